@@ -7,5 +7,15 @@
 #define BMP_HEADER_SIZE 54
 #define BMP_IDX_OFFSET 6
 #define BMP_COUNT_OFFSET 8
+#define BMP_LAYOUT_OFFSET 50
+#define BMP_STRIPE_OFFSET 52
+
+#define DEFAULT_BITS_PER_COLOR 2
+#define DEFAULT_CHANNELS 0xf
+
+#define STRIPE_MIN_SHIFT 12
+#define STRIPE_MAX_SHIFT 24
+
+#define STATS_BUCKETS 32
 
 #define REDIRECT_STDOUT " 2>&1 > /dev/null"
\ No newline at end of file
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "codec.h"
+#include "common.h"
+#include "storage.h"
+#include "extents.h"
+
+// tools that write carriers without the module mark what they wrote, exports show unwritten extents as zeros
+
+static char *extentMapPath(const char *folder) {
+    char *path = malloc(strlen(folder) + 1 + strlen(EXTENTS_NAME) + 1);
+    sprintf(path, "%s/%s", folder, EXTENTS_NAME);
+    return path;
+}
+
+static int writeFull(int fd, const void *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t ret = pwrite(fd, buf, size, offset);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return ret < 0 ? -errno : -EIO;
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+// same checks as the module, a map that doesn't match is ignored
+int openExtentMap(struct ExtentMap *map, const char *folder, ulong size) {
+    struct StgExtentsHeader header;
+    char *path = extentMapPath(folder);
+    ulong bytes;
+
+    memset(map, 0, sizeof(*map));
+    map->fd = open(path, O_RDWR);
+    free(path);
+    if (map->fd < 0) return 0;
+
+    if (pread(map->fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != EXTENTS_MAGIC ||
+            header.version != EXTENTS_VERSION || header.shift < 9 || header.shift > STRIPE_MAX_SHIFT ||
+            header.nrExtents != (size + (1UL << header.shift) - 1) >> header.shift) {
+        printf("written extents map doesn't match the storage, ignoring it\n");
+        goto failed;
+    }
+    map->shift = header.shift;
+    map->nrExtents = header.nrExtents;
+    bytes = (map->nrExtents + 7) / 8;
+    map->bits = malloc(bytes);
+    if (map->bits == NULL || pread(map->fd, map->bits, bytes, sizeof(header)) != (ssize_t) bytes) {
+        printf("ERROR: failed to read written extents map\n");
+        goto failed;
+    }
+    return 0;
+
+failed:
+    free(map->bits);
+    map->bits = NULL;
+    close(map->fd);
+    map->fd = -1;
+    return 0;
+}
+
+void closeExtentMap(struct ExtentMap *map) {
+    if (map->fd < 0) return;
+    close(map->fd);
+    free(map->bits);
+    map->fd = -1;
+    map->bits = NULL;
+}
+
+// every extent the range touches, the map is synced before it returns
+int markExtents(struct ExtentMap *map, ulong position, ulong size) {
+    ulong first, last;
+
+    if (map->fd < 0 || size == 0) return 0;
+
+    first = position >> map->shift;
+    last = min((position + size - 1) >> map->shift, map->nrExtents - 1);
+    for (ulong extent = first; extent <= last; extent++)
+        map->bits[extent / 8] |= 1 << (extent % 8);
+    if (writeFull(map->fd, map->bits + first / 8, last / 8 - first / 8 + 1, sizeof(struct StgExtentsHeader) + first / 8) || fsync(map->fd)) {
+        printf("ERROR: failed to update written extents map\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+// data holds storage bytes from position on
+void zeroUnwritten(struct ExtentMap *map, uint8 *data, ulong position, ulong size) {
+    if (map->fd < 0) return;
+
+    for (ulong done = 0, len; done < size; done += len) {
+        ulong extent = (position + done) >> map->shift;
+        len = min(((extent + 1) << map->shift) - (position + done), size - done);
+        if (extent < map->nrExtents && !(map->bits[extent / 8] & (1 << (extent % 8))))
+            memset(data + done, 0, len);
+    }
+}
+
+// fresh map of an initialized folder, nothing is written yet
+int resetExtentMap(char *folder) {
+    struct Storage storage = {0};
+    struct StgExtentsHeader header = {0};
+    char *path;
+    uint8 *bits;
+    int fd, err;
+
+    if (openStorage(&storage, folder)) return 1;
+    header.magic = EXTENTS_MAGIC;
+    header.version = EXTENTS_VERSION;
+    header.shift = EXTENTS_SHIFT;
+    header.nrExtents = (storage.totalVirtualSize + (1UL << EXTENTS_SHIFT) - 1) >> EXTENTS_SHIFT;
+    closeStorage(&storage);
+
+    path = extentMapPath(folder);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    free(path);
+    if (fd < 0) {
+        printf("ERROR: failed to create written extents map\n");
+        return 1;
+    }
+    bits = calloc(1, (header.nrExtents + 7) / 8);
+    err = writeFull(fd, &header, sizeof(header), 0) || writeFull(fd, bits, (header.nrExtents + 7) / 8, sizeof(header)) || fsync(fd);
+    free(bits);
+    close(fd);
+    if (err) {
+        printf("ERROR: failed to write written extents map\n");
+        return 1;
+    }
+    return 0;
+}
+
+int removeExtentMap(char *folder) {
+    char *path = extentMapPath(folder);
+    int ret = unlink(path);
+    free(path);
+    if (ret && errno != ENOENT) {
+        printf("ERROR: failed to remove written extents map\n");
+        return 1;
+    }
+    return 0;
+}
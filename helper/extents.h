@@ -0,0 +1,23 @@
+#ifndef STG_EXTENTS_H
+#define STG_EXTENTS_H
+
+#include "codec.h"
+
+// written extents map of a folder, see EXTENTS_NAME
+
+struct ExtentMap {
+    int fd; // -1 when the folder has no map, everything counts as written then
+    uint8 shift;
+    ulong nrExtents;
+    uint8 *bits;
+};
+
+int openExtentMap(struct ExtentMap *map, const char *folder, ulong size);
+void closeExtentMap(struct ExtentMap *map);
+int markExtents(struct ExtentMap *map, ulong position, ulong size);
+void zeroUnwritten(struct ExtentMap *map, uint8 *data, ulong position, ulong size);
+
+int resetExtentMap(char *folder);
+int removeExtentMap(char *folder);
+
+#endif
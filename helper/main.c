@@ -1,21 +1,61 @@
 #include "main.h"
 
+struct Options {
+    uint8 bits;
+    uint8 channels;
+    uint8 stripeShift;
+    uint16 queues;   // 0 = default of serve or of the module
+    uint16 depth;
+    int cacheMb;     // -1 = module parameter
+    int writebackMb;
+    uint blockSize;  // 0 = module parameter, or DEFAULT_BLOCK_SIZE without the module
+    uint8 async;
+    uint8 readOnly;
+};
+
 int printHelp() {
-    printf("Usage: stg_helper [mode] [path] [path]\n");
+    printf("Usage: stg_helper [mode] [path] [path] [options]\n");
     printf("    typical modes:\n");
     printf("        init - initializes bitmaps from [sourceFolder] with special header to use them as disk\n");
     printf("            stg_helper init ~/myBmps\n");
+    printf("            --bits [1|2|4] - low bits of every color used for data, default 2\n");
+    printf("            --channels [bgra] - colors used for data, default bgra\n");
+    printf("            --stripe [KiB] - interleave chunks of this size over all bitmaps, power of two from 4 to 16384, default 0 (concatenated)\n");
+    printf("            stg_helper init ~/myBmps --bits 4 --channels bgr\n");
+    printf("            stg_helper init ~/myBmps --stripe 64\n");
     printf("        clean - removes special header from files in [sourceFolder]\n");
     printf("            stg_helper clean ~/myBmps\n");
-    printf("        mount - add and mount a [sourceFolder] to [mountpoint]\n");
+    printf("        mount - add and mount a [sourceFolder] to [mountpoint], takes tuning options of add\n");
     printf("            stg_helper mount ~/myBmps /mnt/stg\n");
     printf("        umount - unmount and remove a disk by [devicePath or mountpoint]\n");
     printf("            stg_helper umount /mnt/stg\n");
     printf("    advanced modes:\n");
     printf("        add - add a disk based on [sourceFolder]\n");
+    printf("            --queues [n] - hardware queues, default one per online cpu\n");
+    printf("            --depth [n] - requests in flight per queue, default 128\n");
+    printf("            --cache-mb [n] - decoded block cache, 0 disables it\n");
+    printf("            --writeback-mb [n] - dirty memory acknowledged before it reaches bitmaps, 0 writes through\n");
+    printf("            --block-size [n] - logical block size, power of two from 512 to 4096\n");
+    printf("            --ro - bitmaps are only read, writes fail\n");
+    printf("            --async - return the name right away, the disk is set up in the background\n");
+    printf("            defaults are module parameters in /sys/module/stg_blkdev/parameters\n");
     printf("            stg_helper add ~/myBmps\n");
+    printf("            stg_helper add ~/myBmps --queues 2 --depth 32 --cache-mb 0\n");
     printf("        remove - remove a disk by [devicePath]\n");
     printf("            stg_helper remove /mnt/stg\n");
+    printf("        import - write a raw [image] into the disk based on [sourceFolder], without the driver\n");
+    printf("            --block-size [n] - logical block size the disk is used with, the image is rounded down to it, default %d\n", DEFAULT_BLOCK_SIZE);
+    printf("            stg_helper import disk.img ~/myBmps\n");
+    printf("        export - read the disk based on [sourceFolder] into a raw [image], without the driver\n");
+    printf("            --block-size [n] - same as for import\n");
+    printf("            stg_helper export ~/myBmps disk.img\n");
+    printf("        stats - print I/O statistics of a disk by [devicePath]\n");
+    printf("            stg_helper stats /dev/stga\n");
+    printf("        serve - serve a disk based on [sourceFolder] from userspace through ublk, until interrupted\n");
+    printf("            --queues [n] - queues, each served by its own thread, default %d\n", DEFAULT_SERVE_QUEUES);
+    printf("            --depth [n] - requests in flight per queue, up to %d of them coded at once, default %d\n", SERVE_MAX_WORKERS, DEFAULT_SERVE_DEPTH);
+    printf("            --block-size [n] - logical block size, power of two from 512 to 4096, default %d\n", DEFAULT_BLOCK_SIZE);
+    printf("            stg_helper serve ~/myBmps --queues 2\n");
     printf("        load - load driver\n");
     printf("            stg_helper load\n");
     printf("        unload - unload driver\n");
@@ -42,6 +82,7 @@ int getBmpColorDepth(FILE *file) {
 struct OpenBmp {
     FILE *file;
     uint16 idx;
+    uint16 depth;
     struct OpenBmp *pnext;
 };
 
@@ -74,9 +115,10 @@ uint16 openBmps(char *folder, struct OpenBmp **openBmpsRef) {
             printf("%s is not a bitmap file, skipping...\n", entry->d_name);
             continue;
         }
-        if (getBmpColorDepth(file) != 32) {
+        int depth = getBmpColorDepth(file);
+        if (depth != 24 && depth != 32) {
             fclose(file);
-            printf("%s is not a 32-bit bitmap file, skipping...\n", entry->d_name);
+            printf("%s is not a 24 or 32-bit bitmap file, skipping...\n", entry->d_name);
             continue;
         }
         if(*openBmpsRef == NULL) {
@@ -87,6 +129,7 @@ uint16 openBmps(char *folder, struct OpenBmp **openBmpsRef) {
             openFilesTail = openFilesTail->pnext;
         }
         openFilesTail->file = file;
+        openFilesTail->depth = depth;
         openFilesTail->idx = bmpCount++;
         if(bmpCount == 0) {
             printf("ERROR: too many files\n");
@@ -107,22 +150,40 @@ void closeBmps(struct OpenBmp *openedBmps) {
     }
 }
 
-int init(char *folder) {
+int init(char *folder, struct Options *options) {
     struct OpenBmp *openedBmps = NULL;
     uint16 bmpsCount = openBmps(folder, &openedBmps);
     struct OpenBmp *openBmp = openedBmps;
+    // 24-bit pixels have no alpha, all of their colors carry data
+    for (; openBmp != NULL; openBmp = openBmp->pnext) {
+        if (openBmp->depth == 24 && (options->channels & 0x7) != 0x7) {
+            printf("ERROR: 24-bit bitmaps need colors 0x7 or 0xf\n");
+            closeBmps(openedBmps);
+            return 1;
+        }
+    }
+    openBmp = openedBmps;
     while (openBmp != NULL) {
         fseek(openBmp->file, BMP_IDX_OFFSET, SEEK_SET);
         fwrite(&openBmp->idx, 1, 2, openBmp->file);
         fwrite(&bmpsCount, 1, 2, openBmp->file);
+        fseek(openBmp->file, BMP_LAYOUT_OFFSET, SEEK_SET);
+        fwrite(&options->bits, 1, 1, openBmp->file);
+        fwrite(&options->channels, 1, 1, openBmp->file);
+        fwrite(&options->stripeShift, 1, 1, openBmp->file);
         openBmp = openBmp->pnext;
     }
-    printf("initialized %d bitmap files\n", bmpsCount);
+    printf("initialized %d bitmap files (%d bits of colors 0x%x)\n", bmpsCount, options->bits, options->channels);
+    if (options->stripeShift)
+        printf("striped in %d KiB chunks\n", 1 << (options->stripeShift - 10));
     if(bmpsCount == 0 && openedBmps != NULL) {
         return 1; // bmpCount overflowed
     }
     closeBmps(openedBmps);
-    return 0;
+    if(bmpsCount == 0) return 0;
+    // the manifest records the folder as it is once the map exists
+    if(resetExtentMap(folder)) return 1;
+    return writeManifest(folder);
 }
 
 int clean(char *folder) {
@@ -133,11 +194,13 @@ int clean(char *folder) {
     while (openBmp != NULL) {
         fseek(openBmp->file, BMP_IDX_OFFSET, SEEK_SET);
         fwrite(&zero, 1, 4, openBmp->file);
+        fseek(openBmp->file, BMP_LAYOUT_OFFSET, SEEK_SET);
+        fwrite(&zero, 1, 3, openBmp->file);
         openBmp = openBmp->pnext;
     }
     printf("cleaned %d bitmap files\n", bmpsCount);
     closeBmps(openedBmps);
-    return 0;
+    return removeExtentMap(folder) || removeManifest(folder);
 }
 
 int isCtlLoaded() {
@@ -182,9 +245,66 @@ int sendIoCtl(int command, char *folder, char **name) {
     return err;
 }
 
-int addDisk(char *folder, char **dev) {
-    int err = sendIoCtl(IOCTL_DEV_ADD, folder, dev);
+// tuned devices are added with StgAddArgs, modules without it still take the bare path of untuned ones
+int sendAddIoCtl(char *folder, char **name, struct Options *options) {
+    struct StgAddArgs args;
+    int err = 0;
+
+    memset(&args, 0, sizeof(args));
+    args.size = sizeof(args);
+    args.version = STG_ADD_VERSION;
+    args.path = (unsigned long) folder;
+    if (options->async) args.flags |= STG_ADD_ASYNC;
+    if (options->readOnly) args.flags |= STG_ADD_READ_ONLY;
+    if (options->queues) {
+        args.valid |= STG_ADD_HW_QUEUES;
+        args.hwQueues = options->queues;
+    }
+    if (options->depth) {
+        args.valid |= STG_ADD_QUEUE_DEPTH;
+        args.queueDepth = options->depth;
+    }
+    if (options->cacheMb >= 0) {
+        args.valid |= STG_ADD_CACHE_MB;
+        args.cacheMb = options->cacheMb;
+    }
+    if (options->writebackMb >= 0) {
+        args.valid |= STG_ADD_WRITEBACK_MB;
+        args.writebackMb = options->writebackMb;
+    }
+    if (options->blockSize) {
+        args.valid |= STG_ADD_BLOCK_SIZE;
+        args.blockSize = options->blockSize;
+    }
+    if (args.valid == 0 && !options->readOnly)
+        return sendIoCtl(options->async ? IOCTL_DEV_ADD_ASYNC : IOCTL_DEV_ADD, folder, name);
+
+    if (strnlen(folder, MAX_BACKING_LEN) >= MAX_BACKING_LEN - 1) {
+        printf("ERROR: path too long\n");
+        return 1;
+    }
+    int fd = open("/dev/stg_manager", O_RDWR);
+    if(fd < 0) {
+        printf("ERROR: failed to open /dev/stg_manager\n");
+        return fd;
+    }
+    err = ioctl(fd, IOCTL_DEV_ADD_ARGS, &args);
+    if(err) {
+        printf("ERROR: module refused the disk or doesn't support tuning options\n");
+    } else {
+        args.name[sizeof(args.name) - 1] = 0;
+        *name = malloc(strlen("/dev/") + strlen(args.name) + 1);
+        sprintf(*name, "/dev/%s", args.name);
+    }
+    close(fd);
+    return err;
+}
+
+int addDisk(char *folder, char **dev, struct Options *options) {
+    int err = sendAddIoCtl(folder, dev, options);
     if(err) return err;
+    // block device doesn't exist yet, its state is listed by the control device
+    if(options->async) return 0;
 
     char* chown1 = "if [[ -v SUDO_USER ]]; then chown $SUDO_USER ";
     char* chown3 = "; else chown $USER";
@@ -204,7 +324,20 @@ int removeDisk(char *deviceFull) {
     return sendIoCtl(IOCTL_DEV_REMOVE, deviceName, NULL);
 }
 
-int autoMount(char *folder, char* mountpoint) {
+// device announces a volatile cache, older modules only when loaded with writeback_mb
+int isWriteBack(char *deviceFull) {
+    char path[64];
+    char mode[16] = {0};
+    snprintf(path, sizeof(path), "/sys/block/%s/queue/write_cache", basename(deviceFull));
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    fread(mode, 1, sizeof(mode) - 1, file);
+    fclose(file);
+    return strncmp(mode, "write back", 10) == 0;
+}
+
+int autoMount(char *folder, char* mountpoint, struct Options *options) {
     int err = 0;
     char* name = NULL;
     if(!isCtlLoaded()) {
@@ -214,7 +347,9 @@ int autoMount(char *folder, char* mountpoint) {
             return err;
         }
     }
-    err = addDisk(folder, &name);
+    // mounting needs the disk right away
+    options->async = 0;
+    err = addDisk(folder, &name, options);
     if(err) {
         printf("ERROR: failed to add disk\n");
         return err;
@@ -233,6 +368,10 @@ int autoMount(char *folder, char* mountpoint) {
     free(isFormattedCmd);
     if(isFormatted) {
         printf("mounting existing ext4 partition\n");
+    } else if(options->readOnly) {
+        printf("ERROR: read-only disk has no ext4 filesystem\n");
+        err = 1;
+        goto failedToFormat;
     } else {
         char *format1 = "mkfs.ext4 -q -m 0 -F ";
         char *formatCmd = malloc(strlen(format1) + strlen(name) + strlen(REDIRECT_STDOUT) + 1);
@@ -256,7 +395,8 @@ int autoMount(char *folder, char* mountpoint) {
         printf("ERROR: failed to create mountpoint\n");
         goto failedToMkdir;
     }
-    char* mount1 = "mount -t ext4 -o sync";
+    // sync would turn every write into a flush and defeat write-back
+    char* mount1 = options->readOnly ? "mount -t ext4 -o ro" : isWriteBack(name) ? "mount -t ext4" : "mount -t ext4 -o sync";
     char* mountCmd = malloc(strlen(mount1) + 1 + strlen(name) + 1 + strlen(mountpoint) + 1);
     sprintf(mountCmd, "%s %s %s", mount1, name, mountpoint);
     err = system(mountCmd);
@@ -347,7 +487,175 @@ int autoUmount(char *folder) {
     }
 }
 
+// upper bound of the log2 bucket below which a fraction of samples fall
+double latencyPercentile(unsigned long long *buckets, unsigned long long samples, double fraction) {
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        seen += buckets[bucket];
+        if (seen > 0 && seen >= samples * fraction)
+            return (double) (2ULL << bucket) / 1000;
+    }
+    return 0;
+}
+
+int printStats(char *deviceFull) {
+    char path[128];
+    char line[1024];
+    char *deviceName = basename(deviceFull);
+
+    snprintf(path, sizeof(path), "/sys/block/%s/stg/counters", deviceName);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("ERROR: failed to open %s\n", path);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[64];
+        unsigned long long value;
+        if (sscanf(line, "%63s %llu", name, &value) == 2)
+            printf("%-20s %llu\n", name, value);
+    }
+    fclose(file);
+
+    snprintf(path, sizeof(path), "/sys/block/%s/stg/latency", deviceName);
+    file = fopen(path, "r");
+    if (file == NULL) {
+        printf("ERROR: failed to open %s\n", path);
+        return 1;
+    }
+    printf("\n%-8s %12s %12s %12s %12s\n", "phase", "samples", "avg us", "p50 us", "p99 us");
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char name[16];
+        unsigned long long samples, total, buckets[STATS_BUCKETS] = {0};
+        int read = 0;
+        char *pos = line;
+        if (sscanf(pos, "%15s %llu %llu%n", name, &samples, &total, &read) != 3)
+            continue;
+        pos += read;
+        for (int bucket = 0; bucket < STATS_BUCKETS && sscanf(pos, "%llu%n", &buckets[bucket], &read) == 1; bucket++)
+            pos += read;
+        printf("%-8s %12llu %12.1f %12.1f %12.1f\n", name, samples,
+               samples ? (double) total / samples / 1000 : 0,
+               latencyPercentile(buckets, samples, 0.5),
+               latencyPercentile(buckets, samples, 0.99));
+    }
+    fclose(file);
+    return 0;
+}
+
+int parseChannels(char *colors) {
+    int channels = 0;
+    for (char *c = colors; *c; c++) {
+        if (*c == 'b') channels |= 1;
+        else if (*c == 'g') channels |= 2;
+        else if (*c == 'r') channels |= 4;
+        else if (*c == 'a') channels |= 8;
+        else return -1;
+    }
+    return channels;
+}
+
+// moves --options out of argv, returns number of remaining arguments or -1
+int parseOptions(int argc, char *argv[], struct Options *options) {
+    int nArgs = 0;
+    options->bits = DEFAULT_BITS_PER_COLOR;
+    options->channels = DEFAULT_CHANNELS;
+    options->stripeShift = 0;
+    options->queues = 0;
+    options->depth = 0;
+    options->cacheMb = -1;
+    options->writebackMb = -1;
+    options->blockSize = 0;
+    options->async = 0;
+    options->readOnly = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--", 2) != 0) {
+            argv[nArgs++] = argv[i];
+            continue;
+        }
+        // flags take no value
+        if (strcmp(argv[i], "--async") == 0) {
+            options->async = 1;
+            continue;
+        }
+        if (strcmp(argv[i], "--ro") == 0) {
+            options->readOnly = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            printf("ERROR: missing value of %s\n", argv[i]);
+            return -1;
+        }
+        char *option = argv[i];
+        char *value = argv[++i];
+        if (strcmp(option, "--bits") == 0) {
+            int bits = atoi(value);
+            if (bits != 1 && bits != 2 && bits != 4) {
+                printf("ERROR: bits must be 1, 2 or 4\n");
+                return -1;
+            }
+            options->bits = bits;
+        } else if (strcmp(option, "--channels") == 0) {
+            int channels = parseChannels(value);
+            if (channels <= 0) {
+                printf("ERROR: channels must be any combination of b, g, r and a\n");
+                return -1;
+            }
+            options->channels = channels;
+        } else if (strcmp(option, "--stripe") == 0) {
+            int kib = atoi(value);
+            int shift = kib > 0 ? __builtin_ctz(kib) + 10 : 0;
+            if (kib < 0 || (kib && ((kib & (kib - 1)) || shift < STRIPE_MIN_SHIFT || shift > STRIPE_MAX_SHIFT))) {
+                printf("ERROR: stripe must be 0 or a power of two between 4 and 16384 KiB\n");
+                return -1;
+            }
+            options->stripeShift = shift;
+        } else if (strcmp(option, "--queues") == 0) {
+            int queues = atoi(value);
+            if (queues <= 0 || queues > 64) {
+                printf("ERROR: queues must be between 1 and 64\n");
+                return -1;
+            }
+            options->queues = queues;
+        } else if (strcmp(option, "--depth") == 0) {
+            int depth = atoi(value);
+            if (depth <= 0 || depth > 1024) {
+                printf("ERROR: depth must be between 1 and 1024\n");
+                return -1;
+            }
+            options->depth = depth;
+        } else if (strcmp(option, "--cache-mb") == 0) {
+            options->cacheMb = atoi(value);
+            if (options->cacheMb < 0) {
+                printf("ERROR: cache must be 0 or more MiB\n");
+                return -1;
+            }
+        } else if (strcmp(option, "--writeback-mb") == 0) {
+            options->writebackMb = atoi(value);
+            if (options->writebackMb < 0) {
+                printf("ERROR: write-back must be 0 or more MiB\n");
+                return -1;
+            }
+        } else if (strcmp(option, "--block-size") == 0) {
+            int size = atoi(value);
+            if (size < 512 || size > 4096 || (size & (size - 1))) {
+                printf("ERROR: block size must be a power of two from 512 to 4096\n");
+                return -1;
+            }
+            options->blockSize = size;
+        } else {
+            printf("ERROR: unknown option %s\n", option);
+            return -1;
+        }
+    }
+    argv[nArgs] = NULL;
+    return nArgs;
+}
+
 int main(int argc, char *argv[]) {
+    struct Options options;
+    argc = parseOptions(argc, argv, &options);
+    if(argc < 0) return 1;
     if(argc < 2) return printHelp();
     int nParams = argc - 2;
 
@@ -357,26 +665,41 @@ int main(int argc, char *argv[]) {
 
     if(strcmp(mode, "init") == 0) {
         if(nParams != 1) return printHelp();
-        return init(folder);
+        return init(folder, &options);
     } else if(strcmp(mode, "clean") == 0) {
         if(nParams != 1) return printHelp();
         return clean(folder);
     } else if(strcmp(mode, "mount") == 0) {
         if(nParams != 2) return printHelp();
-        return autoMount(folder, mountpoint);
+        return autoMount(folder, mountpoint, &options);
     } else if(strcmp(mode, "umount") == 0) {
         if(nParams != 1) return printHelp();
         return autoUmount(folder);
     } else if(strcmp(mode, "add") == 0) {
         if(nParams != 1) return printHelp();
         char* dev;
-        int ret = addDisk(folder, &dev);
+        int ret = addDisk(folder, &dev, &options);
+        if(ret) return ret;
         printf("%s\n", dev);
+        if(options.async) printf("adding, state is in /sys/block/stg_manager/stg/devices\n");
         free(dev);
         return ret;
     } else if(strcmp(mode, "remove") == 0) {
         if(nParams != 1) return printHelp();
         return removeDisk(folder);
+    } else if(strcmp(mode, "stats") == 0) {
+        if(nParams != 1) return printHelp();
+        return printStats(folder);
+    } else if(strcmp(mode, "import") == 0) {
+        if(nParams != 2) return printHelp();
+        return importImage(argv[2], argv[3], options.blockSize ? options.blockSize : DEFAULT_BLOCK_SIZE);
+    } else if(strcmp(mode, "export") == 0) {
+        if(nParams != 2) return printHelp();
+        return exportImage(argv[2], argv[3], options.blockSize ? options.blockSize : DEFAULT_BLOCK_SIZE);
+    } else if(strcmp(mode, "serve") == 0) {
+        if(nParams != 1) return printHelp();
+        return serve(folder, options.queues ? options.queues : DEFAULT_SERVE_QUEUES, options.depth ? options.depth : DEFAULT_SERVE_DEPTH,
+                     options.blockSize ? options.blockSize : DEFAULT_BLOCK_SIZE);
     } else if(strcmp(mode, "load") == 0) {
         if(nParams != 0) return printHelp();
         return loadCtl();
@@ -8,7 +8,13 @@
 #include <libgen.h>
 
 #include "common.h"
+#include "extents.h"
+#include "manifest.h"
+#include "serve.h"
+#include "transfer.h"
 
 #define IOCTL_DEV_ADD 55001
 #define IOCTL_DEV_REMOVE 55002
+#define IOCTL_DEV_ADD_ASYNC 55003
+#define IOCTL_DEV_ADD_ARGS 55004
 #define MAX_BACKING_LEN 1024
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "codec.h"
+#include "common.h"
+#include "storage.h"
+#include "manifest.h"
+
+// lists carriers of an initialized folder, so the module opens them without a scan
+// the module checks it against the folder and scans it anyway once it's stale
+
+static char *manifestPath(const char *folder) {
+    char *path = malloc(strlen(folder) + 1 + strlen(MANIFEST_NAME) + 1);
+    sprintf(path, "%s/%s", folder, MANIFEST_NAME);
+    return path;
+}
+
+// generation of the manifest being replaced, 0 if there is none
+static u64 previousGeneration(int fd) {
+    struct StgManifestHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != MANIFEST_MAGIC)
+        return 0;
+    return header.generation;
+}
+
+static int writeFull(int fd, const void *buf, size_t size) {
+    while (size > 0) {
+        ssize_t ret = write(fd, buf, size);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return ret < 0 ? -errno : -EIO;
+        buf += ret;
+        size -= ret;
+    }
+    return 0;
+}
+
+int writeManifest(char *folder) {
+    struct Storage storage = {0};
+    struct StgManifestHeader *header;
+    struct stat st;
+    char *path;
+    uint8 *buf;
+    ulong size = sizeof(struct StgManifestHeader), pos;
+    int fd;
+
+    if (openStorage(&storage, folder)) return 1;
+
+    for (uint idx = 0; idx < storage.count; idx++) {
+        size_t nameLen = strlen(storage.bmps[idx].name);
+        if (nameLen > MANIFEST_NAME_MAX) {
+            printf("ERROR: name of %s is too long for the manifest\n", storage.bmps[idx].name);
+            closeStorage(&storage);
+            return 1;
+        }
+        size += sizeof(struct StgManifestEntry) + nameLen;
+    }
+    buf = calloc(1, size);
+
+    // the folder changes when the manifest is created, its time is taken after that
+    path = manifestPath(folder);
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd < 0 || stat(folder, &st)) {
+        printf("ERROR: failed to create the manifest\n");
+        goto failed;
+    }
+
+    header = (struct StgManifestHeader *) buf;
+    header->magic = MANIFEST_MAGIC;
+    header->version = MANIFEST_VERSION;
+    header->count = storage.count;
+    header->generation = previousGeneration(fd) + 1;
+    header->size = size;
+    header->folderMtime = (u64) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    header->bits = storage.layout.bits;
+    header->channels = storage.layout.channels;
+    header->stripeShift = storage.stripeShift;
+
+    pos = sizeof(struct StgManifestHeader);
+    for (uint idx = 0; idx < storage.count; idx++) {
+        struct CarrierFile *bmp = &storage.bmps[idx];
+        struct StgManifestEntry *entry = (struct StgManifestEntry *) (buf + pos);
+
+        if (fstat(bmp->fd, &st)) {
+            printf("ERROR: failed to stat %s\n", bmp->name);
+            goto failed;
+        }
+        entry->fileSize = st.st_size;
+        entry->ino = st.st_ino;
+        entry->mtime = (u64) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        // striped storages even out sizes later, the manifest keeps what every carrier holds
+        entry->virtualSize = carrierCapacity(bmp->layout, bmp->width, bmp->height, bmp->rowGroups);
+        entry->width = bmp->width;
+        entry->height = bmp->height;
+        entry->headerSize = bmp->headerSize;
+        entry->idx = bmp->idx;
+        entry->depth = bmp->depth;
+        entry->nameLen = strlen(bmp->name);
+        pos += sizeof(struct StgManifestEntry);
+        memcpy(buf + pos, bmp->name, entry->nameLen);
+        pos += entry->nameLen;
+    }
+    header->checksum = manifestChecksum(MANIFEST_CHECKSUM_INIT, buf, size);
+
+    // rewritten in place, so the folder keeps the time recorded above
+    if (ftruncate(fd, 0) || writeFull(fd, buf, size) || fsync(fd)) {
+        printf("ERROR: failed to write the manifest\n");
+        goto failed;
+    }
+    printf("wrote manifest of generation %lu\n", (ulong) header->generation);
+    close(fd);
+    free(buf);
+    closeStorage(&storage);
+    return 0;
+
+failed:
+    if (fd >= 0) close(fd);
+    free(buf);
+    closeStorage(&storage);
+    return 1;
+}
+
+int removeManifest(char *folder) {
+    char *path = manifestPath(folder);
+    int ret = unlink(path);
+    free(path);
+    if (ret && errno != ENOENT) {
+        printf("ERROR: failed to remove the manifest\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+#ifndef STG_MANIFEST_H
+#define STG_MANIFEST_H
+
+int writeManifest(char *folder);
+int removeManifest(char *folder);
+
+#endif
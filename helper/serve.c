@@ -0,0 +1,719 @@
+#define _GNU_SOURCE // cpu sets and thread affinity
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/ublk_cmd.h>
+
+#include "uring.h"
+#include "codec.h"
+#include "common.h"
+#include "storage.h"
+#include "extents.h"
+#include "serve.h"
+
+// same storage as the module, served from userspace through the ublk driver
+// every queue has a thread with a ring for ublk commands, it hands requests to workers of the queue
+// workers code requests in parallel, each with a ring for carrier I/O, carriers of one request are read and written in parallel
+// finished requests are passed back through an eventfd, only the queue thread may commit them to the driver
+
+#define UBLK_CONTROL "/dev/ublk-control"
+#define UBLK_CHAR "/dev/ublkc"
+#define UBLK_BLOCK "/dev/ublkb"
+
+#define SERVE_MAX_IO (512 * 1024) // bytes of one request, same as carrier chunks of the module
+#define SERVE_MAX_CARRIER_IO 256  // carrier operations in flight per worker
+#define SERVE_EDGE_LOCKS 64
+
+// carrier I/O completions carry the index of the span, commands carry the tag
+#define CARRIER_DATA (1ULL << 63)
+#define QUEUE_EVENT (1ULL << 62)
+
+// part of a request served by one carrier
+struct ServeSpan {
+    struct CarrierFile *bmp;
+    ulong position;  // in the payload of the carrier
+    ulong size;
+    ulong skip;      // payload bytes of the first group before position
+    ulong group;     // holding position
+    uint8 *carrier;  // that group, in the extent of the carrier
+};
+
+// carrier range read and written for a request, covers all its spans in that carrier
+// chunks of a striped storage may share a group at their border, so they share one extent
+struct ServeExtent {
+    struct CarrierFile *bmp;
+    ulong group;
+    ulong groups;
+    uint8 *carrier;  // scratch of the worker
+};
+
+// codes one request at a time
+struct ServeWorker {
+    struct Server *server;
+    struct ServeQueue *queue;
+    pthread_t thread;
+    struct Uring io;
+    uint8 *scratch;  // carrier ranges of the request
+    struct ServeSpan *spans;
+    struct ServeExtent *extents;
+    uint nExtents;
+};
+
+struct ServeQueue {
+    struct Server *server;
+    uint16 id;
+    pthread_t thread;
+    cpu_set_t affinity;
+    struct Uring cmd;
+    struct ublksrv_io_desc *descs;
+    uint8 *buffers;  // depth * SERVE_MAX_IO, the driver copies request pages to and from them
+    struct ServeWorker *workers;
+    uint16 nrWorkers;
+
+    // tags fetched and not yet taken by a worker, and tags done and not yet committed, both under lock
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    uint16 *pending;
+    uint16 pendingHead;
+    uint16 nrPending;
+    uint16 *doneTags;
+    int *doneResults;
+    uint16 nrDone;
+    bool stopping;
+    int eventFd;     // written by workers once they put a tag in done
+    __u64 events;    // read by the ring of commands
+};
+
+struct Server {
+    struct Storage storage;
+
+    int ctlFd;
+    int charFd;
+    struct Uring ctl;
+    struct ublksrv_ctrl_dev_info info;
+    struct ServeQueue *queues;
+    size_t scratchSize;
+    uint maxSpans;      // one per carrier, or per chunk of a striped request
+    uint blockSize;     // logical, the storage keeps what it was formatted with
+    pthread_mutex_t edgeLocks[SERVE_EDGE_LOCKS];
+};
+
+//// requests
+
+// the extent of a carrier, a new one if the request didn't touch it yet
+static struct ServeExtent *findExtent(struct ServeWorker *worker, struct CarrierFile *bmp, ulong group) {
+    struct ServeExtent *extent;
+
+    for (uint i = 0; i < worker->nExtents; i++)
+        if (worker->extents[i].bmp == bmp)
+            return &worker->extents[i];
+    extent = &worker->extents[worker->nExtents++];
+    extent->bmp = bmp;
+    extent->group = group;
+    extent->groups = 0;
+    return extent;
+}
+
+// splits a request into carrier spans and their extents, returns the number of spans
+static uint mapSpans(struct ServeWorker *worker, ulong size, ulong position) {
+    struct Server *server = worker->server;
+    uint8 *carrier = worker->scratch;
+    uint n = 0;
+
+    if (position + size > server->storage.totalVirtualSize)
+        return 0;
+    worker->nExtents = 0;
+    while (size > 0) {
+        struct ServeSpan *span = &worker->spans[n++];
+        const struct StgLayout *layout;
+        struct ServeExtent *extent;
+        ulong local, len, end;
+
+        span->bmp = storageLocate(&server->storage, position, &local, &len);
+        layout = span->bmp->layout;
+        span->position = local;
+        span->size = min(size, len);
+        span->skip = local % layout->groupBytes;
+
+        // spans of a carrier come in order and without gaps
+        span->group = local / layout->groupBytes;
+        end = (local + span->size + layout->groupBytes - 1) / layout->groupBytes;
+        extent = findExtent(worker, span->bmp, span->group);
+        extent->groups = end - extent->group;
+
+        position += span->size;
+        size -= span->size;
+    }
+
+    for (uint i = 0; i < worker->nExtents; i++) {
+        struct ServeExtent *extent = &worker->extents[i];
+        extent->carrier = carrier;
+        carrier += carrierGroupSpan(extent->bmp, extent->group, extent->groups);
+    }
+    for (uint i = 0; i < n; i++) {
+        struct ServeSpan *span = &worker->spans[i];
+        struct ServeExtent *extent = findExtent(worker, span->bmp, 0);
+        span->carrier = extent->carrier + carrierGroupOffset(span->bmp, span->group) - carrierGroupOffset(span->bmp, extent->group);
+    }
+    return n;
+}
+
+// runs one carrier operation per extent and waits for all of them
+static int carrierIo(struct ServeWorker *worker, int opcode) {
+    uint next = 0, pending = 0;
+    int err = 0;
+
+    while (next < worker->nExtents || pending > 0) {
+        struct io_uring_sqe *sqe;
+        struct io_uring_cqe *cqe;
+
+        while (next < worker->nExtents && pending <= worker->io.sqMask && ( sqe = uringGetSqe(&worker->io) ) != NULL) {
+            struct ServeExtent *extent = &worker->extents[next];
+            struct CarrierFile *bmp = extent->bmp;
+            sqe->opcode = opcode;
+            sqe->fd = bmp->fd;
+            if (opcode != IORING_OP_FSYNC) {
+                sqe->off = carrierGroupOffset(bmp, extent->group);
+                sqe->addr = (__u64) extent->carrier;
+                sqe->len = carrierGroupSpan(bmp, extent->group, extent->groups);
+            }
+            sqe->user_data = CARRIER_DATA | next++;
+            pending++;
+        }
+        uringSubmit(&worker->io, 1);
+
+        while (( cqe = uringPeekCqe(&worker->io) ) != NULL) {
+            struct ServeExtent *extent = &worker->extents[cqe->user_data & ~CARRIER_DATA];
+            if (cqe->res < 0)
+                err = cqe->res;
+            else if (opcode != IORING_OP_FSYNC && (ulong) cqe->res != carrierGroupSpan(extent->bmp, extent->group, extent->groups))
+                err = -EIO; // short transfer, carrier shrank under us
+            uringCqeSeen(&worker->io);
+            pending--;
+        }
+    }
+    return err;
+}
+
+static int cmpUint(const void *a, const void *b) {
+    return *(const uint *) a - *(const uint *) b;
+}
+
+// groups shared with neighbouring requests are read, patched and written back, the same as edge locks of the module
+static uint edgeLocks(struct ServeWorker *worker, uint n, uint *locks) {
+    uint count = 0, unique = 0;
+
+    for (uint i = 0; i < n; i++) {
+        struct ServeSpan *span = &worker->spans[i];
+        const struct StgLayout *layout = span->bmp->layout;
+        ulong first = span->position / layout->groupBytes;
+        ulong last = (span->position + span->size - 1) / layout->groupBytes;
+        if (span->skip)
+            locks[count++] = (span->bmp->idx * 31 + first) % SERVE_EDGE_LOCKS;
+        if ((span->position + span->size) % layout->groupBytes)
+            locks[count++] = (span->bmp->idx * 31 + last) % SERVE_EDGE_LOCKS;
+    }
+    // always taken in the same order
+    qsort(locks, count, sizeof(uint), cmpUint);
+    for (uint i = 0; i < count; i++)
+        if (unique == 0 || locks[unique - 1] != locks[i])
+            locks[unique++] = locks[i];
+    return unique;
+}
+
+static int handleRead(struct ServeWorker *worker, uint n, uint8 *data) {
+    int err = carrierIo(worker, IORING_OP_READ);
+    if (err) return err;
+    for (uint i = 0; i < n; i++) {
+        struct ServeSpan *span = &worker->spans[i];
+        struct CarrierFile *bmp = span->bmp;
+        codecDecodeRows(bmp->layout, bmp->rowSize, bmp->rowGroups, data, span->carrier, span->group, span->skip, span->size);
+        data += span->size;
+    }
+    return 0;
+}
+
+static int handleWrite(struct ServeWorker *worker, uint n, const uint8 *data) {
+    struct Server *server = worker->server;
+    uint locks[2 * n];
+    uint nLocks = edgeLocks(worker, n, locks);
+    int err;
+
+    for (uint i = 0; i < nLocks; i++)
+        pthread_mutex_lock(&server->edgeLocks[locks[i]]);
+    if (( err = carrierIo(worker, IORING_OP_READ) )) goto unlock;
+    for (uint i = 0; i < n; i++) {
+        struct ServeSpan *span = &worker->spans[i];
+        struct CarrierFile *bmp = span->bmp;
+        if (data) {
+            codecEncodeRows(bmp->layout, bmp->rowSize, bmp->rowGroups, data, span->carrier, span->group, span->skip, span->size);
+            data += span->size;
+        } else {
+            codecZeroRows(bmp->layout, bmp->rowSize, bmp->rowGroups, span->carrier, span->group, span->skip, span->size);
+        }
+    }
+    err = carrierIo(worker, IORING_OP_WRITE);
+unlock:
+    for (uint i = nLocks; i > 0; i--)
+        pthread_mutex_unlock(&server->edgeLocks[locks[i - 1]]);
+    return err;
+}
+
+static int handleFlush(struct ServeWorker *worker) {
+    struct Server *server = worker->server;
+    for (uint idx = 0; idx < server->storage.count; idx++)
+        worker->extents[idx].bmp = &server->storage.bmps[idx];
+    worker->nExtents = server->storage.count;
+    return carrierIo(worker, IORING_OP_FSYNC);
+}
+
+// result for the driver, bytes done or negative errno
+static int handleRequest(struct ServeWorker *worker, uint16 tag) {
+    const struct ublksrv_io_desc *desc = &worker->queue->descs[tag];
+    uint8 *data = worker->queue->buffers + (size_t) tag * SERVE_MAX_IO;
+    ulong size = (ulong) desc->nr_sectors << 9;
+    ulong position = desc->start_sector << 9;
+    uint op = ublksrv_get_op(desc);
+    uint n;
+    int err;
+
+    if (op == UBLK_IO_OP_FLUSH)
+        return handleFlush(worker);
+    if (op == UBLK_IO_OP_DISCARD) // carriers can't drop anything, same as the module
+        return 0;
+    if (size == 0)
+        return 0;
+
+    n = mapSpans(worker, size, position);
+    if (n == 0)
+        return -EIO;
+    switch (op) {
+        case UBLK_IO_OP_READ: err = handleRead(worker, n, data); break;
+        case UBLK_IO_OP_WRITE: err = handleWrite(worker, n, data); break;
+        case UBLK_IO_OP_WRITE_ZEROES: err = handleWrite(worker, n, NULL); break;
+        default: return -EOPNOTSUPP;
+    }
+    return err ? err : (int) size;
+}
+
+//// queues
+
+static void queueCmd(struct ServeQueue *queue, uint cmdOp, uint16 tag, int result) {
+    struct io_uring_sqe *sqe = uringGetSqe(&queue->cmd);
+    struct ublksrv_io_cmd *cmd = (struct ublksrv_io_cmd *) sqe->cmd;
+
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = queue->server->charFd;
+    sqe->cmd_op = cmdOp;
+    sqe->user_data = tag;
+    cmd->q_id = queue->id;
+    cmd->tag = tag;
+    cmd->result = result;
+    cmd->addr = (__u64) (queue->buffers + (size_t) tag * SERVE_MAX_IO);
+}
+
+// completes once a worker finished a request or the queue is asked to stop
+static void queueWaitEvent(struct ServeQueue *queue) {
+    struct io_uring_sqe *sqe = uringGetSqe(&queue->cmd);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = queue->eventFd;
+    sqe->addr = (__u64) &queue->events;
+    sqe->len = sizeof(queue->events);
+    sqe->user_data = QUEUE_EVENT;
+}
+
+// commits every request workers finished, returns false once the queue has to stop
+static bool queueCommitDone(struct ServeQueue *queue) {
+    bool stopping;
+
+    pthread_mutex_lock(&queue->lock);
+    for (uint16 i = 0; i < queue->nrDone; i++)
+        queueCmd(queue, UBLK_IO_COMMIT_AND_FETCH_REQ, queue->doneTags[i], queue->doneResults[i]);
+    queue->nrDone = 0;
+    stopping = queue->stopping;
+    pthread_mutex_unlock(&queue->lock);
+    return !stopping;
+}
+
+static void queueStop(struct ServeQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = true;
+    pthread_cond_broadcast(&queue->work);
+    pthread_mutex_unlock(&queue->lock);
+    eventfd_write(queue->eventFd, 1);
+}
+
+static void *workerThread(void *data) {
+    struct ServeWorker *worker = data;
+    struct ServeQueue *queue = worker->queue;
+    uint16 depth = queue->server->info.queue_depth;
+
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &queue->affinity);
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        uint16 tag;
+        int res;
+
+        while (queue->nrPending == 0 && !queue->stopping)
+            pthread_cond_wait(&queue->work, &queue->lock);
+        if (queue->nrPending == 0)
+            break;
+        tag = queue->pending[queue->pendingHead];
+        queue->pendingHead = (queue->pendingHead + 1) % depth;
+        queue->nrPending--;
+        pthread_mutex_unlock(&queue->lock);
+
+        res = handleRequest(worker, tag);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->doneTags[queue->nrDone] = tag;
+        queue->doneResults[queue->nrDone++] = res;
+        eventfd_write(queue->eventFd, 1);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+static void *queueThread(void *data) {
+    struct ServeQueue *queue = data;
+    uint16 depth = queue->server->info.queue_depth;
+    uint dead = 0;
+
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &queue->affinity);
+    for (uint16 i = 0; i < queue->nrWorkers; i++)
+        pthread_create(&queue->workers[i].thread, NULL, workerThread, &queue->workers[i]);
+    for (uint16 tag = 0; tag < depth; tag++)
+        queueCmd(queue, UBLK_IO_FETCH_REQ, tag, -1);
+    queueWaitEvent(queue);
+
+    // stopping the device aborts every fetch, the queue ends once all tags are gone
+    while (dead < depth) {
+        struct io_uring_cqe *cqe;
+        bool running = true;
+
+        if (uringSubmit(&queue->cmd, 1) < 0) break;
+        while (( cqe = uringPeekCqe(&queue->cmd) ) != NULL) {
+            __u64 userData = cqe->user_data;
+            int res = cqe->res;
+            uringCqeSeen(&queue->cmd);
+            if (userData == QUEUE_EVENT) {
+                running = queueCommitDone(queue);
+                if (running) queueWaitEvent(queue);
+            } else if (res == UBLK_IO_RES_OK) {
+                pthread_mutex_lock(&queue->lock);
+                queue->pending[(queue->pendingHead + queue->nrPending++) % depth] = userData;
+                pthread_cond_signal(&queue->work);
+                pthread_mutex_unlock(&queue->lock);
+            } else {
+                dead++;
+            }
+        }
+        if (!running) break;
+    }
+
+    queueStop(queue);
+    for (uint16 i = 0; i < queue->nrWorkers; i++)
+        pthread_join(queue->workers[i].thread, NULL);
+    return NULL;
+}
+
+static int initWorker(struct Server *server, struct ServeQueue *queue, struct ServeWorker *worker) {
+    int err;
+
+    worker->server = server;
+    worker->queue = queue;
+    if (( err = uringInit(&worker->io, min(server->storage.count, SERVE_MAX_CARRIER_IO), 0) )) return err;
+    worker->scratch = malloc(server->scratchSize);
+    worker->spans = calloc(server->maxSpans, sizeof(struct ServeSpan));
+    worker->extents = calloc(server->maxSpans, sizeof(struct ServeExtent));
+    if (!worker->scratch || !worker->spans || !worker->extents) {
+        free(worker->scratch);
+        free(worker->spans);
+        free(worker->extents);
+        uringExit(&worker->io);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void freeWorker(struct ServeWorker *worker) {
+    free(worker->scratch);
+    free(worker->spans);
+    free(worker->extents);
+    uringExit(&worker->io);
+}
+
+static int initQueue(struct Server *server, struct ServeQueue *queue, uint16 id) {
+    uint16 depth = server->info.queue_depth;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t descsSize = (depth * sizeof(struct ublksrv_io_desc) + pageSize - 1) / pageSize * pageSize;
+    size_t maxDescsSize = (UBLK_MAX_QUEUE_DEPTH * sizeof(struct ublksrv_io_desc) + pageSize - 1) / pageSize * pageSize;
+    int err;
+
+    queue->server = server;
+    queue->id = id;
+    // every tag and the read of the eventfd
+    if (( err = uringInit(&queue->cmd, depth + 1, IORING_SETUP_SQE128) )) return err;
+    queue->eventFd = eventfd(0, EFD_CLOEXEC);
+    if (queue->eventFd < 0) {
+        err = -errno;
+        goto failedEventFd;
+    }
+
+    queue->descs = mmap(NULL, descsSize, PROT_READ, MAP_SHARED | MAP_POPULATE, server->charFd,
+                        UBLKSRV_CMD_BUF_OFFSET + id * maxDescsSize);
+    if (queue->descs == MAP_FAILED) {
+        err = -errno;
+        goto failedDescs;
+    }
+    queue->buffers = aligned_alloc(pageSize, (size_t) depth * SERVE_MAX_IO);
+    queue->pending = calloc(depth, sizeof(uint16));
+    queue->doneTags = calloc(depth, sizeof(uint16));
+    queue->doneResults = calloc(depth, sizeof(int));
+    queue->workers = calloc(min(depth, SERVE_MAX_WORKERS), sizeof(struct ServeWorker));
+    if (!queue->buffers || !queue->pending || !queue->doneTags || !queue->doneResults || !queue->workers) {
+        err = -ENOMEM;
+        goto failedAlloc;
+    }
+    for (queue->nrWorkers = 0; queue->nrWorkers < min(depth, SERVE_MAX_WORKERS); queue->nrWorkers++)
+        if (( err = initWorker(server, queue, &queue->workers[queue->nrWorkers]) )) goto failedWorkers;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->work, NULL);
+    return 0;
+
+failedWorkers:
+    while (queue->nrWorkers-- > 0)
+        freeWorker(&queue->workers[queue->nrWorkers]);
+failedAlloc:
+    free(queue->buffers);
+    free(queue->pending);
+    free(queue->doneTags);
+    free(queue->doneResults);
+    free(queue->workers);
+    munmap(queue->descs, descsSize);
+failedDescs:
+    close(queue->eventFd);
+failedEventFd:
+    uringExit(&queue->cmd);
+    return err;
+}
+
+static void freeQueue(struct Server *server, struct ServeQueue *queue) {
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t descsSize = (server->info.queue_depth * sizeof(struct ublksrv_io_desc) + pageSize - 1) / pageSize * pageSize;
+
+    for (uint16 i = 0; i < queue->nrWorkers; i++)
+        freeWorker(&queue->workers[i]);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->work);
+    free(queue->buffers);
+    free(queue->pending);
+    free(queue->doneTags);
+    free(queue->doneResults);
+    free(queue->workers);
+    munmap(queue->descs, descsSize);
+    close(queue->eventFd);
+    uringExit(&queue->cmd);
+}
+
+//// control
+
+static int controlCmd(struct Server *server, uint cmdOp, uint16 queueId, void *buf, uint16 len, __u64 data) {
+    struct io_uring_sqe *sqe = uringGetSqe(&server->ctl);
+    struct ublksrv_ctrl_cmd *cmd = (struct ublksrv_ctrl_cmd *) sqe->cmd;
+    struct io_uring_cqe *cqe;
+    int res;
+
+    sqe->opcode = IORING_OP_URING_CMD;
+    sqe->fd = server->ctlFd;
+    sqe->cmd_op = cmdOp;
+    cmd->dev_id = server->info.dev_id;
+    cmd->queue_id = queueId;
+    cmd->addr = (__u64) buf;
+    cmd->len = len;
+    cmd->data[0] = data;
+
+    uringSubmit(&server->ctl, 1);
+    while (( cqe = uringPeekCqe(&server->ctl) ) == NULL)
+        uringSubmit(&server->ctl, 1);
+    res = cqe->res;
+    uringCqeSeen(&server->ctl);
+    return res;
+}
+
+// request cuts at every carrier boundary of a concatenated storage, same as the module
+static ulong serveCarrierChunk(struct Storage *storage, uint blockSize) {
+    ulong gcd = 0, smallest = ULONG_MAX;
+
+    if (storage->stripeShift || storage->count < 2) return 0;
+    for (uint idx = 0; idx < storage->count; idx++) {
+        if (storage->bmps[idx].virtualSize == 0) continue;
+        gcd = sizeGcd(gcd, storage->bmps[idx].virtualSize);
+        smallest = min(smallest, storage->bmps[idx].virtualSize);
+    }
+    return carrierChunk(gcd, smallest, SERVE_MAX_IO, blockSize);
+}
+
+static int setParams(struct Server *server) {
+    struct ublk_params params;
+    ulong chunk = serveCarrierChunk(&server->storage, server->blockSize);
+    memset(&params, 0, sizeof(params));
+    params.len = sizeof(params);
+    params.types = UBLK_PARAM_TYPE_BASIC | UBLK_PARAM_TYPE_DISCARD;
+
+    // carriers are written through their page cache, flushes sync them
+    params.basic.attrs = UBLK_ATTR_VOLATILE_CACHE;
+    // carriers are coded in 4 KiB pages, smaller logical blocks are rewritten with the rest of their page
+    params.basic.logical_bs_shift = __builtin_ctz(server->blockSize);
+    params.basic.physical_bs_shift = 12;
+    params.basic.io_opt_shift = 19; // SERVE_MAX_IO, one request per buffer
+    params.basic.io_min_shift = 12;
+    params.basic.max_sectors = SERVE_MAX_IO >> 9;
+    params.basic.dev_sectors = server->storage.totalVirtualSize / server->blockSize * server->blockSize >> 9;
+    if (server->storage.stripeShift)
+        params.basic.chunk_sectors = 1U << (server->storage.stripeShift - 9);
+    else if (chunk && chunk >> 9 <= UINT_MAX)
+        params.basic.chunk_sectors = chunk >> 9;
+
+    params.discard.discard_granularity = 4096;
+    params.discard.max_discard_sectors = SERVE_MAX_IO >> 9;
+    params.discard.max_write_zeroes_sectors = SERVE_MAX_IO >> 9;
+    params.discard.max_discard_segments = 1;
+
+    return controlCmd(server, UBLK_CMD_SET_PARAMS, -1, &params, sizeof(params), 0);
+}
+
+static int openCharDevice(struct Server *server) {
+    char path[32];
+    snprintf(path, sizeof(path), UBLK_CHAR "%u", server->info.dev_id);
+    // udev creates the node shortly after the device is added
+    for (int i = 0; i < 100; i++) {
+        server->charFd = open(path, O_RDWR);
+        if (server->charFd >= 0) return 0;
+        usleep(10000);
+    }
+    printf("ERROR: failed to open %s\n", path);
+    return -ENODEV;
+}
+
+int serve(char *folder, uint16 nrQueues, uint16 depth, uint blockSize) {
+    struct Server server;
+    struct ExtentMap extents;
+    sigset_t signals;
+    uint16 q;
+    int sig;
+    int err;
+
+    memset(&server, 0, sizeof(server));
+    server.blockSize = blockSize;
+    codecInit();
+    if (( err = openStorage(&server.storage, folder) )) return 1;
+    printf("serving %lu B from %d bitmaps\n", server.storage.totalVirtualSize, server.storage.count);
+    // writes aren't tracked here, so the module has to read everything from carriers afterwards
+    openExtentMap(&extents, folder, server.storage.totalVirtualSize);
+    if (extents.fd >= 0) {
+        printf("written extents aren't tracked while serving, all of them are marked written\n");
+        err = markExtents(&extents, 0, server.storage.totalVirtualSize);
+        closeExtentMap(&extents);
+        if (err) goto failedControl;
+    }
+    for (uint i = 0; i < SERVE_EDGE_LOCKS; i++)
+        pthread_mutex_init(&server.edgeLocks[i], NULL);
+    server.maxSpans = server.storage.count + (SERVE_MAX_IO >> STRIPE_MIN_SHIFT) + 1;
+    // extents of 24-bit carriers also hold the ends of their rows
+    for (uint idx = 0; idx < server.storage.count; idx++) {
+        struct CarrierFile *bmp = &server.storage.bmps[idx];
+        ulong groups = SERVE_MAX_IO / bmp->layout->groupBytes + 2 * server.maxSpans;
+        ulong size = bmp->rowGroups ? (groups / bmp->rowGroups + 2 * server.maxSpans) * bmp->rowSize : groups * bmp->layout->groupSize;
+        if (size > server.scratchSize) server.scratchSize = size;
+    }
+
+    server.ctlFd = open(UBLK_CONTROL, O_RDWR);
+    if (server.ctlFd < 0) {
+        printf("ERROR: failed to open " UBLK_CONTROL ", is ublk_drv loaded?\n");
+        err = -ENODEV;
+        goto failedControl;
+    }
+    if (( err = uringInit(&server.ctl, 4, IORING_SETUP_SQE128) )) {
+        printf("ERROR: failed to set up io_uring (%d)\n", err);
+        goto failedControlRing;
+    }
+
+    server.info.nr_hw_queues = nrQueues;
+    server.info.queue_depth = depth;
+    server.info.max_io_buf_bytes = SERVE_MAX_IO;
+    server.info.dev_id = -1;
+    if (( err = controlCmd(&server, UBLK_CMD_ADD_DEV, -1, &server.info, sizeof(server.info), 0) )) {
+        printf("ERROR: failed to add ublk device (%d)\n", err);
+        goto failedAdd;
+    }
+    if (( err = setParams(&server) )) {
+        printf("ERROR: failed to set device parameters (%d)\n", err);
+        goto failedParams;
+    }
+    if (( err = openCharDevice(&server) )) goto failedParams;
+
+    server.queues = calloc(nrQueues, sizeof(struct ServeQueue));
+    for (q = 0; q < nrQueues; q++) {
+        if (( err = initQueue(&server, &server.queues[q], q) )) {
+            printf("ERROR: failed to set up queue %d (%d)\n", q, err);
+            goto failedQueues;
+        }
+        CPU_ZERO(&server.queues[q].affinity);
+        controlCmd(&server, UBLK_CMD_GET_QUEUE_AFFINITY, q, &server.queues[q].affinity, sizeof(cpu_set_t), 0);
+    }
+
+    // only the main thread takes signals, queues run until the device stops
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    for (q = 0; q < nrQueues; q++)
+        pthread_create(&server.queues[q].thread, NULL, queueThread, &server.queues[q]);
+
+    // waits until every queue fetches all its tags
+    if (( err = controlCmd(&server, UBLK_CMD_START_DEV, -1, NULL, 0, getpid()) )) {
+        // stopping a device that never started doesn't abort fetches, queues leave them to the closing rings
+        printf("ERROR: failed to start device (%d)\n", err);
+        for (q = 0; q < nrQueues; q++)
+            queueStop(&server.queues[q]);
+        for (q = 0; q < nrQueues; q++)
+            pthread_join(server.queues[q].thread, NULL);
+        q = nrQueues;
+        goto failedQueues;
+    }
+    printf(UBLK_BLOCK "%u\n", server.info.dev_id);
+    fflush(stdout);
+    sigwait(&signals, &sig);
+
+    controlCmd(&server, UBLK_CMD_STOP_DEV, -1, NULL, 0, 0);
+    for (q = 0; q < nrQueues; q++)
+        pthread_join(server.queues[q].thread, NULL);
+    q = nrQueues;
+failedQueues:
+    while (q-- > 0)
+        freeQueue(&server, &server.queues[q]);
+    free(server.queues);
+    close(server.charFd);
+failedParams:
+    controlCmd(&server, UBLK_CMD_DEL_DEV, -1, NULL, 0, 0);
+failedAdd:
+    uringExit(&server.ctl);
+failedControlRing:
+    close(server.ctlFd);
+failedControl:
+    closeStorage(&server.storage);
+    return err ? 1 : 0;
+}
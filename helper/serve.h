@@ -0,0 +1,10 @@
+#ifndef STG_SERVE_H
+#define STG_SERVE_H
+
+#define DEFAULT_SERVE_QUEUES 4
+#define DEFAULT_SERVE_DEPTH 64
+#define SERVE_MAX_WORKERS 8 // coding requests of a queue, every one holds carrier ranges of a whole request
+
+int serve(char *folder, uint16 nrQueues, uint16 depth, uint blockSize);
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "codec.h"
+#include "common.h"
+#include "storage.h"
+
+static int readField(int fd, void *buf, size_t size, off_t offset) {
+    return pread(fd, buf, size, offset) == (ssize_t) size ? 0 : -EIO;
+}
+
+// the same checks as handleFile in the module, so both accept the same folders
+static int openCarrier(struct Storage *storage, const char *folder, const char *name) {
+    char *path = malloc(strlen(folder) + 1 + strlen(name) + 1);
+    struct CarrierFile bmp = {0};
+    uint8 magic[2], bits, channels, stripeShift;
+    uint16 depth, count;
+    int err = 0;
+
+    sprintf(path, "%s/%s", folder, name);
+    bmp.fd = open(path, O_RDWR);
+    free(path);
+    if (bmp.fd < 0) {
+        printf("ERROR: failed to open file %s\n", name);
+        return -errno;
+    }
+
+    if (readField(bmp.fd, magic, 2, 0) || magic[0] != 'B' || magic[1] != 'M' ||
+            readField(bmp.fd, &depth, 2, 28) || (depth != 24 && depth != 32)) {
+        printf("%s is not a 24 or 32-bit bitmap file, skipping...\n", name);
+        goto closeFile;
+    }
+    if (readField(bmp.fd, &bmp.width, 4, 18) || readField(bmp.fd, &bmp.height, 4, 22) ||
+            readField(bmp.fd, &bmp.headerSize, 4, 10) || readField(bmp.fd, &bmp.idx, 2, BMP_IDX_OFFSET) ||
+            readField(bmp.fd, &count, 2, BMP_COUNT_OFFSET) || readField(bmp.fd, &bits, 1, BMP_LAYOUT_OFFSET) ||
+            readField(bmp.fd, &channels, 1, BMP_LAYOUT_OFFSET + 1) || readField(bmp.fd, &stripeShift, 1, BMP_STRIPE_OFFSET)) {
+        printf("ERROR: failed to read header of %s\n", name);
+        err = -EIO;
+        goto closeFile;
+    }
+    bmp.rowSize = (bmp.width * (depth / 8) + 3) / 4 * 4;
+    if (bits == 0 && channels == 0) { // initialized before density was configurable
+        bits = DEFAULT_BITS_PER_COLOR;
+        channels = DEFAULT_CHANNELS;
+    }
+    if (count == 0) {
+        printf("%s is not a part of a bmp storage, skipping...\n", name);
+        goto closeFile;
+    }
+
+    if (storage->bmps == NULL) {
+        if (layoutInit(&storage->layout, bits, channels)) {
+            printf("ERROR: unsupported density: %d bits of colors 0x%x\n", bits, channels);
+            err = -EINVAL;
+            goto closeFile;
+        }
+        if (stripeShift && (stripeShift < STRIPE_MIN_SHIFT || stripeShift > STRIPE_MAX_SHIFT)) {
+            printf("ERROR: unsupported stripe of 2^%d B\n", stripeShift);
+            err = -EINVAL;
+            goto closeFile;
+        }
+        layoutInit(&storage->packedLayout, bits, 0xf);
+        storage->stripeShift = stripeShift;
+        storage->bmps = calloc(count, sizeof(struct CarrierFile));
+        storage->count = count;
+        for (uint idx = 0; idx < count; idx++)
+            storage->bmps[idx].fd = -1;
+    } else if (count != storage->count) {
+        printf("ERROR: file count mismatch, %s belongs to other or none bmp storage\n", name);
+        err = -EINVAL;
+        goto closeFile;
+    } else if (bits != storage->layout.bits || channels != storage->layout.channels) {
+        printf("ERROR: density mismatch, different files have reported different density\n");
+        err = -EINVAL;
+        goto closeFile;
+    } else if (stripeShift != storage->stripeShift) {
+        printf("ERROR: stripe mismatch, different files have reported different stripes\n");
+        err = -EINVAL;
+        goto closeFile;
+    }
+
+    if (bmp.idx >= storage->count || storage->bmps[bmp.idx].fd >= 0) {
+        printf("ERROR: file idx %d is out of range or duplicated\n", bmp.idx);
+        err = -EINVAL;
+        goto closeFile;
+    }
+
+    // 24-bit pixels have no alpha, every color carries data
+    bmp.layout = &storage->layout;
+    if (depth == 24) {
+        if ((storage->layout.channels & 0x7) != 0x7) {
+            printf("ERROR: 24-bit bitmaps need density using all of red, green and blue\n");
+            err = -EINVAL;
+            goto closeFile;
+        }
+        bmp.layout = &storage->packedLayout;
+        bmp.rowGroups = carrierRowGroups(bmp.layout, depth, bmp.width);
+        if (bmp.rowGroups == 0) {
+            printf("ERROR: %s is too narrow to hold a group in a row\n", name);
+            err = -EINVAL;
+            goto closeFile;
+        }
+    }
+    bmp.depth = depth;
+    bmp.name = strdup(name);
+    bmp.virtualSize = carrierCapacity(bmp.layout, bmp.width, bmp.height, bmp.rowGroups);
+    storage->totalVirtualSize += bmp.virtualSize;
+    storage->bmps[bmp.idx] = bmp;
+    return 0;
+
+closeFile:
+    close(bmp.fd);
+    return err;
+}
+
+void closeStorage(struct Storage *storage) {
+    for (uint idx = 0; idx < storage->count; idx++) {
+        if (storage->bmps[idx].fd >= 0)
+            close(storage->bmps[idx].fd);
+        free(storage->bmps[idx].name);
+    }
+    free(storage->bmps);
+    storage->bmps = NULL;
+}
+
+int openStorage(struct Storage *storage, const char *folder) {
+    DIR *dir = opendir(folder);
+    struct dirent *entry;
+    ulong virtualOffset = 0;
+    int err = 0;
+
+    if (dir == NULL) {
+        printf("ERROR: failed to open folder\n");
+        return -ENOENT;
+    }
+    while (( entry = readdir(dir) ) != NULL) {
+        if (entry->d_type != DT_REG) continue;
+        if (( err = openCarrier(storage, folder, entry->d_name) )) break;
+    }
+    closedir(dir);
+    if (err) goto failed;
+
+    if (storage->bmps == NULL) {
+        printf("ERROR: no initialized bitmaps in this folder\n");
+        return -EINVAL;
+    }
+    for (uint idx = 0; idx < storage->count; idx++) {
+        struct CarrierFile *bmp = &storage->bmps[idx];
+        if (bmp->fd < 0) {
+            printf("ERROR: failed to open all bmps, %d of %d is missing\n", idx, storage->count);
+            err = -EINVAL;
+            goto failed;
+        }
+        bmp->virtualOffset = virtualOffset;
+        virtualOffset += bmp->virtualSize;
+    }
+
+    // same as the module, every carrier holds the same number of whole chunks
+    if (storage->stripeShift) {
+        ulong stripeSize = ~0UL;
+        for (uint idx = 0; idx < storage->count; idx++)
+            stripeSize = min(stripeSize, storage->bmps[idx].virtualSize);
+        stripeSize = stripeSize >> storage->stripeShift << storage->stripeShift;
+        if (stripeSize == 0) {
+            printf("ERROR: the smallest bmp doesn't fit a single %lu KiB chunk\n", (1UL << storage->stripeShift) / 1024);
+            err = -EINVAL;
+            goto failed;
+        }
+        for (uint idx = 0; idx < storage->count; idx++)
+            storage->bmps[idx].virtualSize = stripeSize;
+        storage->totalVirtualSize = stripeSize * storage->count;
+    }
+    return 0;
+
+failed:
+    if (storage->bmps) closeStorage(storage);
+    return err;
+}
+
+// carrier holding a storage position, len is what follows in the same carrier range
+struct CarrierFile *storageLocate(struct Storage *storage, ulong position, ulong *local, ulong *len) {
+    struct CarrierFile *bmp;
+
+    if (storage->stripeShift) {
+        ulong chunk = 1UL << storage->stripeShift;
+        uint16 idx;
+        *local = stripeLocate(storage->stripeShift, storage->count, position, &idx);
+        *len = chunk - (position & (chunk - 1));
+        return &storage->bmps[idx];
+    }
+
+    // last carrier starting at or before position, same as findBmp in the module
+    uint lo = 0, hi = storage->count - 1;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo + 1) / 2;
+        if (storage->bmps[mid].virtualOffset <= position)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    bmp = &storage->bmps[lo];
+    *local = position - bmp->virtualOffset;
+    *len = bmp->virtualSize - *local;
+    return bmp;
+}
+
+// inverse of storageLocate
+ulong storagePosition(struct Storage *storage, struct CarrierFile *bmp, ulong local, ulong *len) {
+    if (storage->stripeShift) {
+        ulong chunk = 1UL << storage->stripeShift;
+        *len = chunk - (local & (chunk - 1));
+        return stripePosition(storage->stripeShift, storage->count, bmp->idx, local);
+    }
+    *len = bmp->virtualSize - local;
+    return bmp->virtualOffset + local;
+}
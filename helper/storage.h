@@ -0,0 +1,48 @@
+#ifndef STG_STORAGE_H
+#define STG_STORAGE_H
+
+#include "codec.h"
+
+// bitmap storage opened from userspace, the same way the module does it
+
+struct CarrierFile {
+    int fd;
+    char *name; // in the folder
+    uint16 idx;
+    uint16 depth;
+    uint width;
+    uint height;
+    uint rowSize;
+    uint headerSize;
+    uint rowGroups; // groups in a row of a 24-bit carrier, 0 when groups run across rows
+    const struct StgLayout *layout; // of the storage, or its packed variant for 24-bit carriers
+    ulong virtualSize;
+    ulong virtualOffset;
+};
+
+struct Storage {
+    struct CarrierFile *bmps; // sorted by idx and virtualOffset
+    uint16 count;
+    ulong totalVirtualSize;
+    struct StgLayout layout;
+    struct StgLayout packedLayout; // every color carries data, used by 24-bit carriers
+    uint8 stripeShift; // 0 concatenates carriers
+};
+
+int openStorage(struct Storage *storage, const char *folder);
+void closeStorage(struct Storage *storage);
+
+struct CarrierFile *storageLocate(struct Storage *storage, ulong position, ulong *local, ulong *len);
+ulong storagePosition(struct Storage *storage, struct CarrierFile *bmp, ulong local, ulong *len);
+
+// file offset of a group of the carrier
+static inline ulong carrierGroupOffset(const struct CarrierFile *bmp, ulong group) {
+    return groupOffset(bmp->layout, bmp->width, bmp->rowSize, bmp->headerSize, bmp->rowGroups, group);
+}
+
+// carrier bytes read for groups, ends of 24-bit rows between them included
+static inline ulong carrierGroupSpan(const struct CarrierFile *bmp, ulong group, ulong groups) {
+    return groupSpan(bmp->layout, bmp->rowSize, bmp->rowGroups, group, groups);
+}
+
+#endif
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "codec.h"
+#include "common.h"
+#include "storage.h"
+#include "extents.h"
+#include "transfer.h"
+
+// moves a raw image into or out of a storage without the module
+// every worker takes whole carriers, reads large sequential runs and codes them in one batch
+
+#define TRANSFER_CARRIER_SIZE (4 << 20) // carrier bytes read and coded at once, payload always takes less
+
+struct Transfer {
+    struct Storage storage;
+    struct ExtentMap extents;
+    int imageFd;
+    ulong size;    // bytes of the image that are moved
+    int import;
+    uint next;     // carrier taken by the next free worker
+    int err;
+};
+
+static int readFull(int fd, void *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t ret = pread(fd, buf, size, offset);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return ret < 0 ? -errno : -EIO;
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int writeFull(int fd, const void *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t ret = pwrite(fd, buf, size, offset);
+        if (ret < 0 && errno == EINTR) continue;
+        if (ret <= 0) return ret < 0 ? -errno : -EIO;
+        buf += ret;
+        size -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+// moves the pieces of a carrier run that belong to the image, payload holds the whole run
+static int transferPieces(struct Transfer *transfer, struct CarrierFile *bmp, uint8 *payload, ulong position, ulong len) {
+    for (ulong done = 0, piece; done < len; done += piece) {
+        ulong storagePos = storagePosition(&transfer->storage, bmp, position + done, &piece);
+        int err;
+
+        piece = min(piece, len - done);
+        if (storagePos >= transfer->size) break;
+        piece = min(piece, transfer->size - storagePos);
+        if (transfer->import) {
+            err = readFull(transfer->imageFd, payload + done, piece, storagePos);
+        } else {
+            // the module reads extents that were never written as zeros
+            zeroUnwritten(&transfer->extents, payload + done, storagePos, piece);
+            err = writeFull(transfer->imageFd, payload + done, piece, storagePos);
+        }
+        if (err) return err;
+    }
+    return 0;
+}
+
+static int transferCarrier(struct Transfer *transfer, struct CarrierFile *bmp, uint8 *payload, uint8 *carrier) {
+    const struct StgLayout *layout = bmp->layout;
+    int err;
+
+    posix_fadvise(bmp->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (ulong position = 0, len; position < bmp->virtualSize; position += len) {
+        ulong group = position / layout->groupBytes;
+        ulong groups = groupsInSpan(layout, bmp->rowSize, bmp->rowGroups, group, TRANSFER_CARRIER_SIZE);
+        off_t offset = carrierGroupOffset(bmp, group);
+        ulong carrierLen, piece;
+
+        len = min(groups * layout->groupBytes, bmp->virtualSize - position);
+        carrierLen = carrierGroupSpan(bmp, group, (len + layout->groupBytes - 1) / layout->groupBytes);
+
+        // storage positions only grow along a carrier, the rest of it is past the image
+        if (storagePosition(&transfer->storage, bmp, position, &piece) >= transfer->size) break;
+
+        // image bits of the pixels are kept, so the carrier is always read
+        if (( err = readFull(bmp->fd, carrier, carrierLen, offset) )) return err;
+        if (transfer->import) {
+            // payload past the end of the image stays as it was
+            if (storagePosition(&transfer->storage, bmp, position + len - 1, &piece) >= transfer->size)
+                codecDecodeRows(layout, bmp->rowSize, bmp->rowGroups, payload, carrier, group, 0, len);
+            if (( err = transferPieces(transfer, bmp, payload, position, len) )) return err;
+            codecEncodeRows(layout, bmp->rowSize, bmp->rowGroups, payload, carrier, group, 0, len);
+            if (( err = writeFull(bmp->fd, carrier, carrierLen, offset) )) return err;
+        } else {
+            codecDecodeRows(layout, bmp->rowSize, bmp->rowGroups, payload, carrier, group, 0, len);
+            if (( err = transferPieces(transfer, bmp, payload, position, len) )) return err;
+        }
+    }
+    return transfer->import ? (fsync(bmp->fd) ? -errno : 0) : 0;
+}
+
+static void *transferThread(void *data) {
+    struct Transfer *transfer = data;
+    uint8 *payload = malloc(TRANSFER_CARRIER_SIZE);
+    uint8 *carrier = malloc(TRANSFER_CARRIER_SIZE);
+    uint idx;
+
+    if (!payload || !carrier) {
+        __atomic_store_n(&transfer->err, -ENOMEM, __ATOMIC_RELAXED);
+        goto out;
+    }
+    while (( idx = __atomic_fetch_add(&transfer->next, 1, __ATOMIC_RELAXED) ) < transfer->storage.count) {
+        int err;
+        if (__atomic_load_n(&transfer->err, __ATOMIC_RELAXED)) break;
+        if (( err = transferCarrier(transfer, &transfer->storage.bmps[idx], payload, carrier) )) {
+            printf("ERROR: failed to transfer bitmap %d (%s)\n", idx, strerror(-err));
+            __atomic_store_n(&transfer->err, err, __ATOMIC_RELAXED);
+        }
+    }
+out:
+    free(payload);
+    free(carrier);
+    return NULL;
+}
+
+static int transfer(char *folder, char *image, int import, uint blockSize) {
+    struct Transfer transfer;
+    struct stat st;
+    struct timespec start, end;
+    long nrCpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint nrThreads;
+    pthread_t *threads;
+    ulong capacity;
+    double seconds;
+    int ret = 1;
+
+    memset(&transfer, 0, sizeof(transfer));
+    transfer.import = import;
+    codecInit();
+    if (openStorage(&transfer.storage, folder)) return 1;
+    // what the block device shows, whole blocks only
+    capacity = transfer.storage.totalVirtualSize / blockSize * blockSize;
+    openExtentMap(&transfer.extents, folder, transfer.storage.totalVirtualSize);
+
+    transfer.imageFd = import ? open(image, O_RDONLY) : open(image, O_WRONLY | O_CREAT, 0644);
+    if (transfer.imageFd < 0) {
+        printf("ERROR: failed to open %s\n", image);
+        goto failedImage;
+    }
+    fstat(transfer.imageFd, &st);
+    if (import) {
+        transfer.size = lseek(transfer.imageFd, 0, SEEK_END);
+        if (transfer.size > capacity) {
+            printf("ERROR: image has %lu B, storage only %lu B\n", transfer.size, capacity);
+            goto failedSize;
+        }
+    } else {
+        transfer.size = capacity;
+        if (S_ISREG(st.st_mode) && ftruncate(transfer.imageFd, capacity)) {
+            printf("ERROR: failed to resize %s\n", image);
+            goto failedSize;
+        }
+    }
+    posix_fadvise(transfer.imageFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    nrThreads = min((ulong) transfer.storage.count, (ulong) (nrCpus > 0 ? 2 * nrCpus : 1));
+    threads = calloc(nrThreads, sizeof(pthread_t));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint i = 0; i < nrThreads; i++)
+        pthread_create(&threads[i], NULL, transferThread, &transfer);
+    for (uint i = 0; i < nrThreads; i++)
+        pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    free(threads);
+
+    if (!transfer.err && !import && fsync(transfer.imageFd))
+        transfer.err = -errno;
+    // imported data is in carriers, only then it's marked
+    if (!transfer.err && import)
+        transfer.err = markExtents(&transfer.extents, 0, transfer.size);
+    if (!transfer.err) {
+        ret = 0;
+        seconds = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("%s %lu B %s %d bitmaps in %.2f s (%.1f MiB/s)\n", import ? "imported" : "exported", transfer.size,
+               import ? "into" : "from", transfer.storage.count, seconds, transfer.size / 1048576.0 / (seconds > 0 ? seconds : 1));
+    }
+
+failedSize:
+    close(transfer.imageFd);
+failedImage:
+    closeExtentMap(&transfer.extents);
+    closeStorage(&transfer.storage);
+    return ret;
+}
+
+int importImage(char *image, char *folder, uint blockSize) {
+    return transfer(folder, image, 1, blockSize);
+}
+
+int exportImage(char *folder, char *image, uint blockSize) {
+    return transfer(folder, image, 0, blockSize);
+}
@@ -0,0 +1,7 @@
+#ifndef STG_TRANSFER_H
+#define STG_TRANSFER_H
+
+int importImage(char *image, char *folder, uint blockSize);
+int exportImage(char *folder, char *image, uint blockSize);
+
+#endif
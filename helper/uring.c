@@ -0,0 +1,108 @@
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+int uringInit(struct Uring *ring, unsigned entries, unsigned flags) {
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+
+    ring->fd = ioUringSetup(entries, &params);
+    if (ring->fd < 0)
+        return -errno;
+    ring->sqeSize = flags & IORING_SETUP_SQE128 ? 128 : sizeof(struct io_uring_sqe);
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * ring->sqeSize;
+
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+        goto failedToMap;
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqRing == MAP_FAILED)
+        goto failedToMapCq;
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto failedToMapSqes;
+
+    ring->sqHead = ring->sqRing + params.sq_off.head;
+    ring->sqTail = ring->sqRing + params.sq_off.tail;
+    ring->sqMask = *(unsigned *) (ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = ring->sqRing + params.sq_off.array;
+    ring->cqHead = ring->cqRing + params.cq_off.head;
+    ring->cqTail = ring->cqRing + params.cq_off.tail;
+    ring->cqMask = *(unsigned *) (ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = ring->cqRing + params.cq_off.cqes;
+
+    // sqes are always taken in order, so the indirection array is fixed
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        ring->sqArray[i] = i;
+    return 0;
+
+failedToMapSqes:
+    munmap(ring->cqRing, ring->cqRingSize);
+failedToMapCq:
+    munmap(ring->sqRing, ring->sqRingSize);
+failedToMap:
+    close(ring->fd);
+    return -ENOMEM;
+}
+
+void uringExit(struct Uring *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// zeroed sqe, NULL when the queue is full
+struct io_uring_sqe *uringGetSqe(struct Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sqTail + ring->sqPending;
+    struct io_uring_sqe *sqe;
+
+    if (tail - head > ring->sqMask)
+        return NULL;
+    sqe = ring->sqes + (tail & ring->sqMask) * ring->sqeSize;
+    memset(sqe, 0, ring->sqeSize);
+    ring->sqPending++;
+    return sqe;
+}
+
+// passes filled sqes to the kernel and waits for waitNr completions, may return earlier
+int uringSubmit(struct Uring *ring, unsigned waitNr) {
+    unsigned toSubmit = ring->sqPending;
+    int ret;
+
+    __atomic_store_n(ring->sqTail, *ring->sqTail + toSubmit, __ATOMIC_RELEASE);
+    ring->sqPending = 0;
+    do {
+        ret = ioUringEnter(ring->fd, toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR); // interrupted calls submit nothing
+    return ret < 0 ? -errno : ret;
+}
+
+struct io_uring_cqe *uringPeekCqe(struct Uring *ring) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void uringCqeSeen(struct Uring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
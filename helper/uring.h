@@ -0,0 +1,37 @@
+#ifndef STG_URING_H
+#define STG_URING_H
+
+#include <linux/io_uring.h>
+
+// just enough of io_uring for the ublk server, without liburing
+
+struct Uring {
+    int fd;
+    unsigned sqeSize;       // 64, or 128 for IORING_SETUP_SQE128
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned sqPending;     // filled, not yet passed to the kernel
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+};
+
+int uringInit(struct Uring *ring, unsigned entries, unsigned flags);
+void uringExit(struct Uring *ring);
+
+struct io_uring_sqe *uringGetSqe(struct Uring *ring);
+int uringSubmit(struct Uring *ring, unsigned waitNr);
+
+struct io_uring_cqe *uringPeekCqe(struct Uring *ring);
+void uringCqeSeen(struct Uring *ring);
+
+#endif
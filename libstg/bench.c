@@ -0,0 +1,239 @@
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "codec.h"
+
+// round trips every codec against a bit by bit model of the carrier layout, then measures throughput
+// runs without the module, all of the codec is linked from ../module/codec.c
+
+static const char *codecNames[] = { "scalar", "sse2", "avx2", "avx512bw" };
+
+static const ulong sizes[] = { 4096, 65536, 524288, 4194304 };
+
+// misalignment of payload and carrier buffers, the module gets both page aligned only for whole requests
+static const uint alignments[] = { 0, 1, 3 };
+
+// non-default layouts use the generic kernels, which don't depend on the codec
+static const uint8 layouts[][2] = { { 1, 0x7 }, { 1, 0xf }, { 2, 0x7 }, { 4, 0x1 }, { 4, 0x7 } };
+
+#define CHECK_GROUPS 1031
+#define CHECK_WINDOWS 200
+
+//// reference
+
+// n-th color of the pixel that carries data
+static uint channelColor(uint8 channels, uint n) {
+    for (uint color = 0; color < COLORS_PER_PIXEL; color++)
+        if (channels & (1 << color) && n-- == 0)
+            return color;
+    return COLORS_PER_PIXEL;
+}
+
+// payload is one stream of bits, lowest first, spread over the low bits of every used color of every pixel
+static void carrierBit(const struct StgLayout *layout, ulong bit, ulong *byte, uint *shift) {
+    uint colors = hweight8(layout->channels);
+    ulong slot = bit / layout->bits;
+    *byte = slot / colors * COLORS_PER_PIXEL + channelColor(layout->channels, slot % colors);
+    *shift = bit % layout->bits;
+}
+
+static void referenceDecode(const struct StgLayout *layout, uint8 *data, const uint8 *carrier, ulong pos, ulong size) {
+    memset(data, 0, size);
+    for (ulong bit = pos * 8; bit < (pos + size) * 8; bit++) {
+        ulong byte;
+        uint shift;
+        carrierBit(layout, bit, &byte, &shift);
+        data[bit / 8 - pos] |= ((carrier[byte] >> shift) & 1) << (bit % 8);
+    }
+}
+
+static void referenceEncode(const struct StgLayout *layout, const uint8 *data, uint8 *carrier, ulong pos, ulong size) {
+    for (ulong bit = pos * 8; bit < (pos + size) * 8; bit++) {
+        ulong byte;
+        uint shift;
+        carrierBit(layout, bit, &byte, &shift);
+        carrier[byte] &= ~(1 << shift);
+        carrier[byte] |= ((data[bit / 8 - pos] >> (bit % 8)) & 1) << shift;
+    }
+}
+
+//// check
+
+static void fillRandom(uint8 *buf, ulong size) {
+    for (ulong i = 0; i < size; i++)
+        buf[i] = rand();
+}
+
+static int checkLayout(const struct StgLayout *layout, uint align) {
+    ulong carrierSize = (ulong) CHECK_GROUPS * layout->groupSize;
+    ulong payloadSize = (ulong) CHECK_GROUPS * layout->groupBytes;
+    uint8 *carrier = malloc(carrierSize + align);
+    uint8 *expected = malloc(carrierSize);
+    uint8 *data = malloc(payloadSize + align);
+    uint8 *decoded = malloc(payloadSize);
+    int failed = 0;
+
+    if (!carrier || !expected || !data || !decoded) {
+        printf("out of memory\n");
+        failed = 1;
+        goto out;
+    }
+
+    fillRandom(carrier + align, carrierSize);
+    for (uint w = 0; w < CHECK_WINDOWS && !failed; w++) {
+        // every few windows cover everything, so the vector loops run too
+        ulong pos = w % 4 ? rand() % payloadSize : rand() % layout->groupBytes;
+        ulong size = w % 4 ? rand() % (payloadSize - pos) + 1 : payloadSize - pos;
+        uint8 *group = carrier + align + pos / layout->groupBytes * layout->groupSize;
+        ulong skip = pos % layout->groupBytes;
+
+        referenceDecode(layout, decoded, carrier + align, pos, size);
+        codecDecode(layout, data + align, group, skip, size);
+        if (memcmp(decoded, data + align, size)) {
+            printf("decode mismatch at %lu + %lu\n", pos, size);
+            failed = 1;
+            break;
+        }
+
+        fillRandom(data + align, size);
+        memcpy(expected, carrier + align, carrierSize);
+        if (w % 8 == 7) {
+            memset(data + align, 0, size);
+            referenceEncode(layout, data + align, expected, pos, size);
+            codecZero(layout, group, skip, size);
+        } else {
+            referenceEncode(layout, data + align, expected, pos, size);
+            codecEncode(layout, data + align, group, skip, size);
+        }
+        if (memcmp(expected, carrier + align, carrierSize)) {
+            printf("%s mismatch at %lu + %lu\n", w % 8 == 7 ? "zero" : "encode", pos, size);
+            failed = 1;
+        }
+    }
+
+out:
+    free(carrier);
+    free(expected);
+    free(data);
+    free(decoded);
+    return failed;
+}
+
+static int checkAll(void) {
+    struct StgLayout layout;
+    int failed = 0;
+
+    for (uint c = 0; c < ARRAY_SIZE(codecNames); c++) {
+        if (codecSelect(codecNames[c])) continue;
+        for (uint8 bits = 1; bits <= 4; bits *= 2) {
+            for (uint8 channels = 1; channels <= 0xf; channels++) {
+                // only the default layout is served by the selected codec
+                if (c && !(bits == DEFAULT_BITS_PER_COLOR && channels == DEFAULT_CHANNELS)) continue;
+                layoutInit(&layout, bits, channels);
+                for (uint a = 0; a < ARRAY_SIZE(alignments); a++) {
+                    if (!checkLayout(&layout, alignments[a])) continue;
+                    printf("FAIL %s bits %u channels 0x%x align %u\n", codecNames[c], bits, channels, alignments[a]);
+                    failed = 1;
+                }
+            }
+        }
+        if (!failed) printf("check %-8s ok\n", codecNames[c]);
+    }
+    return failed;
+}
+
+//// bench
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// payload GB/s of whole group runs, repeated for at least the given time
+static void benchLayout(const char *name, const struct StgLayout *layout, ulong size, uint align, double seconds) {
+    ulong groups = size / layout->groupBytes;
+    uint8 *carrier = malloc(groups * layout->groupSize + align);
+    uint8 *data = malloc(size + align);
+    double rates[2];
+
+    if (!carrier || !data) {
+        printf("out of memory\n");
+        goto out;
+    }
+    fillRandom(carrier, groups * layout->groupSize + align);
+    fillRandom(data, size + align);
+
+    for (int encode = 0; encode < 2; encode++) {
+        ulong runs = 0;
+        double start = now(), elapsed;
+        do {
+            for (uint i = 0; i < 16; i++, runs++) {
+                if (encode)
+                    codecEncode(layout, data + align, carrier + align, 0, groups * layout->groupBytes);
+                else
+                    codecDecode(layout, data + align, carrier + align, 0, groups * layout->groupBytes);
+            }
+            elapsed = now() - start;
+        } while (elapsed < seconds);
+        rates[encode] = (double) runs * groups * layout->groupBytes / elapsed / 1e9;
+    }
+    printf("%-10s %u/0x%x %8lu %5u %10.2f %10.2f\n", name, layout->bits, layout->channels, size, align, rates[0], rates[1]);
+
+out:
+    free(carrier);
+    free(data);
+}
+
+static void benchAll(const char *only, double seconds) {
+    struct StgLayout layout;
+
+    printf("%-10s %-6s %8s %5s %10s %10s\n", "codec", "layout", "size", "align", "decode", "encode");
+    for (uint c = 0; c < ARRAY_SIZE(codecNames); c++) {
+        if (only && strcmp(only, codecNames[c])) continue;
+        if (codecSelect(codecNames[c])) continue;
+        layoutInit(&layout, DEFAULT_BITS_PER_COLOR, DEFAULT_CHANNELS);
+        for (uint s = 0; s < ARRAY_SIZE(sizes); s++)
+            for (uint a = 0; a < ARRAY_SIZE(alignments); a++)
+                benchLayout(codecNames[c], &layout, sizes[s], alignments[a], seconds);
+    }
+    if (only && strcmp(only, "generic")) return;
+    for (uint l = 0; l < ARRAY_SIZE(layouts); l++) {
+        layoutInit(&layout, layouts[l][0], layouts[l][1]);
+        for (uint s = 0; s < ARRAY_SIZE(sizes); s++)
+            benchLayout("generic", &layout, sizes[s], 0, seconds);
+    }
+}
+
+static int printHelp(void) {
+    printf("Usage: stg_bench [options]\n");
+    printf("    -c - only check codecs against the reference layout\n");
+    printf("    -s [seconds] - minimal time of every measurement, default 0.2\n");
+    printf("    -o [codec] - only measure one of scalar, sse2, avx2, avx512bw, generic\n");
+    printf("    results are payload GB/s\n");
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    double seconds = 0.2;
+    const char *only = NULL;
+    int checkOnly = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cs:o:h")) != -1) {
+        switch (opt) {
+            case 'c': checkOnly = 1; break;
+            case 's': seconds = atof(optarg); break;
+            case 'o': only = optarg; break;
+            default: return printHelp();
+        }
+    }
+
+    srand(1);
+    codecInit();
+    if (checkAll()) return 1;
+    if (checkOnly) return 0;
+    benchAll(only, seconds);
+    return 0;
+}
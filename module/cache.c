@@ -0,0 +1,334 @@
+#include "cache.h"
+
+//// blocks
+
+static struct CacheBlock *allocBlock(pgoff_t idx) {
+    gfp_t gfp = GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN;
+    struct CacheBlock *block = kmalloc(sizeof(struct CacheBlock), gfp);
+    if (block == NULL) return NULL;
+
+    block->data = (void *) __get_free_page(gfp);
+    if (block->data == NULL) {
+        kfree(block);
+        return NULL;
+    }
+    INIT_LIST_HEAD(&block->lru);
+    block->idx = idx;
+    block->state = CACHE_LOADING;
+    return block;
+}
+
+// dirty and flushing blocks hold the newest data, so they serve reads too
+static inline bool isUpToDate(struct CacheBlock *block) {
+    return block->state == CACHE_VALID || block->state == CACHE_DIRTY || block->state == CACHE_FLUSHING;
+}
+
+static void freeBlock(struct CacheBlock *block) {
+    free_page((ulong) block->data);
+    kfree(block);
+}
+
+static void freeBlocks(struct list_head *victims) {
+    struct CacheBlock *block, *next;
+    list_for_each_entry_safe(block, next, victims, lru) {
+        freeBlock(block);
+    }
+}
+
+// moves up to count least recently used blocks to victims, called with xa_lock held
+static ulong evictLocked(struct BlockCache *cache, ulong count, struct list_head *victims) {
+    ulong evicted = 0;
+    while (evicted < count && !list_empty(&cache->lru)) {
+        struct CacheBlock *block = list_last_entry(&cache->lru, struct CacheBlock, lru);
+        __xa_erase(&cache->blocks, block->idx);
+        list_move(&block->lru, victims);
+        cache->nrBlocks--;
+        evicted++;
+    }
+    return evicted;
+}
+
+//// shrinker
+
+static ulong countObjects(struct shrinker *shrink, struct shrink_control *sc) {
+    struct BlockCache *cache = container_of(shrink, struct BlockCache, shrinker);
+    ulong count = READ_ONCE(cache->nrBlocks) - READ_ONCE(cache->nrDirty);
+    return count ? count : SHRINK_EMPTY;
+}
+
+static ulong scanObjects(struct shrinker *shrink, struct shrink_control *sc) {
+    struct BlockCache *cache = container_of(shrink, struct BlockCache, shrinker);
+    LIST_HEAD(victims);
+    ulong freed;
+
+    xa_lock(&cache->blocks);
+    freed = evictLocked(cache, sc->nr_to_scan, &victims);
+    xa_unlock(&cache->blocks);
+
+    freeBlocks(&victims);
+    return freed ? freed : SHRINK_STOP;
+}
+
+//// init && destroy
+
+int cacheInit(struct BlockCache *cache, ulong maxBytes, const char *name) {
+    int err;
+
+    xa_init(&cache->blocks);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->nrBlocks = 0;
+    cache->maxBlocks = maxBytes >> CACHE_BLOCK_SHIFT;
+    cache->nrDirty = 0;
+    cache->maxDirty = 0;
+    init_waitqueue_head(&cache->dirtyWait);
+    cache->shrinkerRegistered = false;
+    if (cache->maxBlocks == 0) return 0;
+
+    cache->shrinker.count_objects = countObjects;
+    cache->shrinker.scan_objects = scanObjects;
+    cache->shrinker.seeks = DEFAULT_SEEKS;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    err = register_shrinker(&cache->shrinker, "stg-%s", name);
+#else
+    err = register_shrinker(&cache->shrinker);
+#endif
+    if (err) {
+        cache->maxBlocks = 0;
+        return err;
+    }
+    cache->shrinkerRegistered = true;
+
+    printInfo("decoded block cache: %lu blocks (%lu KiB)\n", cache->maxBlocks, cache->maxBlocks * CACHE_BLOCK_SIZE / 1024);
+    return 0;
+}
+
+void cacheDestroy(struct BlockCache *cache) {
+    struct CacheBlock *block;
+    ulong idx;
+
+    if (cache->shrinkerRegistered) {
+        unregister_shrinker(&cache->shrinker);
+        cache->shrinkerRegistered = false;
+    }
+
+    // device is gone and flushed, there are no loading or dirty blocks anymore
+    xa_for_each(&cache->blocks, idx, block) {
+        freeBlock(block);
+    }
+    xa_destroy(&cache->blocks);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->nrBlocks = 0;
+    cache->nrDirty = 0;
+}
+
+//// lookup && update
+
+// copies part of the block to the request and advances it, returns 1 on hit
+int cacheRead(struct BlockCache *cache, pgoff_t idx, uint offset, ulong len, struct StgCursor *cur) {
+    struct CacheBlock *block;
+    int hit = 0;
+
+    xa_lock(&cache->blocks);
+    block = xa_load(&cache->blocks, idx);
+    if (block && isUpToDate(block)) {
+        cursorCopyTo(cur, block->data + offset, len);
+        if (block->state == CACHE_VALID)
+            list_move(&block->lru, &cache->lru);
+        hit = 1;
+    }
+    xa_unlock(&cache->blocks);
+    return hit;
+}
+
+// only a hint, block may be gone before it's read
+int cacheHas(struct BlockCache *cache, pgoff_t idx) {
+    struct CacheBlock *block;
+    int has;
+
+    xa_lock(&cache->blocks);
+    block = xa_load(&cache->blocks, idx);
+    has = block && isUpToDate(block);
+    xa_unlock(&cache->blocks);
+    return has;
+}
+
+// returns a loading block owned by the caller, or NULL if the block can't be cached right now
+struct CacheBlock *cacheReserve(struct BlockCache *cache, pgoff_t idx) {
+    struct CacheBlock *block = allocBlock(idx);
+    LIST_HEAD(victims);
+
+    if (block == NULL) return NULL;
+
+    xa_lock(&cache->blocks);
+    if (cache->nrBlocks >= cache->maxBlocks)
+        evictLocked(cache, cache->nrBlocks - cache->maxBlocks + 1, &victims);
+    // someone else is already loading it, or all slots are taken by loading blocks
+    if (cache->nrBlocks >= cache->maxBlocks || __xa_insert(&cache->blocks, idx, block, GFP_NOWAIT)) {
+        xa_unlock(&cache->blocks);
+        freeBlocks(&victims);
+        freeBlock(block);
+        return NULL;
+    }
+    cache->nrBlocks++;
+    xa_unlock(&cache->blocks);
+
+    freeBlocks(&victims);
+    return block;
+}
+
+// publishes a reserved block, drops it if decoding failed or it was written in the meantime
+void cacheFill(struct BlockCache *cache, struct CacheBlock *block, int ok) {
+    xa_lock(&cache->blocks);
+    if (ok && block->state == CACHE_LOADING) {
+        block->state = CACHE_VALID;
+        list_add(&block->lru, &cache->lru);
+        block = NULL;
+    } else {
+        __xa_erase(&cache->blocks, block->idx);
+        cache->nrBlocks--;
+    }
+    xa_unlock(&cache->blocks);
+
+    if (block) freeBlock(block);
+}
+
+// write-through, cached copies are patched with data that was just encoded
+void cacheWrite(struct BlockCache *cache, loff_t position, ulong size, struct StgCursor *cur) {
+    xa_lock(&cache->blocks);
+    while (size > 0) {
+        pgoff_t idx = position >> CACHE_BLOCK_SHIFT;
+        uint offset = position & (CACHE_BLOCK_SIZE - 1);
+        ulong len = min(size, (ulong) CACHE_BLOCK_SIZE - offset);
+        struct CacheBlock *block = xa_load(&cache->blocks, idx);
+
+        if (block && block->state == CACHE_VALID) {
+            cursorCopyFrom(cur, block->data + offset, len);
+        } else {
+            if (block) block->state = CACHE_STALE; // reader may have decoded old data
+            cursorSkip(cur, len);
+        }
+
+        position += len;
+        size -= len;
+    }
+    xa_unlock(&cache->blocks);
+}
+
+// carriers were cleared, flushing blocks go back to dirty so old data isn't written over the zeros
+void cacheZero(struct BlockCache *cache, loff_t position, ulong size) {
+    xa_lock(&cache->blocks);
+    while (size > 0) {
+        pgoff_t idx = position >> CACHE_BLOCK_SHIFT;
+        uint offset = position & (CACHE_BLOCK_SIZE - 1);
+        ulong len = min(size, (ulong) CACHE_BLOCK_SIZE - offset);
+        struct CacheBlock *block = xa_load(&cache->blocks, idx);
+
+        if (block && isUpToDate(block)) {
+            memset(block->data + offset, 0, len);
+            if (block->state == CACHE_FLUSHING) {
+                block->state = CACHE_DIRTY;
+                __xa_set_mark(&cache->blocks, idx, CACHE_DIRTY_MARK);
+            }
+        } else if (block) {
+            block->state = CACHE_STALE;
+        }
+
+        position += len;
+        size -= len;
+    }
+    xa_unlock(&cache->blocks);
+}
+
+//// write-back
+
+// copies the write into the cache and marks it dirty, returns 1 if it was absorbed
+// whole blocks are cached on a miss, partial writes need a cached block to patch
+int cacheWriteBack(struct BlockCache *cache, pgoff_t idx, uint offset, ulong len, struct StgCursor *cur) {
+    struct CacheBlock *block, *fresh = NULL;
+    LIST_HEAD(victims);
+    int absorbed = 0;
+
+    xa_lock(&cache->blocks);
+    block = xa_load(&cache->blocks, idx);
+    if (block == NULL && len == CACHE_BLOCK_SIZE) {
+        xa_unlock(&cache->blocks);
+        fresh = allocBlock(idx);
+        if (fresh == NULL) return 0;
+
+        xa_lock(&cache->blocks);
+        if (cache->nrBlocks >= cache->maxBlocks)
+            evictLocked(cache, cache->nrBlocks - cache->maxBlocks + 1, &victims);
+        if (cache->nrBlocks < cache->maxBlocks && !__xa_insert(&cache->blocks, idx, fresh, GFP_NOWAIT)) {
+            cache->nrBlocks++;
+            fresh->state = CACHE_VALID; // whole block is overwritten below
+            fresh = NULL;
+        }
+        block = xa_load(&cache->blocks, idx);
+    }
+
+    if (block) {
+        switch (block->state) {
+        case CACHE_VALID:
+            list_del_init(&block->lru);
+            cache->nrDirty++;
+            fallthrough;
+        case CACHE_FLUSHING:
+            block->state = CACHE_DIRTY;
+            __xa_set_mark(&cache->blocks, idx, CACHE_DIRTY_MARK);
+            fallthrough;
+        case CACHE_DIRTY:
+            cursorCopyFrom(cur, block->data + offset, len);
+            absorbed = 1;
+            break;
+        default:
+            block->state = CACHE_STALE; // reader may have decoded old data, write goes through
+        }
+    }
+    xa_unlock(&cache->blocks);
+
+    freeBlocks(&victims);
+    if (fresh) freeBlock(fresh);
+    return absorbed;
+}
+
+// takes a run of adjacent dirty blocks starting at or after *next, they stay cached while flushing
+uint cacheTakeDirty(struct BlockCache *cache, pgoff_t *next, struct CacheBlock **blocks, uint max) {
+    struct CacheBlock *block;
+    ulong idx = *next;
+    uint nrBlocks = 0;
+
+    xa_lock(&cache->blocks);
+    block = xa_find(&cache->blocks, &idx, ULONG_MAX, CACHE_DIRTY_MARK);
+    while (block && nrBlocks < max) {
+        __xa_clear_mark(&cache->blocks, idx, CACHE_DIRTY_MARK);
+        block->state = CACHE_FLUSHING;
+        blocks[nrBlocks++] = block;
+
+        block = xa_load(&cache->blocks, ++idx);
+        if (block && block->state != CACHE_DIRTY) block = NULL;
+    }
+    xa_unlock(&cache->blocks);
+
+    *next = idx;
+    return nrBlocks;
+}
+
+// cleans flushed blocks, the ones written in the meantime or failed stay dirty
+void cacheFlushDone(struct BlockCache *cache, struct CacheBlock **blocks, uint nrBlocks, int ok) {
+    xa_lock(&cache->blocks);
+    for (uint i = 0; i < nrBlocks; i++) {
+        struct CacheBlock *block = blocks[i];
+        if (block->state != CACHE_FLUSHING) continue;
+        if (ok) {
+            block->state = CACHE_VALID;
+            list_add(&block->lru, &cache->lru);
+            cache->nrDirty--;
+        } else {
+            block->state = CACHE_DIRTY;
+            __xa_set_mark(&cache->blocks, block->idx, CACHE_DIRTY_MARK);
+        }
+    }
+    xa_unlock(&cache->blocks);
+
+    wake_up_all(&cache->dirtyWait);
+}
@@ -0,0 +1,16 @@
+#include "definitions.h"
+#include "cursor.h"
+
+int cacheInit(struct BlockCache *cache, ulong maxBytes, const char *name);
+void cacheDestroy(struct BlockCache *cache);
+
+int cacheRead(struct BlockCache *cache, pgoff_t idx, uint offset, ulong len, struct StgCursor *cur);
+int cacheHas(struct BlockCache *cache, pgoff_t idx);
+struct CacheBlock *cacheReserve(struct BlockCache *cache, pgoff_t idx);
+void cacheFill(struct BlockCache *cache, struct CacheBlock *block, int ok);
+void cacheWrite(struct BlockCache *cache, loff_t position, ulong size, struct StgCursor *cur);
+void cacheZero(struct BlockCache *cache, loff_t position, ulong size);
+
+int cacheWriteBack(struct BlockCache *cache, pgoff_t idx, uint offset, ulong len, struct StgCursor *cur);
+uint cacheTakeDirty(struct BlockCache *cache, pgoff_t *next, struct CacheBlock **blocks, uint max);
+void cacheFlushDone(struct BlockCache *cache, struct CacheBlock **blocks, uint nrBlocks, int ok);
@@ -0,0 +1,613 @@
+#include "codec.h"
+
+#if defined(__KERNEL__) && defined(CONFIG_X86_64)
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+//// default layout, 2 bits of every color
+// every pixel carries exactly one byte, so it gets the vectorized kernels
+
+//// scalar
+
+// pixel bits that carry data for every byte value
+static u32 spreadTable[256];
+
+static void initSpreadTable(void) {
+    for (uint byte = 0; byte < 256; byte++) {
+        u32 pixel = 0;
+        for (uint8 colorIdx = 0; colorIdx < COLORS_PER_PIXEL; colorIdx++) {
+            uint8 twoBits = (byte >> (colorIdx * DEFAULT_BITS_PER_COLOR)) & 0b00000011;
+            pixel |= twoBits << (colorIdx * 8);
+        }
+        spreadTable[byte] = pixel;
+    }
+}
+
+static void decodeScalar(uint8 *data, const uint8 *carrier, ulong count) {
+    const u32 *pixels = (const u32 *) carrier;
+    // multiplication moves bits of every color next to each other in the top byte
+    for (ulong i = 0; i < count; i++)
+        data[i] = ((pixels[i] & 0x03030303) * 0x01041040) >> 24;
+}
+
+static void encodeScalar(const uint8 *data, uint8 *carrier, ulong count) {
+    u32 *pixels = (u32 *) carrier;
+    for (ulong i = 0; i < count; i++)
+        pixels[i] = (pixels[i] & 0xfcfcfcfc) | spreadTable[data[i]];
+}
+
+static const struct StgCodec codecScalar = {
+    .name = "scalar",
+    .decode = decodeScalar,
+    .encode = encodeScalar,
+    .fpu = false,
+};
+
+#ifdef LIBSTG_X86_64
+
+//// simd
+// registers are not clobbered explicitly in kernel, compiler never touches them there (same as lib/raid6)
+// userspace builds vectorize on their own and have to know
+
+#ifdef __KERNEL__
+#define SIMD_CLOBBERS
+#else
+#define SIMD_CLOBBERS , "xmm0", "xmm1", "xmm2", "xmm3", "xmm4", "xmm5", "xmm6", "xmm7"
+#endif
+
+static const u32 mask03[16] __aligned(64) = {
+    0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303,
+    0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303, 0x03030303,
+};
+static const u32 maskFc[16] __aligned(64) = {
+    0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc,
+    0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc, 0xfcfcfcfc,
+};
+static const u32 maskFf[4] __aligned(16) = { 0xff, 0xff, 0xff, 0xff };
+// byte weights (1, 4) and word weights (1, 16) for pmaddubsw + pmaddwd
+static const u32 weights14[16] __aligned(64) = {
+    0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401,
+    0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401, 0x04010401,
+};
+static const u32 weights116[16] __aligned(64) = {
+    0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001,
+    0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001, 0x00100001,
+};
+// undoes lane interleaving of vpackssdw + vpackuswb
+static const u32 packOrder[8] __aligned(32) = { 0, 4, 1, 5, 2, 6, 3, 7 };
+
+// sse2, 16 pixels per iteration
+// (x & 0x03) | word >> 6 | dword >> 12 leaves the payload byte in the low byte of every pixel
+
+static void decodeSse2(uint8 *data, const uint8 *carrier, ulong count) {
+    const u32 *pixels = (const u32 *) carrier;
+    ulong i;
+    for (i = 0; i + 16 <= count; i += 16) {
+        asm volatile(
+            "movdqa %[m3], %%xmm6\n\t"
+            "movdqa %[mff], %%xmm7\n\t"
+#define SSE2_GATHER(x) \
+            "movdqu " #x "*16(%[src]), %%xmm" #x "\n\t" \
+            "pand %%xmm6, %%xmm" #x "\n\t" \
+            "movdqa %%xmm" #x ", %%xmm4\n\t" \
+            "psrlw $6, %%xmm4\n\t" \
+            "por %%xmm4, %%xmm" #x "\n\t" \
+            "movdqa %%xmm" #x ", %%xmm4\n\t" \
+            "psrld $12, %%xmm4\n\t" \
+            "por %%xmm4, %%xmm" #x "\n\t" \
+            "pand %%xmm7, %%xmm" #x "\n\t"
+            SSE2_GATHER(0)
+            SSE2_GATHER(1)
+            SSE2_GATHER(2)
+            SSE2_GATHER(3)
+#undef SSE2_GATHER
+            "packssdw %%xmm1, %%xmm0\n\t"
+            "packssdw %%xmm3, %%xmm2\n\t"
+            "packuswb %%xmm2, %%xmm0\n\t"
+            "movdqu %%xmm0, (%[dst])\n\t"
+            :
+            : [src] "r" (pixels + i), [dst] "r" (data + i),
+              [m3] "m" (mask03), [mff] "m" (maskFf)
+            : "memory" SIMD_CLOBBERS);
+    }
+    decodeScalar(data + i, carrier + i * sizeof(u32), count - i);
+}
+
+// byte is zero extended to a dword and spread with x | x << 6 | x << 12 | x << 18
+
+static void encodeSse2(const uint8 *data, uint8 *carrier, ulong count) {
+    u32 *pixels = (u32 *) carrier;
+    ulong i;
+    for (i = 0; i + 16 <= count; i += 16) {
+        asm volatile(
+            "pxor %%xmm7, %%xmm7\n\t"
+            "movdqa %[m3], %%xmm6\n\t"
+            "movdqu (%[src]), %%xmm1\n\t"
+            "movdqa %%xmm1, %%xmm3\n\t"
+            "punpcklbw %%xmm7, %%xmm1\n\t"
+            "punpckhbw %%xmm7, %%xmm3\n\t"
+            "movdqa %%xmm1, %%xmm0\n\t"
+            "movdqa %%xmm3, %%xmm2\n\t"
+            "punpcklwd %%xmm7, %%xmm0\n\t"
+            "punpckhwd %%xmm7, %%xmm1\n\t"
+            "punpcklwd %%xmm7, %%xmm2\n\t"
+            "punpckhwd %%xmm7, %%xmm3\n\t"
+#define SSE2_SCATTER(x) \
+            "movdqa %%xmm" #x ", %%xmm4\n\t" \
+            "pslld $6, %%xmm4\n\t" \
+            "por %%xmm4, %%xmm" #x "\n\t" \
+            "movdqa %%xmm" #x ", %%xmm4\n\t" \
+            "pslld $12, %%xmm4\n\t" \
+            "por %%xmm4, %%xmm" #x "\n\t" \
+            "pand %%xmm6, %%xmm" #x "\n\t" \
+            "movdqu " #x "*16(%[dst]), %%xmm5\n\t" \
+            "pand %[mfc], %%xmm5\n\t" \
+            "por %%xmm5, %%xmm" #x "\n\t" \
+            "movdqu %%xmm" #x ", " #x "*16(%[dst])\n\t"
+            SSE2_SCATTER(0)
+            SSE2_SCATTER(1)
+            SSE2_SCATTER(2)
+            SSE2_SCATTER(3)
+#undef SSE2_SCATTER
+            :
+            : [src] "r" (data + i), [dst] "r" (pixels + i),
+              [m3] "m" (mask03), [mfc] "m" (maskFc)
+            : "memory" SIMD_CLOBBERS);
+    }
+    encodeScalar(data + i, carrier + i * sizeof(u32), count - i);
+}
+
+static const struct StgCodec codecSse2 = {
+    .name = "sse2",
+    .decode = decodeSse2,
+    .encode = encodeSse2,
+    .fpu = true,
+};
+
+// avx2, 32 pixels per iteration
+// pmaddubsw and pmaddwd with weights (1, 4) and (1, 16) assemble the byte in one dword
+
+static void decodeAvx2(uint8 *data, const uint8 *carrier, ulong count) {
+    const u32 *pixels = (const u32 *) carrier;
+    ulong i;
+    for (i = 0; i + 32 <= count; i += 32) {
+        asm volatile(
+            "vmovdqa %[m3], %%ymm4\n\t"
+            "vmovdqa %[w14], %%ymm5\n\t"
+            "vmovdqa %[w116], %%ymm6\n\t"
+            "vmovdqa %[order], %%ymm7\n\t"
+#define AVX2_GATHER(x) \
+            "vpand " #x "*32(%[src]), %%ymm4, %%ymm" #x "\n\t" \
+            "vpmaddubsw %%ymm5, %%ymm" #x ", %%ymm" #x "\n\t" \
+            "vpmaddwd %%ymm6, %%ymm" #x ", %%ymm" #x "\n\t"
+            AVX2_GATHER(0)
+            AVX2_GATHER(1)
+            AVX2_GATHER(2)
+            AVX2_GATHER(3)
+#undef AVX2_GATHER
+            "vpackssdw %%ymm1, %%ymm0, %%ymm0\n\t"
+            "vpackssdw %%ymm3, %%ymm2, %%ymm2\n\t"
+            "vpackuswb %%ymm2, %%ymm0, %%ymm0\n\t"
+            "vpermd %%ymm0, %%ymm7, %%ymm0\n\t"
+            "vmovdqu %%ymm0, (%[dst])\n\t"
+            :
+            : [src] "r" (pixels + i), [dst] "r" (data + i),
+              [m3] "m" (mask03), [w14] "m" (weights14), [w116] "m" (weights116), [order] "m" (packOrder)
+            : "memory" SIMD_CLOBBERS);
+    }
+    asm volatile("vzeroupper" ::: "memory");
+    decodeScalar(data + i, carrier + i * sizeof(u32), count - i);
+}
+
+static void encodeAvx2(const uint8 *data, uint8 *carrier, ulong count) {
+    u32 *pixels = (u32 *) carrier;
+    ulong i;
+    for (i = 0; i + 32 <= count; i += 32) {
+        asm volatile(
+            "vmovdqa %[m3], %%ymm6\n\t"
+            "vmovdqa %[mfc], %%ymm7\n\t"
+#define AVX2_SCATTER(x) \
+            "vpmovzxbd " #x "*8(%[src]), %%ymm" #x "\n\t" \
+            "vpslld $6, %%ymm" #x ", %%ymm4\n\t" \
+            "vpor %%ymm4, %%ymm" #x ", %%ymm" #x "\n\t" \
+            "vpslld $12, %%ymm" #x ", %%ymm4\n\t" \
+            "vpor %%ymm4, %%ymm" #x ", %%ymm" #x "\n\t" \
+            "vpand %%ymm6, %%ymm" #x ", %%ymm" #x "\n\t" \
+            "vpand " #x "*32(%[dst]), %%ymm7, %%ymm5\n\t" \
+            "vpor %%ymm5, %%ymm" #x ", %%ymm" #x "\n\t" \
+            "vmovdqu %%ymm" #x ", " #x "*32(%[dst])\n\t"
+            AVX2_SCATTER(0)
+            AVX2_SCATTER(1)
+            AVX2_SCATTER(2)
+            AVX2_SCATTER(3)
+#undef AVX2_SCATTER
+            :
+            : [src] "r" (data + i), [dst] "r" (pixels + i),
+              [m3] "m" (mask03), [mfc] "m" (maskFc)
+            : "memory" SIMD_CLOBBERS);
+    }
+    asm volatile("vzeroupper" ::: "memory");
+    encodeScalar(data + i, carrier + i * sizeof(u32), count - i);
+}
+
+static const struct StgCodec codecAvx2 = {
+    .name = "avx2",
+    .decode = decodeAvx2,
+    .encode = encodeAvx2,
+    .fpu = true,
+};
+
+// avx-512bw, 64 pixels per iteration
+// same weights as avx2, vpmovdb narrows dwords without any lane fixup, vpternlogd merges bits
+
+static void decodeAvx512(uint8 *data, const uint8 *carrier, ulong count) {
+    const u32 *pixels = (const u32 *) carrier;
+    ulong i;
+    for (i = 0; i + 64 <= count; i += 64) {
+        asm volatile(
+            "vmovdqa64 %[m3], %%zmm4\n\t"
+            "vmovdqa64 %[w14], %%zmm5\n\t"
+            "vmovdqa64 %[w116], %%zmm6\n\t"
+#define AVX512_GATHER(x) \
+            "vpandd " #x "*64(%[src]), %%zmm4, %%zmm" #x "\n\t" \
+            "vpmaddubsw %%zmm5, %%zmm" #x ", %%zmm" #x "\n\t" \
+            "vpmaddwd %%zmm6, %%zmm" #x ", %%zmm" #x "\n\t" \
+            "vpmovdb %%zmm" #x ", " #x "*16(%[dst])\n\t"
+            AVX512_GATHER(0)
+            AVX512_GATHER(1)
+            AVX512_GATHER(2)
+            AVX512_GATHER(3)
+#undef AVX512_GATHER
+            :
+            : [src] "r" (pixels + i), [dst] "r" (data + i),
+              [m3] "m" (mask03), [w14] "m" (weights14), [w116] "m" (weights116)
+            : "memory" SIMD_CLOBBERS);
+    }
+    asm volatile("vzeroupper" ::: "memory");
+    decodeScalar(data + i, carrier + i * sizeof(u32), count - i);
+}
+
+static void encodeAvx512(const uint8 *data, uint8 *carrier, ulong count) {
+    u32 *pixels = (u32 *) carrier;
+    ulong i;
+    for (i = 0; i + 64 <= count; i += 64) {
+        asm volatile(
+            "vmovdqa64 %[m3], %%zmm6\n\t"
+#define AVX512_SCATTER(x) \
+            "vpmovzxbd " #x "*16(%[src]), %%zmm" #x "\n\t" \
+            "vpslld $6, %%zmm" #x ", %%zmm4\n\t" \
+            "vpord %%zmm4, %%zmm" #x ", %%zmm" #x "\n\t" \
+            "vpslld $12, %%zmm" #x ", %%zmm4\n\t" \
+            "vpord %%zmm4, %%zmm" #x ", %%zmm" #x "\n\t" \
+            "vmovdqu32 " #x "*64(%[dst]), %%zmm5\n\t" \
+            "vpternlogd $0xd8, %%zmm6, %%zmm" #x ", %%zmm5\n\t" \
+            "vmovdqu32 %%zmm5, " #x "*64(%[dst])\n\t"
+            AVX512_SCATTER(0)
+            AVX512_SCATTER(1)
+            AVX512_SCATTER(2)
+            AVX512_SCATTER(3)
+#undef AVX512_SCATTER
+            :
+            : [src] "r" (data + i), [dst] "r" (pixels + i),
+              [m3] "m" (mask03)
+            : "memory" SIMD_CLOBBERS);
+    }
+    asm volatile("vzeroupper" ::: "memory");
+    encodeScalar(data + i, carrier + i * sizeof(u32), count - i);
+}
+
+static const struct StgCodec codecAvx512 = {
+    .name = "avx512bw",
+    .decode = decodeAvx512,
+    .encode = encodeAvx512,
+    .fpu = true,
+};
+
+#endif
+
+//// other layouts
+// one function per (bits, channels) pair, constants fold the loops into straight shifts and masks
+
+static __always_inline void decodeGroups(uint8 *data, const uint8 *carrier, ulong groups, const uint bits, const uint channels) {
+    const uint groupPixels = LAYOUT_GROUP_PIXELS(bits, channels);
+    const uint groupBytes = LAYOUT_GROUP_BYTES(bits, channels);
+
+    for (ulong g = 0; g < groups; g++) {
+        u32 acc = 0;
+        uint shift = 0;
+#pragma GCC unroll 8
+        for (uint p = 0; p < groupPixels; p++) {
+#pragma GCC unroll 4
+            for (uint c = 0; c < COLORS_PER_PIXEL; c++) {
+                if (!(channels & (1 << c))) continue;
+                acc |= (u32) (carrier[p * COLORS_PER_PIXEL + c] & ((1 << bits) - 1)) << shift;
+                shift += bits;
+            }
+        }
+#pragma GCC unroll 4
+        for (uint k = 0; k < groupBytes; k++)
+            data[k] = acc >> (8 * k);
+        data += groupBytes;
+        carrier += groupPixels * COLORS_PER_PIXEL;
+    }
+}
+
+static __always_inline void encodeGroups(const uint8 *data, uint8 *carrier, ulong groups, const uint bits, const uint channels) {
+    const uint groupPixels = LAYOUT_GROUP_PIXELS(bits, channels);
+    const uint groupBytes = LAYOUT_GROUP_BYTES(bits, channels);
+
+    for (ulong g = 0; g < groups; g++) {
+        u32 acc = 0;
+#pragma GCC unroll 4
+        for (uint k = 0; k < groupBytes; k++)
+            acc |= (u32) data[k] << (8 * k);
+#pragma GCC unroll 8
+        for (uint p = 0; p < groupPixels; p++) {
+#pragma GCC unroll 4
+            for (uint c = 0; c < COLORS_PER_PIXEL; c++) {
+                uint8 *color = &carrier[p * COLORS_PER_PIXEL + c];
+                if (!(channels & (1 << c))) continue;
+                *color = (*color & ~((1 << bits) - 1)) | (acc & ((1 << bits) - 1));
+                acc >>= bits;
+            }
+        }
+        data += groupBytes;
+        carrier += groupPixels * COLORS_PER_PIXEL;
+    }
+}
+
+#define LAYOUT_KERNELS(bits, channels) \
+static void decode_##bits##_##channels(uint8 *data, const uint8 *carrier, ulong groups) { \
+    decodeGroups(data, carrier, groups, bits, channels); \
+} \
+static void encode_##bits##_##channels(const uint8 *data, uint8 *carrier, ulong groups) { \
+    encodeGroups(data, carrier, groups, bits, channels); \
+}
+
+#define LAYOUT_ENTRY(bits, channels) \
+    [LAYOUT_BITS_IDX(bits)][channels] = { decode_##bits##_##channels, encode_##bits##_##channels },
+
+#define FOR_EACH_CHANNELS(X, bits) \
+    X(bits, 1) X(bits, 2) X(bits, 3) X(bits, 4) X(bits, 5) X(bits, 6) X(bits, 7) X(bits, 8) \
+    X(bits, 9) X(bits, 10) X(bits, 11) X(bits, 12) X(bits, 13) X(bits, 14) X(bits, 15)
+
+#define FOR_EACH_LAYOUT(X) \
+    FOR_EACH_CHANNELS(X, 1) FOR_EACH_CHANNELS(X, 2) FOR_EACH_CHANNELS(X, 4)
+
+FOR_EACH_LAYOUT(LAYOUT_KERNELS)
+
+static const struct {
+    groupDecoder_t decode;
+    groupEncoder_t encode;
+} layoutKernels[3][16] = {
+    FOR_EACH_LAYOUT(LAYOUT_ENTRY)
+};
+
+//// dispatch
+
+// slowest first
+static const struct StgCodec *const stgCodecs[] = {
+    &codecScalar,
+#ifdef LIBSTG_X86_64
+    &codecSse2,
+    &codecAvx2,
+    &codecAvx512,
+#endif
+};
+
+static const struct StgCodec *stgCodec = &codecScalar;
+
+static bool codecUsable(const struct StgCodec *codec) {
+#if defined(__KERNEL__) && defined(CONFIG_X86_64)
+    if (codec == &codecAvx512)
+        return boot_cpu_has(X86_FEATURE_AVX512F) && boot_cpu_has(X86_FEATURE_AVX512BW) &&
+                cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM | XFEATURE_MASK_AVX512, NULL);
+    if (codec == &codecAvx2)
+        return boot_cpu_has(X86_FEATURE_AVX2) && cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+    if (codec == &codecSse2)
+        return boot_cpu_has(X86_FEATURE_XMM2);
+#elif defined(LIBSTG_X86_64)
+    // libgcc also checks that the os saves the registers
+    if (codec == &codecAvx512)
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    if (codec == &codecAvx2)
+        return __builtin_cpu_supports("avx2");
+    if (codec == &codecSse2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return codec == &codecScalar;
+}
+
+void codecInit(void) {
+    initSpreadTable();
+    stgCodec = &codecScalar;
+    for (uint i = 0; i < ARRAY_SIZE(stgCodecs); i++)
+        if (codecUsable(stgCodecs[i]))
+            stgCodec = stgCodecs[i];
+    printInfo("using %s codec\n", stgCodec->name);
+}
+
+const char *codecName(void) {
+    return stgCodec->name;
+}
+
+// overrides the detected codec, layouts initialized before keep theirs
+int codecSelect(const char *name) {
+    for (uint i = 0; i < ARRAY_SIZE(stgCodecs); i++) {
+        if (strcmp(stgCodecs[i]->name, name)) continue;
+        if (!codecUsable(stgCodecs[i])) return -EOPNOTSUPP;
+        stgCodec = stgCodecs[i];
+        return 0;
+    }
+    return -EINVAL;
+}
+
+int layoutInit(struct StgLayout *layout, uint8 bits, uint8 channels) {
+    if ((bits != 1 && bits != 2 && bits != 4) || channels == 0 || channels > 0xf)
+        return -EINVAL;
+
+    layout->bits = bits;
+    layout->channels = channels;
+    layout->groupPixels = LAYOUT_GROUP_PIXELS(bits, channels);
+    layout->groupBytes = LAYOUT_GROUP_BYTES(bits, channels);
+    layout->groupSize = layout->groupPixels * COLORS_PER_PIXEL;
+    layout->dataMask = 0;
+    for (uint color = 0; color < COLORS_PER_PIXEL; color++)
+        if (channels & (1 << color))
+            layout->dataMask |= ((1u << bits) - 1) << (color * 8);
+    if (bits == 2 && channels == 0xf) {
+        layout->decode = stgCodec->decode;
+        layout->encode = stgCodec->encode;
+        layout->fpu = stgCodec->fpu;
+    } else {
+        layout->decode = layoutKernels[LAYOUT_BITS_IDX(bits)][channels].decode;
+        layout->encode = layoutKernels[LAYOUT_BITS_IDX(bits)][channels].encode;
+        layout->fpu = false;
+    }
+    return 0;
+}
+
+static void runDecoder(const struct StgLayout *layout, uint8 *data, const uint8 *carrier, ulong groups) {
+#ifdef CONFIG_X86_64
+    if (layout->fpu) {
+        kernel_fpu_begin();
+        layout->decode(data, carrier, groups);
+        kernel_fpu_end();
+        return;
+    }
+#endif
+    layout->decode(data, carrier, groups);
+}
+
+static void runEncoder(const struct StgLayout *layout, const uint8 *data, uint8 *carrier, ulong groups) {
+#ifdef CONFIG_X86_64
+    if (layout->fpu) {
+        kernel_fpu_begin();
+        layout->encode(data, carrier, groups);
+        kernel_fpu_end();
+        return;
+    }
+#endif
+    layout->encode(data, carrier, groups);
+}
+
+// carrier points to the group holding the first byte, skip is the position of that byte in the group
+void codecDecode(const struct StgLayout *layout, uint8 *data, const uint8 *carrier, ulong skip, ulong size) {
+    uint8 group[LAYOUT_MAX_GROUP_BYTES];
+    ulong groups;
+
+    if (skip) {
+        ulong len = min(size, layout->groupBytes - skip);
+        layout->decode(group, carrier, 1);
+        memcpy(data, group + skip, len);
+        data += len;
+        size -= len;
+        carrier += layout->groupSize;
+    }
+
+    groups = size / layout->groupBytes;
+    if (groups) {
+        runDecoder(layout, data, carrier, groups);
+        data += groups * layout->groupBytes;
+        size -= groups * layout->groupBytes;
+        carrier += groups * layout->groupSize;
+    }
+
+    if (size) {
+        layout->decode(group, carrier, 1);
+        memcpy(data, group, size);
+    }
+}
+
+// partial groups at the edges are decoded, patched and encoded again
+void codecEncode(const struct StgLayout *layout, const uint8 *data, uint8 *carrier, ulong skip, ulong size) {
+    uint8 group[LAYOUT_MAX_GROUP_BYTES];
+    ulong groups;
+
+    if (skip) {
+        ulong len = min(size, layout->groupBytes - skip);
+        layout->decode(group, carrier, 1);
+        memcpy(group + skip, data, len);
+        layout->encode(group, carrier, 1);
+        data += len;
+        size -= len;
+        carrier += layout->groupSize;
+    }
+
+    groups = size / layout->groupBytes;
+    if (groups) {
+        runEncoder(layout, data, carrier, groups);
+        data += groups * layout->groupBytes;
+        size -= groups * layout->groupBytes;
+        carrier += groups * layout->groupSize;
+    }
+
+    if (size) {
+        layout->decode(group, carrier, 1);
+        memcpy(group, data, size);
+        layout->encode(group, carrier, 1);
+    }
+}
+
+// encodes zeros without a payload, whole groups only lose their data bits
+void codecZero(const struct StgLayout *layout, uint8 *carrier, ulong skip, ulong size) {
+    static const uint8 zeros[LAYOUT_MAX_GROUP_BYTES];
+    uint *pixel;
+    ulong pixels;
+
+    if (skip) {
+        ulong len = min(size, layout->groupBytes - skip);
+        codecEncode(layout, zeros, carrier, skip, len);
+        size -= len;
+        carrier += layout->groupSize;
+    }
+
+    pixels = size / layout->groupBytes * layout->groupPixels;
+    pixel = (uint *) carrier;
+    for (ulong i = 0; i < pixels; i++)
+        pixel[i] &= ~layout->dataMask;
+    size %= layout->groupBytes;
+    carrier += pixels * COLORS_PER_PIXEL;
+
+    if (size)
+        codecEncode(layout, zeros, carrier, 0, size);
+}
+
+//// rows
+
+// carrier holds groups from group on as they are in the file, every row is coded in one run
+// data is NULL when zeroing, carrier is only read when decoding
+static void codecRows(const struct StgLayout *layout, uint rowSize, uint rowGroups, uint8 *data, uint8 *carrier, ulong group, ulong skip, ulong size, bool decode) {
+    while (size > 0) {
+        ulong left = rowGroupsLeft(rowGroups, group);
+        ulong len = rowGroups ? min(size, left * layout->groupBytes - skip) : size;
+
+        if (decode)
+            codecDecode(layout, data, carrier, skip, len);
+        else if (data)
+            codecEncode(layout, data, carrier, skip, len);
+        else
+            codecZero(layout, carrier, skip, len);
+
+        if (data) data += len;
+        size -= len;
+        if (size == 0) break;
+        // runs end with their row, the next one starts a row
+        carrier += left * layout->groupSize + rowSize - rowGroups * layout->groupSize;
+        group += left;
+        skip = 0;
+    }
+}
+
+void codecDecodeRows(const struct StgLayout *layout, uint rowSize, uint rowGroups, uint8 *data, const uint8 *carrier, ulong group, ulong skip, ulong size) {
+    codecRows(layout, rowSize, rowGroups, data, (uint8 *) carrier, group, skip, size, true);
+}
+
+void codecEncodeRows(const struct StgLayout *layout, uint rowSize, uint rowGroups, const uint8 *data, uint8 *carrier, ulong group, ulong skip, ulong size) {
+    codecRows(layout, rowSize, rowGroups, (uint8 *) data, carrier, group, skip, size, false);
+}
+
+void codecZeroRows(const struct StgLayout *layout, uint rowSize, uint rowGroups, uint8 *carrier, ulong group, ulong skip, ulong size) {
+    codecRows(layout, rowSize, rowGroups, NULL, carrier, group, skip, size, false);
+}
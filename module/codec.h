@@ -0,0 +1,15 @@
+#include "libstg.h"
+
+void codecInit(void);
+const char *codecName(void);
+int codecSelect(const char *name);
+
+int layoutInit(struct StgLayout *layout, uint8 bits, uint8 channels);
+
+void codecDecode(const struct StgLayout *layout, uint8 *data, const uint8 *carrier, ulong skip, ulong size);
+void codecEncode(const struct StgLayout *layout, const uint8 *data, uint8 *carrier, ulong skip, ulong size);
+void codecZero(const struct StgLayout *layout, uint8 *carrier, ulong skip, ulong size);
+
+void codecDecodeRows(const struct StgLayout *layout, uint rowSize, uint rowGroups, uint8 *data, const uint8 *carrier, ulong group, ulong skip, ulong size);
+void codecEncodeRows(const struct StgLayout *layout, uint rowSize, uint rowGroups, const uint8 *data, uint8 *carrier, ulong group, ulong skip, ulong size);
+void codecZeroRows(const struct StgLayout *layout, uint rowSize, uint rowGroups, uint8 *carrier, ulong group, ulong skip, ulong size);
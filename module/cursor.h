@@ -0,0 +1,74 @@
+#ifndef STG_CURSOR_H
+#define STG_CURSOR_H
+
+#include "definitions.h"
+
+// walks payload of a bio chain, one multi-page bvec at a time
+
+static inline void cursorInit(struct StgCursor *cur, struct bio *bio) {
+    cur->bio = bio;
+    cur->iter = bio->bi_iter;
+}
+
+// returns current contiguous piece of payload
+static inline uint8 *cursorMap(struct StgCursor *cur, ulong *len) {
+    struct bio_vec bv = mp_bvec_iter_bvec(cur->bio->bi_io_vec, cur->iter);
+    *len = bv.bv_len;
+    return page_address(bv.bv_page) + bv.bv_offset;
+}
+
+// bytes can't go past the current piece
+static inline void cursorAdvance(struct StgCursor *cur, ulong bytes) {
+    bio_advance_iter_single(cur->bio, &cur->iter, bytes);
+    if (cur->iter.bi_size == 0 && cur->bio->bi_next) {
+        cur->bio = cur->bio->bi_next;
+        cur->iter = cur->bio->bi_iter;
+    }
+}
+
+static inline void cursorSkip(struct StgCursor *cur, ulong size) {
+    while (size > 0) {
+        ulong len;
+        cursorMap(cur, &len);
+        len = min(len, size);
+        cursorAdvance(cur, len);
+        size -= len;
+    }
+}
+
+static inline void cursorZero(struct StgCursor *cur, ulong size) {
+    while (size > 0) {
+        ulong len;
+        uint8 *data = cursorMap(cur, &len);
+        len = min(len, size);
+        memset(data, 0, len);
+        cursorAdvance(cur, len);
+        size -= len;
+    }
+}
+
+static inline void cursorCopyTo(struct StgCursor *cur, const void *src, ulong size) {
+    while (size > 0) {
+        ulong len;
+        uint8 *data = cursorMap(cur, &len);
+        len = min(len, size);
+        memcpy(data, src, len);
+        cursorAdvance(cur, len);
+        src += len;
+        size -= len;
+    }
+}
+
+static inline void cursorCopyFrom(struct StgCursor *cur, void *dst, ulong size) {
+    while (size > 0) {
+        ulong len;
+        uint8 *data = cursorMap(cur, &len);
+        len = min(len, size);
+        memcpy(dst, data, len);
+        cursorAdvance(cur, len);
+        dst += len;
+        size -= len;
+    }
+}
+
+#endif
@@ -1,19 +1,45 @@
+#ifndef STG_DEFINITIONS_H
+#define STG_DEFINITIONS_H
+
 #include <linux/fs.h>
 #include <linux/blk-mq.h>
+#include <linux/moduleparam.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <linux/mempool.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/xarray.h>
+#include <linux/shrinker.h>
+#include <linux/bitops.h>
+#include <linux/bio.h>
+#include <linux/mm.h>
+#include <linux/sizes.h>
+#include <linux/wait.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/lcm.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
+#include <linux/ktime.h>
+#include <linux/namei.h>
+#include <linux/stat.h>
+#include <linux/cpuhotplug.h>
+#include <linux/cred.h>
+#include <linux/path.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,12,0)
+#include <linux/unaligned.h>
+#else
+#include <asm/unaligned.h>
+#endif
 
-//// types
-
-// TODO: fix all of those to proper u16, u32, etc.
-#define uint unsigned int
-#define uint8 unsigned char
-#define uint16 unsigned short
-#define ulong unsigned long
-
-//// macros
-
-#define printInfo(...)  printk(KERN_INFO  "stg_blkdev: " __VA_ARGS__)
-#define printError(...) printk(KERN_ERR   "stg_blkdev: " __VA_ARGS__)
-#define printDebug(...) printk(KERN_DEBUG "stg_blkdev: " __VA_ARGS__)
+#include "libstg.h"
 
 //// block device
 
@@ -26,19 +52,42 @@
 
 #define IOCTL_DEV_ADD 55001
 #define IOCTL_DEV_REMOVE 55002
+#define IOCTL_DEV_ADD_ASYNC 55003 // returns the name right away, the device is set up in the background
+#define IOCTL_DEV_ADD_ARGS 55004 // takes struct StgAddArgs with tuning of the device
 #define MAX_BACKING_LEN 1024
 
-#define RW_BUF_SIZE PAGE_SIZE
-#define RW_BUF_PIXELS (PAGE_SIZE / COLORS_PER_PIXEL)
+// carrier bytes read at once, default sized requests fit in one read
+#define RW_BUF_SIZE SZ_512K
+#define RW_BUF_PAGES (RW_BUF_SIZE >> PAGE_SHIFT)
+
+// largest request the block layer builds, parts of it are coded on several cpus
+#define MAX_REQUEST_SIZE SZ_8M
+
+// tuning of one device, taken from module parameters and overridden by StgAddArgs
+struct DevParams {
+    uint hwQueues;    // 0 = one per online cpu
+    uint queueDepth;
+    uint cacheMb;
+    uint writebackMb;
+    uint writebackMs;
+    uint blockSize;
+    uint splitKb;
+    bool directIo;
+    bool zeroCopy;
+    bool readOnly;
+};
 
 struct SteganographyBlockDevice {
     int devMajor;
     char letter;
     sector_t capacity;
+    uint nrHwQueues;
     struct blk_mq_tag_set tag_set;
     struct request_queue *queue;
     struct gendisk *gdisk;
+    struct workqueue_struct *wq;
     struct BmpStorage *bmpS;
+    bool ready; // set up and added, until then it can't be removed
 
     struct SteganographyBlockDevice *pnext;
 };
@@ -55,18 +104,148 @@ struct SteganographyControlDevice {
     struct SteganographyBlockDevice *pnext;
 };
 
+// lives in the request pdu, allocated by blk-mq together with the tag set
 struct SbdWorker {
     struct work_struct work;
     struct request *rq;
+    u64 queued; // ns
+    int err;    // of requestHandler, the request ends with it
+};
+
+// position in the payload of a request
+struct StgCursor {
+    struct bio *bio;
+    struct bvec_iter iter;
+};
+
+// one chunk of carrier, read and written asynchronously through the backing file
+struct CarrierIo {
+    void *buf;
+    struct bio_vec bvecs[RW_BUF_PAGES]; // pages of buf, set up once
+    struct kiocb iocb;
+    struct completion done;
+    loff_t pos;  // carrier range in the buffer, widened to whole blocks for direct I/O
+    ulong size;
+    uint lead;   // bytes in front of the chunk
+    bool direct;
+    long ret;
+    bool inFlight;
+    u64 start; // ns
+    u64 end;
+    uint16 idx; // carrier, for tracing
+};
+
+// two chunks, so carrier I/O of one overlaps codec work on the other
+struct Bounce {
+    struct CarrierIo io[2];
+};
+
+// rewrites of blocks or groups shared by neighbouring requests are serialized
+#define DIO_EDGE_LOCKS 64
+
+// large requests are coded on several cpus, bigger ones are planned this many bytes at a time
+#define SPLIT_WINDOW SZ_4M
+
+// per cpu bounce, taken with trylock, mempool is used when it's busy
+#define BOUNCE_POOL_SIZE 4
+
+struct BounceBuffer {
+    struct mutex lock;
+    struct Bounce *bounce;
+};
+
+//// statistics
+
+#define STATS_BUCKETS 32 // bucket n counts latencies from 2^n to 2^(n+1) ns
+
+enum StatsPhase {
+    STATS_QUEUE,   // from queue_rq to the worker
+    STATS_CARRIER, // one carrier chunk, from submission to completion
+    STATS_CODEC,   // decoding or encoding of one chunk
+    STATS_TOTAL,   // whole request, from queue_rq to completion
+    STATS_PHASES,
+};
+
+// per cpu, summed when read, index 0 is read and 1 is write
+struct StgStats {
+    u64 ios[2];
+    u64 bytes[2];
+    u64 carrierIos[2];
+    u64 carrierBytes[2];
+    u64 cacheHits;
+    u64 cacheMisses;
+    u64 time[STATS_PHASES]; // ns
+    u64 latency[STATS_PHASES][STATS_BUCKETS];
+};
+
+//// decoded block cache
+
+#define CACHE_BLOCK_SHIFT 12
+#define CACHE_BLOCK_SIZE (1 << CACHE_BLOCK_SHIFT)
+#define CACHE_RUN_BLOCKS 32 // misses decoded and published together
+
+enum CacheBlockState {
+    CACHE_LOADING,  // reserved by a reader, data is being decoded
+    CACHE_VALID,    // data matches carriers, block is on the lru list
+    CACHE_STALE,    // written while loading, dropped when reader is done
+    CACHE_DIRTY,    // data is newer than carriers, block is marked in the xarray
+    CACHE_FLUSHING, // being encoded by the flusher, goes back to dirty if written again
+};
+
+#define CACHE_DIRTY_MARK XA_MARK_0 // dirty blocks are found in index order
+
+struct CacheBlock {
+    struct list_head lru; // only clean blocks are on the lru list
+    pgoff_t idx;
+    enum CacheBlockState state;
+    void *data;
+};
+
+struct BlockCache {
+    struct xarray blocks; // xa_lock protects everything below
+    struct list_head lru; // most recently used first
+    ulong nrBlocks;
+    ulong maxBlocks; // 0 means cache is disabled
+    ulong nrDirty;   // dirty and flushing blocks, they can't be evicted
+    ulong maxDirty;  // 0 means write-through
+    wait_queue_head_t dirtyWait; // writers throttled by maxDirty
+    struct shrinker shrinker;
+    bool shrinkerRegistered;
+};
+
+//// write-back
+
+struct WriteBack {
+    struct task_struct *thread; // NULL means write-through
+    wait_queue_head_t wait;
+    bool kicked;                // dirty memory is over the background limit
+    struct mutex lock;          // one flusher at a time
+    ulong expire;               // jiffies between background flushes
+};
+
+//// written extents
+
+struct ExtentMap {
+    struct file *fd;    // sidecar, NULL means there's no map and everything counts as written
+    ulong *bits;        // set once the extent was written
+    ulong *dirty;       // pages of bits that aren't in the sidecar yet
+    ulong nrExtents;
+    ulong size;         // bytes of the storage
+    uint8 shift;
+    struct mutex lock;  // serializes changes of bits, first writes zero the rest of their extents under it
+    struct mutex syncLock;
 };
 
 //// bmp
 
-#define COLORS_PER_PIXEL 4
-#define USED_BITS_PER_PIXEL 2
 #define BMP_HEADER_SIZE 54
 #define BMP_IDX_OFFSET 6
 #define BMP_COUNT_OFFSET 8
+#define BMP_LAYOUT_OFFSET 50 // "important colors", ignored by readers
+#define BMP_STRIPE_OFFSET 52
+
+// files of a folder opened and their headers read at once while a device is added
+#define PROBE_MAX_ACTIVE 64
 
 struct Bmp {
     struct file *fd;
@@ -79,16 +258,46 @@ struct Bmp {
     uint headerSize;
     uint rowSize;
     uint8 padding;
+    uint16 depth;   // bits per pixel, 24 or 32
+    uint rowGroups; // groups in a row of a 24-bit carrier, 0 when groups run across rows
+
+    uint8 bits;
+    uint8 channels;
+    uint8 stripeShift;
+
+    const struct StgLayout *layout; // of the storage, or its packed variant for 24-bit carriers
+    uint dioAlign; // block size of direct I/O, 0 means buffered
+    bool zeroCopy; // codec works on page cache of the carrier
+    struct StgStats __percpu *stats; // of the storage
+    ulong *unsynced; // of the storage, bit idx is set once the carrier is written and cleared by the flush syncing it
 
     ulong virtualSize;
     ulong virtualOffset;
-
-    struct Bmp* pnext;
 };
 
 struct BmpStorage {
-    struct Bmp *bmps;
+    struct Bmp **bmps; // sorted by idx and virtualOffset
+
     uint16 count;
     ulong totalVirtualSize;
     char* backingPath;
+    struct path folder;      // looked up by the caller of add, files of the folder are opened relative to it
+    const struct cred *cred; // of the caller of add, workers open files with it
+    struct StgLayout layout;
+    struct StgLayout packedLayout; // every color carries data, used by 24-bit carriers
+    uint8 stripeShift; // 0 concatenates carriers, otherwise they take turns in chunks of 1 << stripeShift bytes
+    bool directIo; // carriers bypass page cache where the backing filesystem allows it
+    bool zeroCopy; // carriers are coded in their page cache, takes precedence over directIo
+    bool readOnly; // carriers and the extent map are opened read-only, writes fail before reaching them
+    ulong splitBytes; // requests of twice as much are cut into parts coded in parallel, 0 disables it
+    struct list_head splitPlans; // free plans of split windows, allocated with the storage
+    spinlock_t splitLock;
+    uint splitMaxPieces; // pieces a plan holds
+    struct StgStats __percpu *stats;
+    ulong *unsynced; // carriers written since the last flush, by idx
+    struct BlockCache cache;
+    struct WriteBack wb;
+    struct ExtentMap extents;
 };
+
+#endif
@@ -17,18 +17,12 @@ int iterate_dir_callback(struct dir_context *ctx, const char *name, int namlen,
 
 #endif
 
-int readdir(const char* path, readdir_t filler, void* context) {
-    int err;
+int readdir(struct file *dir, readdir_t filler, void* context) {
     struct callback_context buf = {
         .ctx.actor = (filldir_t) iterate_dir_callback,
         .context = context,
         .filler = filler
     };
 
-    struct file* dir = filp_open(path, O_DIRECTORY, S_IRWXU | S_IRWXG | S_IRWXO);
-    if(IS_ERR(dir)) return PTR_ERR(dir);
-
-    err = iterate_dir(dir, &buf.ctx);
-    filp_close(dir, NULL);
-    return err;
+    return iterate_dir(dir, &buf.ctx);
 }
@@ -9,4 +9,4 @@ struct callback_context {
     void* context;
 };
 
-int readdir(const char* path, readdir_t filler, void* context);
+int readdir(struct file *dir, readdir_t filler, void* context);
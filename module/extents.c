@@ -0,0 +1,175 @@
+#include "extents.h"
+
+// bits are changed in memory, pages of them are written to the sidecar on flush
+
+static inline ulong bitsBytes(struct ExtentMap *map) {
+    return DIV_ROUND_UP(map->nrExtents, 8);
+}
+
+// sidecar page holding the bit of an extent
+static inline ulong bitsPage(ulong extent) {
+    return extent >> (3 + PAGE_SHIFT);
+}
+
+// a missing or mismatched sidecar only disables the map, the map takes fd over
+int extentsOpen(struct ExtentMap *map, struct file *fd, ulong size) {
+    struct StgExtentsHeader header;
+    loff_t pos = 0;
+    ulong done = 0;
+    int err = 0;
+
+    mutex_init(&map->lock);
+    mutex_init(&map->syncLock);
+    map->fd = NULL;
+
+    if (IS_ERR(fd)) {
+        printInfo("no written extents map, every block is read from carriers\n");
+        return 0;
+    }
+
+    if (kernel_read(fd, &header, sizeof(header), &pos) != sizeof(header) || header.magic != EXTENTS_MAGIC ||
+            header.version != EXTENTS_VERSION || header.shift < SECTOR_SHIFT || header.shift > STRIPE_MAX_SHIFT ||
+            header.nrExtents != DIV_ROUND_UP(size, 1UL << header.shift)) {
+        printInfo("written extents map doesn't match the storage, every block is read from carriers\n");
+        goto closeFile;
+    }
+    map->shift = header.shift;
+    map->nrExtents = header.nrExtents;
+    map->size = size;
+
+    map->bits = kvzalloc(BITS_TO_LONGS(map->nrExtents) * sizeof(ulong), GFP_KERNEL);
+    map->dirty = bitmap_zalloc(DIV_ROUND_UP(bitsBytes(map), PAGE_SIZE), GFP_KERNEL);
+    if (map->bits == NULL || map->dirty == NULL) {
+        printError("failed to allocate written extents map\n");
+        err = -ENOMEM;
+        goto freeBits;
+    }
+    while (done < bitsBytes(map)) {
+        ssize_t ret = kernel_read(fd, (void *) map->bits + done, bitsBytes(map) - done, &pos);
+        if (ret <= 0) {
+            printInfo("written extents map is truncated, every block is read from carriers\n");
+            goto freeBits;
+        }
+        done += ret;
+    }
+
+    map->fd = fd;
+    printInfo("written extents: %u of %lu extents of %lu KiB\n", bitmap_weight(map->bits, map->nrExtents), map->nrExtents, extentSize(map) / 1024);
+    return 0;
+
+freeBits:
+    kvfree(map->bits);
+    bitmap_free(map->dirty);
+    map->bits = map->dirty = NULL;
+closeFile:
+    filp_close(fd, NULL);
+    return err;
+}
+
+void extentsClose(struct ExtentMap *map) {
+    if (map->fd == NULL) return;
+
+    if (extentsSync(map, true))
+        printError("failed to write written extents map, written data may read as zeros\n");
+    filp_close(map->fd, NULL);
+    kvfree(map->bits);
+    bitmap_free(map->dirty);
+    map->fd = NULL;
+    map->bits = map->dirty = NULL;
+}
+
+// writes changed pages of bits, durable also syncs the sidecar
+int extentsSync(struct ExtentMap *map, bool durable) {
+    ulong nrPages, page;
+    int err = 0;
+
+    if (map->fd == NULL) return 0;
+
+    nrPages = DIV_ROUND_UP(bitsBytes(map), PAGE_SIZE);
+    mutex_lock(&map->syncLock);
+    for_each_set_bit(page, map->dirty, nrPages) {
+        ulong offset = page * PAGE_SIZE;
+        ulong len = min(bitsBytes(map) - offset, PAGE_SIZE);
+        loff_t pos = sizeof(struct StgExtentsHeader) + offset;
+
+        // bits changed from now on mark the page again
+        test_and_clear_bit(page, map->dirty);
+        if (kernel_write(map->fd, (void *) map->bits + offset, len, &pos) != len) {
+            set_bit(page, map->dirty);
+            err = -EIO;
+        }
+    }
+    if (!err && durable)
+        err = vfs_fsync(map->fd, 1);
+    mutex_unlock(&map->syncLock);
+    return err;
+}
+
+// bytes from position on whose extents are all written or all unwritten, positions out of the map count as written
+ulong extentsRun(struct ExtentMap *map, loff_t position, ulong size, bool *written) {
+    ulong first, last, next;
+
+    *written = true;
+    if (map->fd == NULL || size == 0 || position + size > map->size) return size;
+
+    first = position >> map->shift;
+    last = (position + size - 1) >> map->shift;
+    *written = test_bit(first, map->bits);
+    if (*written)
+        next = find_next_zero_bit(map->bits, last + 1, first + 1);
+    else
+        next = find_next_bit(map->bits, last + 1, first + 1);
+    return min((loff_t) next << map->shift, position + (loff_t) size) - position;
+}
+
+bool extentsWritten(struct ExtentMap *map, loff_t position, ulong size) {
+    bool written;
+    return extentsRun(map, position, size, &written) == size && written;
+}
+
+bool extentsUnwritten(struct ExtentMap *map, loff_t position, ulong size) {
+    bool written;
+    return extentsRun(map, position, size, &written) == size && !written;
+}
+
+// range of extents the request covers as a whole, start equals end when there are none
+void extentsWhole(struct ExtentMap *map, loff_t position, ulong size, loff_t *start, loff_t *end) {
+    *start = *end = position + size;
+    if (map->fd == NULL || position + size > map->size) return;
+
+    *start = round_up(position, extentSize(map));
+    // the last extent of the storage is shorter
+    *end = position + size == map->size ? position + size : round_down(position + size, extentSize(map));
+    if (*end <= *start) *start = *end = position + size;
+}
+
+static void markDirty(struct ExtentMap *map, ulong first, ulong last) {
+    for (ulong page = bitsPage(first); page <= bitsPage(last); page++)
+        set_bit(page, map->dirty);
+}
+
+// every extent the range touches, callers hold the lock
+void extentsMark(struct ExtentMap *map, loff_t position, ulong size) {
+    ulong first, last;
+
+    if (map->fd == NULL || size == 0 || position + size > map->size) return;
+
+    first = position >> map->shift;
+    last = (position + size - 1) >> map->shift;
+    bitmap_set(map->bits, first, last - first + 1);
+    markDirty(map, first, last);
+}
+
+// extents of a range from extentsWhole
+void extentsClear(struct ExtentMap *map, loff_t position, ulong size) {
+    ulong first, last;
+
+    if (map->fd == NULL || size == 0) return;
+
+    first = position >> map->shift;
+    last = (position + size - 1) >> map->shift;
+    mutex_lock(&map->lock);
+    bitmap_clear(map->bits, first, last - first + 1);
+    markDirty(map, first, last);
+    mutex_unlock(&map->lock);
+}
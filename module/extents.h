@@ -0,0 +1,16 @@
+#include "definitions.h"
+
+int extentsOpen(struct ExtentMap *map, struct file *fd, ulong size);
+void extentsClose(struct ExtentMap *map);
+int extentsSync(struct ExtentMap *map, bool durable);
+
+ulong extentsRun(struct ExtentMap *map, loff_t position, ulong size, bool *written);
+bool extentsWritten(struct ExtentMap *map, loff_t position, ulong size);
+bool extentsUnwritten(struct ExtentMap *map, loff_t position, ulong size);
+void extentsWhole(struct ExtentMap *map, loff_t position, ulong size, loff_t *start, loff_t *end);
+void extentsMark(struct ExtentMap *map, loff_t position, ulong size);
+void extentsClear(struct ExtentMap *map, loff_t position, ulong size);
+
+static inline ulong extentSize(struct ExtentMap *map) {
+    return 1UL << map->shift;
+}
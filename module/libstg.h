@@ -0,0 +1,310 @@
+#ifndef STG_LIBSTG_H
+#define STG_LIBSTG_H
+
+// codec and carrier layout shared by the module and userspace (libstg, see ../libstg)
+// nothing in here may depend on anything else from the module
+
+#ifdef __KERNEL__
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/printk.h>
+
+#ifdef CONFIG_X86_64
+#define LIBSTG_X86_64
+#endif
+
+#else
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define hweight8(x) __builtin_popcount((uint8_t) (x))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define __aligned(x) __attribute__((aligned(x)))
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#ifdef __x86_64__
+#define LIBSTG_X86_64
+#endif
+
+#endif
+
+//// types
+
+// TODO: fix all of those to proper u16, u32, etc.
+#define uint unsigned int
+#define uint8 unsigned char
+#define uint16 unsigned short
+#define ulong unsigned long
+
+//// macros
+
+#ifdef __KERNEL__
+#define printInfo(...)  printk(KERN_INFO  "stg_blkdev: " __VA_ARGS__)
+#define printError(...) printk(KERN_ERR   "stg_blkdev: " __VA_ARGS__)
+#define printDebug(...) printk(KERN_DEBUG "stg_blkdev: " __VA_ARGS__)
+#else
+#define printInfo(...)  fprintf(stderr, "libstg: " __VA_ARGS__)
+#define printError(...) fprintf(stderr, "libstg: " __VA_ARGS__)
+#define printDebug(...)
+#endif
+
+//// codec
+
+// decodes groups of whole pixels into bytes and back
+typedef void(*groupDecoder_t)(uint8 *data, const uint8 *carrier, ulong groups);
+typedef void(*groupEncoder_t)(const uint8 *data, uint8 *carrier, ulong groups);
+
+struct StgCodec {
+    const char *name;
+    groupDecoder_t decode;
+    groupEncoder_t encode;
+    bool fpu; // needs kernel_fpu_begin/end around it
+};
+
+//// layout
+
+#define DEFAULT_BITS_PER_COLOR 2
+#define DEFAULT_CHANNELS 0xf // bit n means n-th byte of a pixel carries data
+
+// smallest run of pixels that holds whole bytes
+#define LAYOUT_PIXEL_BITS(bits, channels) ((bits) * hweight8(channels))
+#define LAYOUT_LOWEST_BIT(x) ((x) & 7 ? (x) & -(x) : 8)
+#define LAYOUT_GROUP_PIXELS(bits, channels) (8 / LAYOUT_LOWEST_BIT(LAYOUT_PIXEL_BITS(bits, channels)))
+#define LAYOUT_GROUP_BYTES(bits, channels) (LAYOUT_GROUP_PIXELS(bits, channels) * LAYOUT_PIXEL_BITS(bits, channels) / 8)
+#define LAYOUT_MAX_GROUP_BYTES 4
+#define LAYOUT_MAX_GROUP_PIXELS 8
+#define LAYOUT_BITS_IDX(bits) ((bits) >> 1)
+
+struct StgLayout {
+    uint8 bits;        // low bits used in every color
+    uint8 channels;    // mask of colors that carry data
+    uint8 groupPixels;
+    uint8 groupBytes;
+    uint groupSize;    // bytes of carrier per group
+    uint dataMask;     // bits of a pixel that carry data
+    groupDecoder_t decode;
+    groupEncoder_t encode;
+    bool fpu;
+};
+
+//// carrier
+
+#define COLORS_PER_PIXEL 4
+
+// file offset of a pixel, rows are padded to rowSize
+static inline ulong pixelOffset(uint width, uint rowSize, uint headerSize, ulong pixelIdx) {
+    uint row = pixelIdx / width;
+    uint col = pixelIdx % width;
+    return (ulong) row * rowSize + col * COLORS_PER_PIXEL + headerSize;
+}
+
+// payload bytes of a carrier, pixels that don't fill a group are left unused
+static inline ulong layoutCapacity(const struct StgLayout *layout, uint width, uint height) {
+    ulong groups = (ulong) width * height / layout->groupPixels;
+    return groups * layout->groupBytes;
+}
+
+// 24-bit carriers are coded as a stream of colors, every 4 of them taken as one pixel of a layout using all channels
+// groups don't cross rows there, the colors left at the end of a row and its padding are skipped
+// 32-bit rows have no padding, their groups run across rows and rowGroups is 0
+
+static inline uint carrierRowGroups(const struct StgLayout *layout, uint depth, uint width) {
+    return depth == 24 ? width * 3 / layout->groupSize : 0;
+}
+
+static inline ulong carrierCapacity(const struct StgLayout *layout, uint width, uint height, uint rowGroups) {
+    if (rowGroups == 0)
+        return layoutCapacity(layout, width, height);
+    return (ulong) rowGroups * height * layout->groupBytes;
+}
+
+// file offset of a group
+static inline ulong groupOffset(const struct StgLayout *layout, uint width, uint rowSize, uint headerSize, uint rowGroups, ulong group) {
+    if (rowGroups == 0)
+        return pixelOffset(width, rowSize, headerSize, group * layout->groupPixels);
+    return (group / rowGroups) * rowSize + (group % rowGroups) * layout->groupSize + headerSize;
+}
+
+// groups from group to the end of its row
+static inline ulong rowGroupsLeft(uint rowGroups, ulong group) {
+    return rowGroups ? rowGroups - group % rowGroups : ~0UL;
+}
+
+// carrier bytes from the first group to the end of the last one, skipped ends of rows included
+static inline ulong groupSpan(const struct StgLayout *layout, uint rowSize, uint rowGroups, ulong group, ulong groups) {
+    ulong last = group + groups - 1;
+    if (rowGroups == 0)
+        return groups * layout->groupSize;
+    return (last / rowGroups - group / rowGroups) * rowSize + (last % rowGroups + 1) * layout->groupSize - (group % rowGroups) * layout->groupSize;
+}
+
+// groups starting at group that fit in bytes of carrier, whole rows are taken once a row fits
+static inline ulong groupsInSpan(const struct StgLayout *layout, uint rowSize, uint rowGroups, ulong group, ulong bytes) {
+    ulong left = rowGroupsLeft(rowGroups, group);
+    if (rowGroups == 0)
+        return bytes / layout->groupSize;
+    if (bytes < rowSize)
+        return min(left, bytes / layout->groupSize);
+    return left + (bytes / rowSize - 1) * rowGroups;
+}
+
+//// stripes
+// striped storages deal chunks of 1 << shift payload bytes round-robin to all carriers, shift 0 concatenates them
+
+#define STRIPE_MIN_SHIFT 12
+#define STRIPE_MAX_SHIFT 24
+#define DEFAULT_STRIPE_SHIFT 16
+
+// carrier idx and position in it of a storage position
+static inline ulong stripeLocate(uint8 shift, uint16 count, ulong position, uint16 *idx) {
+    ulong chunk = position >> shift;
+    *idx = chunk % count;
+    return (chunk / count) << shift | (position & ((1UL << shift) - 1));
+}
+
+// storage position of a carrier position
+static inline ulong stripePosition(uint8 shift, uint16 count, uint16 idx, ulong local) {
+    return ((local >> shift) * count + idx) << shift | (local & ((1UL << shift) - 1));
+}
+
+//// queue limits
+// devices announce a geometry that lets the block layer build requests the codec takes in one piece
+
+#define DEFAULT_BLOCK_SIZE 512 // what storages were formatted with before, 4096 saves read-modify-write of carriers
+
+// carriers of a concatenated storage start at multiples of the gcd of their sizes
+static inline ulong sizeGcd(ulong a, ulong b) {
+    while (b) {
+        ulong t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// chunk that cuts requests at every carrier boundary, 0 if it would also cut them too often elsewhere
+// gcd and smallest are taken over carriers with payload, requests up to window are coded in one piece anyway
+static inline ulong carrierChunk(ulong gcd, ulong smallest, ulong window, uint blockSize) {
+    if (gcd == 0 || gcd % blockSize)
+        return 0;
+    return gcd >= min(smallest, window) ? gcd : 0;
+}
+
+//// manifest
+// written into the folder by the helper, lists carriers so they can be opened without reading their headers
+// a header is followed by one entry per carrier in idx order, each followed by its file name
+
+#define MANIFEST_NAME ".stg_manifest"
+#define MANIFEST_MAGIC 0x4d475453 // "STGM"
+#define MANIFEST_VERSION 2
+#define MANIFEST_NAME_MAX 255
+
+struct StgManifestHeader {
+    u32 magic;
+    u16 version;
+    u16 count;        // carriers of the storage
+    u64 generation;   // bumped by every init of the folder
+    u64 checksum;     // of the whole manifest, taken with this field zeroed
+    u64 size;         // bytes of the whole manifest
+    u64 folderMtime;  // ns, the manifest is stale once files of the folder change
+    uint8 bits;
+    uint8 channels;
+    uint8 stripeShift;
+    uint8 reserved[5];
+} __attribute__((packed));
+
+struct StgManifestEntry {
+    u64 fileSize;     // the manifest is stale if the file changed size or inode
+    u64 ino;
+    u64 mtime;        // ns, headers of carriers changed since are read and compared with the entry
+    u64 virtualSize;  // payload bytes, before stripes are evened out
+    u32 width;
+    u32 height;
+    u32 headerSize;
+    u16 idx;
+    u16 depth;
+    u16 nameLen;      // name follows without a terminator
+    u16 reserved;
+} __attribute__((packed));
+
+#define MANIFEST_MAX_SIZE (sizeof(struct StgManifestHeader) + 65535UL * (sizeof(struct StgManifestEntry) + MANIFEST_NAME_MAX))
+
+// 64-bit FNV-1a, continued from hash, which starts at MANIFEST_CHECKSUM_INIT
+#define MANIFEST_CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+static inline u64 manifestChecksum(u64 hash, const void *buf, ulong size) {
+    const uint8 *bytes = buf;
+    for (ulong i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+//// written extents
+// sidecar of the folder with a bit per extent of the storage, set once any of the extent was written
+// extents that were never written, or were discarded, read as zeros without touching carriers
+
+#define EXTENTS_NAME ".stg_extents"
+#define EXTENTS_MAGIC 0x58475453 // "STGX"
+#define EXTENTS_VERSION 1
+#define EXTENTS_SHIFT 12 // one block of the decoded block cache
+
+// followed by the bits, lowest extent in the lowest bit of the first byte
+struct StgExtentsHeader {
+    u32 magic;
+    u16 version;
+    uint8 shift;      // extents have 1 << shift bytes of the storage
+    uint8 reserved;
+    u64 nrExtents;    // the last one may be shorter
+} __attribute__((packed));
+
+//// add ioctl
+// argument of IOCTL_DEV_ADD_ARGS, the control device still takes a bare path with IOCTL_DEV_ADD
+// new fields only go to the end, callers built against an older struct pass a smaller size and get defaults
+
+#define STG_ADD_VERSION 1
+#define STG_ADD_MIN_SIZE 24 // up to name, every tuning field is optional
+
+// flags
+#define STG_ADD_ASYNC (1 << 0)     // return the name right away, like IOCTL_DEV_ADD_ASYNC
+#define STG_ADD_READ_ONLY (1 << 1) // carriers are opened read-only, writes fail
+#define STG_ADD_FLAGS (STG_ADD_ASYNC | STG_ADD_READ_ONLY)
+
+// bits of valid, fields without them take module parameters
+#define STG_ADD_HW_QUEUES (1 << 0)
+#define STG_ADD_QUEUE_DEPTH (1 << 1)
+#define STG_ADD_CACHE_MB (1 << 2)
+#define STG_ADD_WRITEBACK_MB (1 << 3)
+#define STG_ADD_BLOCK_SIZE (1 << 4)
+#define STG_ADD_VALID (STG_ADD_HW_QUEUES | STG_ADD_QUEUE_DEPTH | STG_ADD_CACHE_MB | STG_ADD_WRITEBACK_MB | STG_ADD_BLOCK_SIZE)
+
+struct StgAddArgs {
+    u32 size;         // bytes of the struct as the caller knows it
+    u16 version;
+    u16 flags;
+    u64 path;         // address of the NUL terminated carrier folder
+    char name[8];     // filled with the name of the new device
+    u32 valid;
+    u32 hwQueues;     // 0 = one per online cpu
+    u32 queueDepth;   // requests in flight per hardware queue
+    u32 cacheMb;      // 0 = no decoded block cache
+    u32 writebackMb;  // 0 = write-through
+    u32 blockSize;    // logical block size, power of two from 512 to 4096
+};
+
+#endif
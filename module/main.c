@@ -1,10 +1,105 @@
 #include "main.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 // controller
 static struct SteganographyControlDevice *ctlDev = NULL;
 
+// protects the list of devices and their letters, devices are set up outside of it
+static DEFINE_MUTEX(devsLock);
+
+// devices added asynchronously are set up here, the ioctl returns their name right away
+static struct workqueue_struct *addWq = NULL;
+
+struct AddWork {
+    struct work_struct work;
+    struct SteganographyBlockDevice *dev;
+    char *name;
+    struct DevParams params;
+};
+
+// default number of hardware queues for newly added devices, 0 means one per online cpu
+// can be changed through /sys/module/stg_blkdev/parameters before every add
+static uint hw_queues = 0;
+module_param(hw_queues, uint, 0644);
+MODULE_PARM_DESC(hw_queues, "number of hardware queues per device (0 = one per online cpu)");
+
+static uint queue_depth = 128;
+module_param(queue_depth, uint, 0644);
+MODULE_PARM_DESC(queue_depth, "requests in flight per hardware queue of a device");
+
+// memory limit of decoded block cache for newly added devices
+static uint cache_mb = 16;
+module_param(cache_mb, uint, 0644);
+MODULE_PARM_DESC(cache_mb, "decoded block cache size per device in MiB (0 = disabled)");
+
+// write-back keeps dirty blocks in the cache, writes are acknowledged before they reach carriers
+static uint writeback_mb = 0;
+module_param(writeback_mb, uint, 0644);
+MODULE_PARM_DESC(writeback_mb, "dirty memory limit per device in MiB, at most half of the cache (0 = write-through)");
+
+static uint writeback_ms = 5000;
+module_param(writeback_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_ms, "interval of background write-back in milliseconds");
+
+// carriers of newly added devices are read and written with O_DIRECT semantics when possible
+static bool direct_io = false;
+module_param(direct_io, bool, 0644);
+MODULE_PARM_DESC(direct_io, "bypass page cache of carrier files, like LO_FLAGS_DIRECT_IO of the loop driver");
+
+// carriers of newly added devices are coded in place in their page cache, overrides direct_io
+static bool zero_copy = false;
+module_param(zero_copy, bool, 0644);
+MODULE_PARM_DESC(zero_copy, "decode and encode carriers in their page cache without bounce buffers");
+
+// requests of at least twice this size are cut into parts coded on several cpus
+static uint split_kb = 256;
+module_param(split_kb, uint, 0644);
+MODULE_PARM_DESC(split_kb, "bytes per part of large requests coded in parallel in KiB (0 = one cpu per request)");
+
+// logical block size of newly added devices, 512 only for filesystems that can't use anything bigger
+static uint block_size = DEFAULT_BLOCK_SIZE;
+module_param(block_size, uint, 0644);
+MODULE_PARM_DESC(block_size, "logical block size of devices in bytes, power of two from 512 to 4096, default 512");
+
 //// add and remove devices
 
+// module parameters at the time of the add, StgAddArgs may override them
+static void defaultParams(struct DevParams *params) {
+    params->hwQueues = hw_queues;
+    params->queueDepth = queue_depth;
+    params->cacheMb = cache_mb;
+    params->writebackMb = writeback_mb;
+    params->writebackMs = writeback_ms;
+    params->blockSize = block_size;
+    params->splitKb = split_kb;
+    params->directIo = direct_io;
+    params->zeroCopy = zero_copy;
+    params->readOnly = false;
+}
+
+// fields of args marked valid override module parameters
+static int argsParams(const struct StgAddArgs *args, struct DevParams *params) {
+    if (args->version == 0 || args->version > STG_ADD_VERSION) {
+        printError("unknown add arguments version %u\n", args->version);
+        return -EINVAL;
+    }
+    if (args->flags & ~STG_ADD_FLAGS || args->valid & ~STG_ADD_VALID) {
+        printError("unknown add flags 0x%x or fields 0x%x\n", args->flags & ~STG_ADD_FLAGS, args->valid & ~STG_ADD_VALID);
+        return -EINVAL;
+    }
+
+    defaultParams(params);
+    if (args->valid & STG_ADD_HW_QUEUES) params->hwQueues = args->hwQueues;
+    if (args->valid & STG_ADD_QUEUE_DEPTH) params->queueDepth = args->queueDepth;
+    if (args->valid & STG_ADD_CACHE_MB) params->cacheMb = args->cacheMb;
+    if (args->valid & STG_ADD_WRITEBACK_MB) params->writebackMb = args->writebackMb;
+    if (args->valid & STG_ADD_BLOCK_SIZE) params->blockSize = args->blockSize;
+    params->readOnly = args->flags & STG_ADD_READ_ONLY;
+    return 0;
+}
+
 char getNextAvailableLetter(void) {
     char letter = 'a';
     while (letter <= 'z') {
@@ -23,25 +118,39 @@ char getNextAvailableLetter(void) {
     return 0;
 }
 
-int addDev(char* backingPath, char** name) {
+// unlinks and frees a reserved device that failed to be set up
+static void releaseDev(struct SteganographyBlockDevice *dev) {
+    struct SteganographyBlockDevice **pprev = &ctlDev->pnext;
+
+    mutex_lock(&devsLock);
+    while (*pprev != dev) pprev = &(*pprev)->pnext;
+    *pprev = dev->pnext;
+    mutex_unlock(&devsLock);
+
+    bsPutFolder(dev->bmpS); // undo bsLookupFolder
+    kfree(dev->bmpS->backingPath); // undo kmalloc backingPath in parent function
+    kfree(dev->bmpS);
+    kfree(dev);
+}
+
+// links a device that is still being set up, so its path and letter can't be taken twice
+static struct SteganographyBlockDevice *reserveDev(char* backingPath, char** name) {
     int err = 0;
-    struct SteganographyBlockDevice *dev = ctlDev->pnext;
-    
-    printInfo("!!! add device\n");
+    struct SteganographyBlockDevice *dev;
+    struct SteganographyBlockDevice **plast = &ctlDev->pnext;
 
     if (!backingPath) {
         printError("backingPath not provided\n");
-        err = -ENOENT;
-        goto noBackingPath;
+        return ERR_PTR(-ENOENT);
     }
 
-    while(dev != NULL) {
+    mutex_lock(&devsLock);
+    for (dev = ctlDev->pnext; dev != NULL; plast = &dev->pnext, dev = dev->pnext) {
         if (strcmp(dev->bmpS->backingPath, backingPath) == 0) {
             printError("device with backingPath %s already exists\n", backingPath);
             err = -EEXIST;
             goto backingPathExists;
         }
-        dev = dev->pnext;
     }
 
     dev = kzalloc(sizeof (struct SteganographyBlockDevice), GFP_KERNEL);
@@ -52,7 +161,6 @@ int addDev(char* backingPath, char** name) {
     }
     dev->pnext = NULL;
 
-    // open backing files
     dev->bmpS = kzalloc(sizeof(struct BmpStorage), GFP_KERNEL);
     if (dev->bmpS == NULL) {
         printError("failed to allocate dev->bmpS struct\n");
@@ -61,21 +169,6 @@ int addDev(char* backingPath, char** name) {
     }
     dev->bmpS->backingPath = backingPath;
 
-    printDebug("opening backing files\n");
-    if (( err = openBmps(dev->bmpS) )) {
-        printError("failed to open backing files\n");
-        goto failedOpenBmps;
-    }
-
-    // set device capacity
-    dev->capacity = dev->bmpS->totalVirtualSize / SECTOR_SIZE;
-    if(dev->capacity == 0) {
-        printError("capacity is 0\n");
-        err = -EINVAL;
-        goto failedCapacity;
-    }
-    printInfo("sector size: %d B * capacity: %llu sectors = available: %llu B \n", SECTOR_SIZE, dev->capacity, dev->capacity * SECTOR_SIZE);
-
     dev->letter = getNextAvailableLetter();
     if (dev->letter == 0) {
         printError("no available letter\n");
@@ -91,23 +184,120 @@ int addDev(char* backingPath, char** name) {
     }
     sprintf(*name, "%s%c", BLK_DEV_NAME, dev->letter);
 
+    *plast = dev;
+    mutex_unlock(&devsLock);
+    return dev;
+
+failedAllocName:
+failedAllocLetter:
+    kfree(dev->bmpS); // undo kmalloc bmpS
+failedAllocBmpS:
+    kfree(dev); // undo kmalloc dev
+failedAllocDev:
+backingPathExists:
+    mutex_unlock(&devsLock);
+    return ERR_PTR(err);
+}
+
+// opens carriers and adds the disk of a reserved device, unlinks and frees it on failure
+static int setupDev(struct SteganographyBlockDevice *dev, char* name, const struct DevParams *params) {
+    int err = 0;
+    uint blockSize = params->blockSize;
+    ulong chunk;
+
+    if (params->queueDepth == 0 || params->queueDepth > BLK_MQ_MAX_DEPTH) {
+        printError("invalid queue depth %u\n", params->queueDepth);
+        err = -EINVAL;
+        goto failedParams;
+    }
+    if (blockSize < SECTOR_SIZE || blockSize > PAGE_SIZE || !is_power_of_2(blockSize)) {
+        printError("invalid block size %u\n", blockSize);
+        err = -EINVAL;
+        goto failedParams;
+    }
+
+    dev->bmpS->stats = alloc_percpu(struct StgStats);
+    if (dev->bmpS->stats == NULL) {
+        printError("failed to allocate stats\n");
+        err = -ENOMEM;
+        goto failedAllocStats;
+    }
+    dev->bmpS->directIo = params->directIo;
+    dev->bmpS->zeroCopy = params->zeroCopy;
+    dev->bmpS->readOnly = params->readOnly;
+    dev->bmpS->splitBytes = (ulong) params->splitKb << 10;
+
+    // bounce buffers are allocated with the first device
+    if (( err = holdBounceBuffers() )) {
+        printError("failed to allocate bounce buffers\n");
+        goto failedHoldBounce;
+    }
+
+    printDebug("opening backing files\n");
+    if (( err = openBmps(dev->bmpS) )) {
+        printError("failed to open backing files\n");
+        goto failedOpenBmps;
+    }
+
+    // set device capacity, whole logical blocks only
+    dev->capacity = round_down(dev->bmpS->totalVirtualSize, blockSize) / SECTOR_SIZE;
+    if(dev->capacity == 0) {
+        printError("capacity is 0\n");
+        err = -EINVAL;
+        goto failedCapacity;
+    }
+    printInfo("sector size: %d B * capacity: %llu sectors = available: %llu B in %u B blocks\n", SECTOR_SIZE, dev->capacity, dev->capacity * SECTOR_SIZE, blockSize);
+
     // register new block device and get device major number
-    printDebug("registering block device %s", *name);
-    dev->devMajor = register_blkdev(0, *name);
+    printDebug("registering block device %s", name);
+    dev->devMajor = register_blkdev(0, name);
     if (dev->devMajor < 0) {
         printError("failed to register block device\n");
         err = dev->devMajor;
         goto failedRegisterBlkDev;
     }
 
-    // allocate queue
-    printDebug("allocating queue");
-    if (blk_mq_alloc_sq_tag_set(&dev->tag_set, &mqOps, 128, BLK_MQ_F_SHOULD_MERGE)) {
+    // allocate queues, one hardware context per cpu unless configured otherwise
+    dev->nrHwQueues = params->hwQueues ? min(params->hwQueues, nr_cpu_ids) : num_online_cpus();
+    printDebug("allocating %u hardware queues", dev->nrHwQueues);
+    dev->tag_set.ops = &mqOps;
+    dev->tag_set.nr_hw_queues = dev->nrHwQueues;
+    dev->tag_set.nr_maps = 1;
+    dev->tag_set.queue_depth = params->queueDepth;
+    dev->tag_set.numa_node = NUMA_NO_NODE;
+    dev->tag_set.flags = BLK_MQ_F_SHOULD_MERGE;
+    dev->tag_set.cmd_size = sizeof(struct SbdWorker);
+    dev->tag_set.driver_data = dev;
+    if (blk_mq_alloc_tag_set(&dev->tag_set)) {
         printError("failed to allocate device queue\n");
         err = -ENOMEM;
         goto failedAllocQueue;
     }
 
+    // requests are served by a dedicated workqueue, so they don't compete with the whole system
+    // it's bound, so a request is coded on the cpu that submitted it, cpu intensive keeps other work there running
+    printDebug("allocating workqueue");
+    dev->wq = alloc_workqueue("%s", WQ_HIGHPRI | WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 0, name);
+    if (dev->wq == NULL) {
+        printError("failed to allocate workqueue\n");
+        err = -ENOMEM;
+        goto failedAllocWq;
+    }
+
+    // cache of decoded blocks in front of the carriers
+    printDebug("allocating cache");
+    if (( err = cacheInit(&dev->bmpS->cache, (ulong) params->cacheMb << 20, name) )) {
+        printError("failed to register cache shrinker\n");
+        goto failedInitCache;
+    }
+
+    printDebug("starting write-back");
+    // nothing is written to a read-only device, so there is nothing to write back
+    if (( err = bsStartWriteBack(dev->bmpS, params->readOnly ? 0 : (ulong) params->writebackMb << 20, params->writebackMs, name) )) {
+        printError("failed to start write-back thread\n");
+        goto failedStartWriteBack;
+    }
+
     // allocate gdisk
     printDebug("allocating gdisk");
     dev->gdisk = blk_mq_alloc_disk(&dev->tag_set, dev);
@@ -126,29 +316,67 @@ int addDev(char* backingPath, char** name) {
     dev->gdisk->fops = &bdOps;
     dev->gdisk->private_data = dev;
 
+    // complete requests on the exact cpu that submitted them
+    blk_queue_flag_set(QUEUE_FLAG_SAME_COMP, dev->gdisk->queue);
+    blk_queue_flag_set(QUEUE_FLAG_SAME_FORCE, dev->gdisk->queue);
+
+    // acknowledged writes may sit in the cache, in page cache of carriers and in bits of the extent map
+    // so upper layers have to send flushes even in write-through mode
+    if (!params->readOnly)
+        blk_queue_write_cache(dev->gdisk->queue, true, false);
+
+    // writes are also refused by queueRq, the flag only tells filesystems and tools
+    set_disk_ro(dev->gdisk, params->readOnly);
+
+    // carriers are coded in whole pages, smaller logical blocks are only emulated
+    blk_queue_logical_block_size(dev->gdisk->queue, blockSize);
+    blk_queue_physical_block_size(dev->gdisk->queue, CACHE_BLOCK_SIZE);
+    blk_queue_io_min(dev->gdisk->queue, CACHE_BLOCK_SIZE);
+
+    // segments are walked by the cursor without DMA, so only the request size is limited
+    // max_sectors is raised over the default cap too, filesystems get the large requests right away
+    blk_queue_max_hw_sectors(dev->gdisk->queue, MAX_REQUEST_SIZE >> SECTOR_SHIFT);
+    dev->gdisk->queue->limits.max_sectors = MAX_REQUEST_SIZE >> SECTOR_SHIFT;
+    blk_queue_max_segments(dev->gdisk->queue, USHRT_MAX);
+    blk_queue_max_segment_size(dev->gdisk->queue, UINT_MAX);
+
+    // requests don't cross chunks, a full stripe touches every carrier once
+    if (dev->bmpS->stripeShift) {
+        blk_queue_chunk_sectors(dev->gdisk->queue, 1U << (dev->bmpS->stripeShift - SECTOR_SHIFT));
+        if (((ulong) dev->bmpS->count << dev->bmpS->stripeShift) <= UINT_MAX)
+            blk_queue_io_opt(dev->gdisk->queue, dev->bmpS->count << dev->bmpS->stripeShift);
+    } else {
+        // carrier boundaries of equally sized carriers become chunk boundaries, requests never take two carriers
+        chunk = bsCarrierChunk(dev->bmpS, blockSize);
+        if (chunk && (chunk >> SECTOR_SHIFT) <= UINT_MAX)
+            blk_queue_chunk_sectors(dev->gdisk->queue, chunk >> SECTOR_SHIFT);
+        // requests of twice the split size are the first coded on several cpus
+        blk_queue_io_opt(dev->gdisk->queue, dev->bmpS->splitBytes ? min(2 * dev->bmpS->splitBytes, (ulong) MAX_REQUEST_SIZE) : RW_BUF_SIZE);
+    }
+
+    // zeroing doesn't need a payload, discard forgets whole written extents and is ignored without them
+    blk_queue_max_discard_sectors(dev->gdisk->queue, UINT_MAX >> SECTOR_SHIFT);
+    blk_queue_max_write_zeroes_sectors(dev->gdisk->queue, UINT_MAX >> SECTOR_SHIFT);
+    dev->gdisk->queue->limits.discard_granularity = dev->bmpS->extents.fd ? extentSize(&dev->bmpS->extents) : CACHE_BLOCK_SIZE;
+
     printDebug("setting capacity");
     set_capacity(dev->gdisk, dev->capacity);
 
     // set device name as it will be represented in /dev
-    strncpy(dev->gdisk->disk_name, *name + 0, 9);
+    strncpy(dev->gdisk->disk_name, name + 0, 9);
     printInfo("adding disk /dev/%s\n", dev->gdisk->disk_name);
 
     // notify kernel about new disk device
     printDebug("adding disk");
-    if(( err = add_disk(dev->gdisk) )) {
+    // statistics are in /sys/block/stgX/stg/
+    if(( err = device_add_disk(NULL, dev->gdisk, statsGroups) )) {
         printError("Failed to add disk\n");
         goto failedToAdd;
     }
 
-    if(ctlDev->pnext == NULL) {
-        ctlDev->pnext = dev;
-    } else {
-        struct SteganographyBlockDevice *pprev = ctlDev->pnext;
-        while(pprev->pnext != NULL) {
-            pprev = pprev->pnext;
-        }
-        pprev->pnext = dev;
-    }
+    mutex_lock(&devsLock);
+    dev->ready = true;
+    mutex_unlock(&devsLock);
 
     return 0;
 
@@ -159,41 +387,105 @@ failedToAdd:
     put_disk(dev->gdisk); // undo blk_mq_alloc_disk
 
 failedAllocGdisk:
+    printDebug("bsStopWriteBack");
+    bsStopWriteBack(dev->bmpS); // undo bsStartWriteBack
+
+failedStartWriteBack:
+    printDebug("cacheDestroy");
+    cacheDestroy(&dev->bmpS->cache); // undo cacheInit
+
+failedInitCache:
+    printDebug("destroy_workqueue");
+    destroy_workqueue(dev->wq); // undo alloc_workqueue
+
+failedAllocWq:
     printDebug("blk_mq_free_tag_set");
-    blk_mq_free_tag_set(&dev->tag_set); // undo blk_mq_alloc_sq_tag_set // TODO: is this the cause of the errors?
+    blk_mq_free_tag_set(&dev->tag_set); // undo blk_mq_alloc_tag_set // TODO: is this the cause of the errors?
 
 failedAllocQueue:
     printDebug("unregister_blkdev");
-    unregister_blkdev(dev->devMajor, *name); // undo register_blkdev
+    unregister_blkdev(dev->devMajor, name); // undo register_blkdev
 
 failedRegisterBlkDev:
-    printDebug("kfree *name");
-    kfree(*name); // undo kmalloc name
-
-failedAllocName:
-failedAllocLetter:
 failedCapacity:
     printDebug("closeBmps");
     closeBmps(dev->bmpS); // undo openBmps
 
 failedOpenBmps:
-    printDebug("kfree dev->bmpS");
-    kfree(dev->bmpS); // undo kmalloc bmpS
+    printDebug("releaseBounceBuffers");
+    releaseBounceBuffers(); // undo holdBounceBuffers
 
-failedAllocBmpS:
-    printDebug("kfree dev");
-    kfree(dev); // undo kmalloc dev
+failedHoldBounce:
+    printDebug("free_percpu dev->bmpS->stats");
+    free_percpu(dev->bmpS->stats); // undo alloc_percpu stats
 
-failedAllocDev:
-    printDebug("kfree backingPath");
-    kfree(backingPath); // undo kmalloc backingPath in parent function
+failedAllocStats:
+failedParams:
+    printDebug("releaseDev");
+    releaseDev(dev); // undo reserveDev
 
-backingPathExists:
-noBackingPath:
     printError("device will not be created (error %d)", err);
     return err;
 }
 
+static void addDevWork(struct work_struct *work) {
+    struct AddWork *add = container_of(work, struct AddWork, work);
+    char device[16], error[32];
+    char *envp[] = { device, error, NULL };
+    int err = setupDev(add->dev, add->name, &add->params);
+
+    // the disk of the device announces itself, the control device tells about failures too
+    snprintf(device, sizeof(device), "STG_DEVICE=%s", add->name);
+    snprintf(error, sizeof(error), "STG_ADD_ERROR=%d", err);
+    kobject_uevent_env(&disk_to_dev(ctlDev->gdisk)->kobj, KOBJ_CHANGE, envp);
+
+    kfree(add->name);
+    kfree(add);
+}
+
+// an asynchronous add returns once the name is reserved, the device shows up when it is set up
+int addDev(char* backingPath, char** name, const struct DevParams *params, bool async) {
+    struct SteganographyBlockDevice *dev;
+    struct AddWork *add;
+    int err;
+
+    printInfo("!!! add device%s\n", async ? " asynchronously" : "");
+
+    dev = reserveDev(backingPath, name);
+    if (IS_ERR(dev)) {
+        kfree(backingPath); // undo kmalloc backingPath in parent function
+        printError("device will not be created (error %ld)", PTR_ERR(dev));
+        return PTR_ERR(dev);
+    }
+
+    // paths are resolved here, in the root, mounts and credentials of the caller, not of the worker setting it up
+    if (( err = bsLookupFolder(dev->bmpS) )) {
+        releaseDev(dev);
+        kfree(*name);
+        return err;
+    }
+
+    if (!async) {
+        if (( err = setupDev(dev, *name, params) )) kfree(*name);
+        return err;
+    }
+
+    add = kzalloc(sizeof(struct AddWork), GFP_KERNEL);
+    if (add != NULL) add->name = kstrdup(*name, GFP_KERNEL);
+    if (add == NULL || add->name == NULL) {
+        printError("failed to allocate add work\n");
+        kfree(add);
+        releaseDev(dev);
+        kfree(*name);
+        return -ENOMEM;
+    }
+    add->dev = dev;
+    add->params = *params;
+    INIT_WORK(&add->work, addDevWork);
+    queue_work(addWq, &add->work);
+    return 0;
+}
+
 int removeDev(struct SteganographyBlockDevice *dev) {
     printInfo("removing disk /dev/%s\n", dev->gdisk->disk_name);
 
@@ -204,6 +496,9 @@ int removeDev(struct SteganographyBlockDevice *dev) {
         printError("dev->gdisk is NULL #1\n");
     }
 
+    printDebug("destroy_workqueue");
+    destroy_workqueue(dev->wq);
+
     printDebug("blk_mq_free_tag_set");
     blk_mq_free_tag_set(&dev->tag_set);
 
@@ -222,14 +517,29 @@ int removeDev(struct SteganographyBlockDevice *dev) {
     }
 
     if(dev->bmpS) {
+        printDebug("bsStopWriteBack");
+        bsStopWriteBack(dev->bmpS);
+
+        printDebug("cacheDestroy");
+        cacheDestroy(&dev->bmpS->cache);
+
         printDebug("closeBmps");
         closeBmps(dev->bmpS);
 
+        printDebug("releaseBounceBuffers");
+        releaseBounceBuffers();
+
+        printDebug("bsPutFolder");
+        bsPutFolder(dev->bmpS);
+
         if(dev->bmpS->backingPath) {
             printDebug("kfree dev->bmpS->backingPath");
             kfree(dev->bmpS->backingPath);
         }
 
+        printDebug("free_percpu dev->bmpS->stats");
+        free_percpu(dev->bmpS->stats);
+
         printDebug("kfree dev->bmpS");
         kfree(dev->bmpS);
     }
@@ -242,7 +552,7 @@ int removeDev(struct SteganographyBlockDevice *dev) {
 
 int findRemoveDev(char* deviceName) {
     struct SteganographyBlockDevice *pprev = NULL;
-    struct SteganographyBlockDevice *dev = ctlDev->pnext;
+    struct SteganographyBlockDevice *dev;
     char letter = 0;
 
     printInfo("!!! remove device\n");
@@ -253,23 +563,62 @@ int findRemoveDev(char* deviceName) {
     }
     letter = deviceName[3];
 
+    mutex_lock(&devsLock);
+    dev = ctlDev->pnext;
     while(dev != NULL) {
         if(dev->letter == letter) {
+            // setup owns the device until it is ready
+            if(!dev->ready) {
+                mutex_unlock(&devsLock);
+                printError("device %s is still being added\n", deviceName);
+                return -EBUSY;
+            }
             if(pprev == NULL)
                 ctlDev->pnext = dev->pnext;
             else
                 pprev->pnext = dev->pnext;
-            
+            mutex_unlock(&devsLock);
+
             removeDev(dev);
             return 0;
         }
         pprev = dev;
         dev = dev->pnext;
     }
+    mutex_unlock(&devsLock);
     printError("device %s not found\n", deviceName);
     return 1;
 }
 
+// one device per line: name, state and folder of its carriers
+static ssize_t devicesShow(struct device *device, struct device_attribute *attr, char *buf) {
+    struct SteganographyBlockDevice *dev;
+    int len = 0;
+
+    mutex_lock(&devsLock);
+    for (dev = ctlDev->pnext; dev != NULL; dev = dev->pnext)
+        len += sysfs_emit_at(buf, len, "%s%c %s %s\n", BLK_DEV_NAME, dev->letter, dev->ready ? "ready" : "adding", dev->bmpS->backingPath);
+    mutex_unlock(&devsLock);
+    return len;
+}
+
+static DEVICE_ATTR(devices, 0444, devicesShow, NULL);
+
+static struct attribute *ctlAttrs[] = {
+    &dev_attr_devices.attr,
+    NULL,
+};
+
+static const struct attribute_group ctlGroup = {
+    .name = "stg",
+    .attrs = ctlAttrs,
+};
+
+static const struct attribute_group *ctlGroups[] = {
+    &ctlGroup,
+    NULL,
+};
+
 //// block device operations
 
 static int devOpen(struct block_device *bd, fmode_t mode) {
@@ -280,10 +629,49 @@ static void devRelease(struct gendisk *gdisk, fmode_t mode) {
     return;
 }
 
+// versioned add, the folder is passed by address and the name comes back in args
+static int addDevArgs(struct StgAddArgs __user *uargs) {
+    struct StgAddArgs args;
+    struct DevParams params;
+    char *backingPath, *name;
+    u32 size;
+    int err;
+
+    if (get_user(size, &uargs->size))
+        return -EFAULT;
+    if (size < STG_ADD_MIN_SIZE || size > PAGE_SIZE) {
+        printError("invalid size of add arguments %u\n", size);
+        return -EINVAL;
+    }
+    // fields the module doesn't know yet have to be zero, missing ones are zeroed
+    if (( err = copy_struct_from_user(&args, sizeof(args), uargs, size) )) {
+        printError("failed to copy add arguments (error %d)\n", err);
+        return err;
+    }
+    if (( err = argsParams(&args, &params) ))
+        return err;
+
+    backingPath = strndup_user(u64_to_user_ptr(args.path), MAX_BACKING_LEN);
+    if (IS_ERR(backingPath)) {
+        printError("failed to copy backingPath\n");
+        return PTR_ERR(backingPath);
+    }
+
+    if (( err = addDev(backingPath, &name, &params, args.flags & STG_ADD_ASYNC) ))
+        return err;
+    // backingPath belongs to the device now
+    name[4] = '\0';
+    err = copy_to_user(uargs->name, name, strlen(name) + 1) ? -EFAULT : 0;
+    kfree(name);
+    if (err) printError("copy_to_user failed\n");
+    return err;
+}
+
 int devIoCtl(struct block_device *bd, fmode_t mode, uint cmd, ulong arg) {
     int err = 0;
     int copied;
     char* backingPath;
+    struct DevParams params;
 
     if(strcmp(bd->bd_disk->disk_name, CTL_DEV_NAME) != 0) {
         printError("%s: ioctl request not supported\n", bd->bd_disk->disk_name);
@@ -295,6 +683,9 @@ int devIoCtl(struct block_device *bd, fmode_t mode, uint cmd, ulong arg) {
         return -EINVAL;
     }
 
+    if (cmd == IOCTL_DEV_ADD_ARGS)
+        return addDevArgs((struct StgAddArgs __user *) arg);
+
     backingPath = kzalloc(MAX_BACKING_LEN, GFP_KERNEL);
     if(backingPath == NULL) {
         printError("failed to allocate memory for backingPath\n");
@@ -313,21 +704,18 @@ int devIoCtl(struct block_device *bd, fmode_t mode, uint cmd, ulong arg) {
         goto failedCopyFromUser;
     }
 
-    if (cmd == IOCTL_DEV_ADD) {
+    if (cmd == IOCTL_DEV_ADD || cmd == IOCTL_DEV_ADD_ASYNC) {
         char* name;
-        err = addDev(backingPath, &name);
+        defaultParams(&params);
+        err = addDev(backingPath, &name, &params, cmd == IOCTL_DEV_ADD_ASYNC);
         if(err) return err;
         name[4] = '\0';
-        copied = copy_to_user((char*)arg, name, MAX_BACKING_LEN);
-        if(copied < 0) {
+        // backingPath belongs to the device now
+        copied = copy_to_user((char*)arg, name, strlen(name) + 1);
+        kfree(name);
+        if(copied) {
             printError("copy_to_user failed\n");
-            err = -EINVAL;
-            goto failedCopyFromUser;
-        }
-        if(copied == MAX_BACKING_LEN) {
-            printError("name too long\n");
-            err = -EINVAL;
-            goto failedCopyFromUser;
+            return -EFAULT;
         }
         return 0;
     } else if(cmd == IOCTL_DEV_REMOVE) {
@@ -351,31 +739,35 @@ static struct block_device_operations bdOps = {
 
 //// worker
 
-// serve requests
+// serve requests, the whole request is one contiguous range of the device
 static int requestHandler(struct request *rq, ulong *nrBytes) {
     int err = 0;
-    struct bio_vec bvec;
-    struct req_iterator iter;
+    struct StgCursor cur;
     struct SteganographyBlockDevice *dev = rq->q->queuedata;
     loff_t pos = blk_rq_pos(rq) << SECTOR_SHIFT;
-
-    // iterate over all requests segments
-    rq_for_each_segment(bvec, rq, iter) {
-        // get pointer to the data
-        void* bBuf = page_address(bvec.bv_page) + bvec.bv_offset;
-        ulong bLen = bvec.bv_len;
-
-        if (rq_data_dir(rq) == WRITE)
-            err = bsEncode(bBuf, bLen, pos, dev->bmpS);
-        else
-            err = bsDecode(bBuf, bLen, pos, dev->bmpS);
-        
-        if (err) return err;
-
-        pos += bLen;
-        *nrBytes += bLen;
-    }
-
+    ulong size = blk_rq_bytes(rq);
+
+    if (req_op(rq) == REQ_OP_FLUSH) return bsFlush(dev->bmpS);
+    if (size == 0) return 0;
+
+    switch (req_op(rq)) {
+    case REQ_OP_DISCARD:
+        err = bsDiscard(size, pos, dev->bmpS); // only forgets whole written extents, nothing else is touched
+        break;
+    case REQ_OP_WRITE_ZEROES:
+        err = bsZero(size, pos, dev->bmpS);
+        break;
+    case REQ_OP_WRITE:
+        cursorInit(&cur, rq->bio);
+        err = bsEncode(&cur, size, pos, dev->bmpS);
+        break;
+    default:
+        cursorInit(&cur, rq->bio);
+        err = bsDecode(&cur, size, pos, dev->bmpS);
+    }
+    if (err) return err;
+
+    *nrBytes += size;
     return err;
 }
 
@@ -383,34 +775,51 @@ static int requestHandler(struct request *rq, ulong *nrBytes) {
 static void requestHandlerThread(struct work_struct *work_arg){
     struct SbdWorker *worker = container_of(work_arg, struct SbdWorker, work);
     struct request *rq = worker->rq;
-    ulong nrBytes = 0; // todo: use it
-    requestHandler(rq, &nrBytes); // todo: handle return value
-
+    struct StgStats __percpu *stats = ((struct SteganographyBlockDevice *) rq->q->queuedata)->bmpS->stats;
+    int rw = op_is_write(req_op(rq));
+    ulong nrBytes = 0;
+
+    trace_stg_worker_start(rq);
+    statsSince(stats, STATS_QUEUE, worker->queued);
+    worker->err = requestHandler(rq, &nrBytes);
+    if (worker->err && printk_ratelimit())
+        printError("%s of %u B at sector %llu failed (error %d)\n", req_op(rq) == REQ_OP_FLUSH ? "flush" : rw ? "write" : "read",
+                   blk_rq_bytes(rq), (u64) blk_rq_pos(rq), worker->err);
+
+    this_cpu_inc(stats->ios[rw]);
+    this_cpu_add(stats->bytes[rw], nrBytes);
+    statsSince(stats, STATS_TOTAL, worker->queued);
     blk_mq_complete_request(rq);
-
-    kfree(worker);
 }
 
 //// blk_mq_ops
 
 static blk_status_t queueRq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data* bd) {
     struct request *rq = bd->rq;
-    struct SbdWorker *worker = kmalloc(sizeof(struct SbdWorker), GFP_KERNEL); // todo: use kzalloz if encounter problems
-    if (worker == NULL) {
-        printError("failed to allocate worker struct");
-        return -ENOMEM;
-    }
-
+    struct SteganographyBlockDevice *dev = hctx->queue->queuedata;
+    struct SbdWorker *worker = blk_mq_rq_to_pdu(rq); // preallocated by blk-mq with every request
+
+    trace_stg_queue_rq(rq);
+    // the block layer only warns about writes to read-only disks, carriers may not even be writable
+    if (dev->bmpS->readOnly && op_is_write(req_op(rq)) && req_op(rq) != REQ_OP_FLUSH)
+        return BLK_STS_IOERR;
+    worker->queued = statsNow();
     blk_mq_start_request(rq);
     worker->rq = rq;
+    worker->err = 0;
     INIT_WORK(&worker->work, requestHandlerThread);
-    schedule_work(&worker->work);
+    // queue_rq runs on a cpu served by this hctx, keep the work there
+    queue_work_on(raw_smp_processor_id(), dev->wq, &worker->work);
 
     return BLK_STS_OK;
 }
 
 static void completeRq(struct request *rq) {
-    blk_mq_end_request(rq, BLK_STS_OK); // yolo
+    struct SbdWorker *worker = blk_mq_rq_to_pdu(rq);
+
+    trace_stg_complete_rq(rq);
+    // a failed flush is the only sign of lost write-back, so errors always reach the submitter
+    blk_mq_end_request(rq, errno_to_blk_status(worker->err));
 }
 
 static struct blk_mq_ops mqOps = {
@@ -424,6 +833,25 @@ static int __init moduleInit(void) {
     int err = 0;
     printInfo("!!! module initialize\n");
 
+    codecInit();
+
+    if (( err = initBounceBuffers() )) {
+        printError("failed to allocate bounce buffers\n");
+        goto failedAllocBounce;
+    }
+
+    if (( err = initSplitWorkers() )) {
+        printError("failed to allocate split workqueue\n");
+        goto failedInitSplit;
+    }
+
+    addWq = alloc_workqueue("stg_add", WQ_UNBOUND, 0);
+    if (addWq == NULL) {
+        printError("failed to allocate add workqueue\n");
+        err = -ENOMEM;
+        goto failedAllocAddWq;
+    }
+
     ctlDev = kzalloc(sizeof (struct SteganographyBlockDevice), GFP_KERNEL);
     if (ctlDev == NULL) {
         printError("failed to allocate dev struct\n");
@@ -475,7 +903,8 @@ static int __init moduleInit(void) {
     set_capacity(ctlDev->gdisk, ctlDev->capacity);
 
     // notify kernel about new disk device
-    if(( err = add_disk(ctlDev->gdisk) )) {
+    // devices and their state are in /sys/block/stg_manager/stg/
+    if(( err = device_add_disk(NULL, ctlDev->gdisk, ctlGroups) )) {
         printError("Failed to add disk\n");
         goto failedToAdd;
     }
@@ -493,14 +922,24 @@ failedAllocQueue:
 failedRegisterBlkDev:
     kfree(ctlDev); // undo kmalloc dev
 failedAllocdev:
+    destroy_workqueue(addWq); // undo alloc_workqueue
+failedAllocAddWq:
+    freeSplitWorkers(); // undo initSplitWorkers
+failedInitSplit:
+    freeBounceBuffers(); // undo initBounceBuffers
+failedAllocBounce:
     printError("devInit() failed with error %d", err);
     return err;
 }
 
 // release disk and free memory
 static void __exit moduleExit(void) {
-    struct SteganographyBlockDevice *dev = ctlDev->pnext;
+    struct SteganographyBlockDevice *dev;
     printInfo("!!! module exit\n");
+    // pending asynchronous adds finish first, so every device is either ready or gone
+    printDebug("destroy_workqueue addWq");
+    destroy_workqueue(addWq);
+    dev = ctlDev->pnext;
     printInfo("removing all devices");
     while(dev != NULL) {
         struct SteganographyBlockDevice *next = dev->pnext;
@@ -519,6 +958,10 @@ static void __exit moduleExit(void) {
     put_disk(ctlDev->gdisk);
     printDebug("kfree ctlDev");
     kfree(ctlDev);
+    printDebug("freeSplitWorkers");
+    freeSplitWorkers();
+    printDebug("freeBounceBuffers");
+    freeBounceBuffers();
 }
 
 module_init(moduleInit);
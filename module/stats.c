@@ -0,0 +1,102 @@
+#include "stats.h"
+
+//// sysfs, /sys/block/stgX/stg/
+
+static const char *phaseNames[STATS_PHASES] = {
+    [STATS_QUEUE] = "queue",
+    [STATS_CARRIER] = "carrier",
+    [STATS_CODEC] = "codec",
+    [STATS_TOTAL] = "total",
+};
+
+static struct StgStats __percpu *devStats(struct device *dev) {
+    struct SteganographyBlockDevice *sbd = dev_to_disk(dev)->private_data;
+    return sbd->bmpS->stats;
+}
+
+static void sumStats(struct StgStats __percpu *stats, struct StgStats *sum) {
+    int cpu;
+
+    memset(sum, 0, sizeof(struct StgStats));
+    for_each_possible_cpu(cpu) {
+        struct StgStats *s = per_cpu_ptr(stats, cpu);
+        for (uint rw = 0; rw < 2; rw++) {
+            sum->ios[rw] += s->ios[rw];
+            sum->bytes[rw] += s->bytes[rw];
+            sum->carrierIos[rw] += s->carrierIos[rw];
+            sum->carrierBytes[rw] += s->carrierBytes[rw];
+        }
+        sum->cacheHits += s->cacheHits;
+        sum->cacheMisses += s->cacheMisses;
+        for (uint phase = 0; phase < STATS_PHASES; phase++) {
+            sum->time[phase] += s->time[phase];
+            for (uint bucket = 0; bucket < STATS_BUCKETS; bucket++)
+                sum->latency[phase][bucket] += s->latency[phase][bucket];
+        }
+    }
+}
+
+// one counter per line
+static ssize_t countersShow(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct StgStats *sum = kmalloc(sizeof(struct StgStats), GFP_KERNEL);
+    int len = 0;
+
+    if (sum == NULL) return -ENOMEM;
+    sumStats(devStats(dev), sum);
+
+    len += sysfs_emit_at(buf, len, "reads %llu\n", sum->ios[0]);
+    len += sysfs_emit_at(buf, len, "writes %llu\n", sum->ios[1]);
+    len += sysfs_emit_at(buf, len, "read_bytes %llu\n", sum->bytes[0]);
+    len += sysfs_emit_at(buf, len, "write_bytes %llu\n", sum->bytes[1]);
+    len += sysfs_emit_at(buf, len, "carrier_reads %llu\n", sum->carrierIos[0]);
+    len += sysfs_emit_at(buf, len, "carrier_writes %llu\n", sum->carrierIos[1]);
+    len += sysfs_emit_at(buf, len, "carrier_read_bytes %llu\n", sum->carrierBytes[0]);
+    len += sysfs_emit_at(buf, len, "carrier_write_bytes %llu\n", sum->carrierBytes[1]);
+    len += sysfs_emit_at(buf, len, "cache_hits %llu\n", sum->cacheHits);
+    len += sysfs_emit_at(buf, len, "cache_misses %llu\n", sum->cacheMisses);
+
+    kfree(sum);
+    return len;
+}
+
+// one phase per line: name, samples, total ns and STATS_BUCKETS log2 buckets
+static ssize_t latencyShow(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct StgStats *sum = kmalloc(sizeof(struct StgStats), GFP_KERNEL);
+    int len = 0;
+
+    if (sum == NULL) return -ENOMEM;
+    sumStats(devStats(dev), sum);
+
+    for (uint phase = 0; phase < STATS_PHASES; phase++) {
+        u64 samples = 0;
+        for (uint bucket = 0; bucket < STATS_BUCKETS; bucket++)
+            samples += sum->latency[phase][bucket];
+
+        len += sysfs_emit_at(buf, len, "%s %llu %llu", phaseNames[phase], samples, sum->time[phase]);
+        for (uint bucket = 0; bucket < STATS_BUCKETS; bucket++)
+            len += sysfs_emit_at(buf, len, " %llu", sum->latency[phase][bucket]);
+        len += sysfs_emit_at(buf, len, "\n");
+    }
+
+    kfree(sum);
+    return len;
+}
+
+static DEVICE_ATTR(counters, 0444, countersShow, NULL);
+static DEVICE_ATTR(latency, 0444, latencyShow, NULL);
+
+static struct attribute *statsAttrs[] = {
+    &dev_attr_counters.attr,
+    &dev_attr_latency.attr,
+    NULL,
+};
+
+static const struct attribute_group statsGroup = {
+    .name = "stg",
+    .attrs = statsAttrs,
+};
+
+const struct attribute_group *statsGroups[] = {
+    &statsGroup,
+    NULL,
+};
@@ -0,0 +1,27 @@
+#ifndef STG_STATS_H
+#define STG_STATS_H
+
+#include "definitions.h"
+
+extern const struct attribute_group *statsGroups[];
+
+static inline u64 statsNow(void) {
+    return ktime_get_ns();
+}
+
+static inline void statsLatency(struct StgStats __percpu *stats, enum StatsPhase phase, u64 ns) {
+    uint bucket = ns ? min_t(uint, ilog2(ns), STATS_BUCKETS - 1) : 0;
+    this_cpu_add(stats->time[phase], ns);
+    this_cpu_inc(stats->latency[phase][bucket]);
+}
+
+static inline void statsSince(struct StgStats __percpu *stats, enum StatsPhase phase, u64 start) {
+    statsLatency(stats, phase, statsNow() - start);
+}
+
+static inline void statsCarrier(struct StgStats __percpu *stats, int rw, ulong bytes) {
+    this_cpu_inc(stats->carrierIos[rw == WRITE]);
+    this_cpu_add(stats->carrierBytes[rw == WRITE], bytes);
+}
+
+#endif
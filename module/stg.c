@@ -1,290 +1,1828 @@
 #include "stg.h"
+#include "trace.h"
+
+static struct BounceBuffer __percpu *bounceBuffers = NULL;
+static mempool_t *bouncePool = NULL;
+static struct mutex edgeLocks[DIO_EDGE_LOCKS];
+
+// buffers exist only while there are devices, for cpus that came online in the meantime
+static DEFINE_MUTEX(bounceUsersLock);
+static uint bounceUsers = 0;
+static int bounceCpuState = 0;
+
+static void freeBounce(struct Bounce *bounce) {
+    for (uint i = 0; i < ARRAY_SIZE(bounce->io); i++)
+        kvfree(bounce->io[i].buf);
+    kfree(bounce);
+}
+
+// buffers may come from vmalloc, their pages are looked up once for the iov_iters
+static struct Bounce *allocBounce(gfp_t gfp, int node) {
+    struct Bounce *bounce = kzalloc_node(sizeof(struct Bounce), gfp, node);
+    if (bounce == NULL) return NULL;
+
+    for (uint i = 0; i < ARRAY_SIZE(bounce->io); i++) {
+        struct CarrierIo *io = &bounce->io[i];
+        io->buf = kvmalloc_node(RW_BUF_SIZE, gfp, node);
+        if (io->buf == NULL) {
+            freeBounce(bounce);
+            return NULL;
+        }
+        for (uint page = 0; page < RW_BUF_PAGES; page++) {
+            void *addr = io->buf + page * PAGE_SIZE;
+            io->bvecs[page].bv_page = is_vmalloc_addr(addr) ? vmalloc_to_page(addr) : virt_to_page(addr);
+            io->bvecs[page].bv_len = PAGE_SIZE;
+            io->bvecs[page].bv_offset = 0;
+        }
+        init_completion(&io->done);
+    }
+    return bounce;
+}
+
+static void *bounceAlloc(gfp_t gfp, void *data) {
+    return allocBounce(gfp, NUMA_NO_NODE);
+}
+
+static void bounceFree(void *bounce, void *data) {
+    freeBounce(bounce);
+}
+
+// only locks and pointers per possible cpu, buffers come with the first device
+int initBounceBuffers(void) {
+    int cpu;
+
+    for (uint i = 0; i < DIO_EDGE_LOCKS; i++)
+        mutex_init(&edgeLocks[i]);
+
+    bounceBuffers = alloc_percpu(struct BounceBuffer);
+    if (bounceBuffers == NULL) return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        mutex_init(&per_cpu_ptr(bounceBuffers, cpu)->lock);
+    return 0;
+}
+
+void freeBounceBuffers(void) {
+    free_percpu(bounceBuffers);
+    bounceBuffers = NULL;
+}
+
+// buffers of a cpu are kept when it goes offline, workers that ran there may still hold them
+static int bounceCpuOnline(uint cpu) {
+    struct BounceBuffer *bb = per_cpu_ptr(bounceBuffers, cpu);
+    struct Bounce *bounce;
+
+    if (READ_ONCE(bb->bounce)) return 0;
+    bounce = allocBounce(GFP_KERNEL, cpu_to_node(cpu));
+    if (bounce == NULL) return -ENOMEM;
+    mutex_lock(&bb->lock);
+    bb->bounce = bounce;
+    mutex_unlock(&bb->lock);
+    return 0;
+}
+
+static void dropBounceBuffers(void) {
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct BounceBuffer *bb = per_cpu_ptr(bounceBuffers, cpu);
+        if (bb->bounce) freeBounce(bb->bounce);
+        bb->bounce = NULL;
+    }
+    mempool_destroy(bouncePool);
+    bouncePool = NULL;
+}
+
+// first device allocates buffers of online cpus, hotplug adds them for cpus coming online later
+int holdBounceBuffers(void) {
+    int ret = 0;
+
+    mutex_lock(&bounceUsersLock);
+    if (bounceUsers++ > 0) goto out;
+
+    bouncePool = mempool_create(BOUNCE_POOL_SIZE, bounceAlloc, bounceFree, NULL);
+    if (bouncePool == NULL) {
+        ret = -ENOMEM;
+        goto failed;
+    }
+    ret = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "block/stg:bounce", bounceCpuOnline, NULL);
+    if (ret < 0) goto failed;
+    bounceCpuState = ret;
+    ret = 0;
+    goto out;
+
+failed:
+    dropBounceBuffers();
+    bounceUsers--;
+out:
+    mutex_unlock(&bounceUsersLock);
+    return ret;
+}
+
+// last device frees all buffers, it must be idle
+void releaseBounceBuffers(void) {
+    mutex_lock(&bounceUsersLock);
+    if (--bounceUsers == 0) {
+        cpuhp_remove_state_nocalls(bounceCpuState);
+        dropBounceBuffers();
+    }
+    mutex_unlock(&bounceUsersLock);
+}
+
+// returns two RW_BUF_SIZE chunks, owner must be passed back to putBounce
+struct Bounce *getBounce(struct BounceBuffer **owner) {
+    struct BounceBuffer *bb = per_cpu_ptr(bounceBuffers, raw_smp_processor_id());
+    if (mutex_trylock(&bb->lock)) {
+        if (bb->bounce) {
+            *owner = bb;
+            return bb->bounce;
+        }
+        mutex_unlock(&bb->lock);
+    }
+    // another worker preempted on this cpu holds it, or the cpu is just coming online
+    // GFP_NOIO mempool allocation can't fail
+    *owner = NULL;
+    return mempool_alloc(bouncePool, GFP_NOIO);
+}
+
+void putBounce(struct Bounce *bounce, struct BounceBuffer *owner) {
+    if (owner)
+        mutex_unlock(&owner->lock);
+    else
+        mempool_free(bounce, bouncePool);
+}
+
+//// carrier I/O
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+static void carrierIoComplete(struct kiocb *iocb, long ret) {
+#else
+static void carrierIoComplete(struct kiocb *iocb, long ret, long ret2) {
+#endif
+    struct CarrierIo *io = container_of(iocb, struct CarrierIo, iocb);
+    io->end = statsNow();
+    io->ret = ret;
+    trace_stg_carrier_done(io->idx, io->pos, ret);
+    complete(&io->done);
+}
+
+// starts reading or writing the carrier range of the chunk, like lo_rw_aio in the loop driver
+static void carrierSubmit(struct CarrierIo *io, int rw, struct Bmp *bmp) {
+    struct iov_iter iter;
+    ssize_t ret;
+
+    iov_iter_bvec(&iter, rw, io->bvecs, DIV_ROUND_UP(io->size, PAGE_SIZE), io->size);
+    init_sync_kiocb(&io->iocb, bmp->fd);
+    io->iocb.ki_pos = io->pos;
+    io->iocb.ki_complete = carrierIoComplete;
+    if (io->direct)
+        io->iocb.ki_flags |= IOCB_DIRECT;
+    io->inFlight = true;
+    io->start = statsNow();
+    io->idx = bmp->idx;
+    statsCarrier(bmp->stats, rw, io->size);
+    if (rw == WRITE)
+        trace_stg_carrier_write(bmp->idx, io->pos, io->size);
+    else
+        trace_stg_carrier_read(bmp->idx, io->pos, io->size);
+    reinit_completion(&io->done);
+
+    if (rw == WRITE)
+        ret = call_write_iter(bmp->fd, &io->iocb, &iter);
+    else
+        ret = call_read_iter(bmp->fd, &io->iocb, &iter);
+
+    // buffered I/O is usually done before it returns
+    if (ret != -EIOCBQUEUED)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,16,0)
+        carrierIoComplete(&io->iocb, ret);
+#else
+        carrierIoComplete(&io->iocb, ret, 0);
+#endif
+}
+
+// blocks at the end of the file that can't be covered whole are read through page cache
+static void carrierRead(struct CarrierIo *io, ulong size, loff_t position, struct Bmp *bmp) {
+    loff_t start = position;
+    loff_t end = position + size;
+
+    io->direct = false;
+    if (bmp->dioAlign) {
+        start = round_down(start, (loff_t) bmp->dioAlign);
+        end = round_up(end, (loff_t) bmp->dioAlign);
+        io->direct = end <= bmp->size;
+        if (!io->direct) {
+            start = position;
+            end = position + size;
+        }
+    }
+    io->pos = start;
+    io->size = end - start;
+    io->lead = position - start;
+    carrierSubmit(io, READ, bmp);
+}
+
+// writes back the whole range that was read
+static void carrierWrite(struct CarrierIo *io, struct Bmp *bmp) {
+    carrierSubmit(io, WRITE, bmp);
+}
+
+static int carrierWait(struct CarrierIo *io, struct Bmp *bmp) {
+    if (!io->inFlight) return 0;
+    wait_for_completion_io(&io->done);
+    io->inFlight = false;
+    statsLatency(bmp->stats, STATS_CARRIER, io->end - io->start);
+    if (io->ret < 0) return io->ret;
+    return io->ret == io->size ? 0 : -EIO;
+}
+
+// block size direct I/O has to be aligned to, 0 if the backing filesystem can't do it
+static uint carrierDioAlign(struct Bmp *bmp) {
+    uint align = i_blocksize(file_inode(bmp->fd));
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+    if (!(bmp->fd->f_mode & FMODE_CAN_ODIRECT)) return 0;
+#else
+    if (bmp->fd->f_mapping->a_ops->direct_IO == NULL) return 0;
+#endif
+    return align <= PAGE_SIZE ? align : 0;
+}
+
+static struct mutex *edgeLock(struct Bmp *bmp, ulong unit) {
+    return &edgeLocks[hash_long((ulong) bmp ^ unit, ilog2(DIO_EDGE_LOCKS))];
+}
 
 void bRead(void *buffer, ulong size, loff_t position, struct Bmp *bmp) {
+    trace_stg_carrier_read(bmp->idx, position, size);
     kernel_read(bmp->fd, buffer, size, &position);
 }
 
 void bWrite(const void *buffer, ulong size, loff_t position, struct Bmp *bmp) {
+    trace_stg_carrier_write(bmp->idx, position, size);
     kernel_write(bmp->fd, buffer, size, &position);
 }
 
-ulong pixelIdxToBmpIdx(struct Bmp *bmp, ulong pixelIdx) {
-    uint row = pixelIdx / bmp->width;
-    uint col = pixelIdx % bmp->width;
-    return (ulong) row * bmp->rowSize + col * COLORS_PER_PIXEL + bmp->headerSize;
+// file offset of a group of the carrier
+static loff_t groupToBmpIdx(struct Bmp *bmp, ulong group) {
+    return groupOffset(bmp->layout, bmp->width, bmp->rowSize, bmp->headerSize, bmp->rowGroups, group);
 }
 
-void bDecode(uint8 *data, ulong size, loff_t position, struct Bmp *bmp) {
-    uint pixel;
-    for (ulong byteIdx = 0; byteIdx < size; byteIdx++) {
-        uint8 byte = 0;
-        ulong pixelIdx = pixelIdxToBmpIdx(bmp, position + byteIdx);
-        bRead(&pixel, 4, pixelIdx, bmp);
-        for (uint8 colorIdx = 0; colorIdx < COLORS_PER_PIXEL; colorIdx++) {
-            uint8 twoBits = (pixel >> (colorIdx * 8)) & 0b00000011;
-            byte |= twoBits << (colorIdx * USED_BITS_PER_PIXEL);
-        }
-        data[byteIdx] = byte;
+// carrier bytes read for groups, ends of 24-bit rows between them included
+static ulong groupsToBmpSpan(struct Bmp *bmp, ulong group, ulong groups) {
+    return groupSpan(bmp->layout, bmp->rowSize, bmp->rowGroups, group, groups);
+}
+
+// groups of the next chunk, it has to fit a bounce buffer widened for direct I/O
+static ulong chunkGroups(struct Bmp *bmp, ulong group, ulong skip, ulong size) {
+    const struct StgLayout *layout = bmp->layout;
+    ulong fit = groupsInSpan(layout, bmp->rowSize, bmp->rowGroups, group, RW_BUF_SIZE - 2 * bmp->dioAlign);
+    return min(fit, DIV_ROUND_UP(skip + size, (ulong) layout->groupBytes));
+}
+
+// decodes carrier groups straight into request pages, pieces may end in the middle of a group
+static void decodeToCursor(const struct StgLayout *layout, struct StgCursor *cur, uint8 *carrier, ulong skip, ulong size) {
+    while (size > 0) {
+        ulong len;
+        uint8 *data = cursorMap(cur, &len);
+        len = min(len, size);
+        codecDecode(layout, data, carrier, skip, len);
+        carrier += (skip + len) / layout->groupBytes * layout->groupSize;
+        skip = (skip + len) % layout->groupBytes;
+        cursorAdvance(cur, len);
+        size -= len;
     }
 }
 
-void bDecodeFast(uint8 *data, ulong size, loff_t position, struct Bmp *bmp) {
-    ulong pixelIdx = pixelIdxToBmpIdx(bmp, position);
-    ulong bufSize = min(RW_BUF_SIZE, size * sizeof(u32));
-    u32 *rbuf = kmalloc(bufSize, GFP_KERNEL);
-    if(rbuf == NULL) {
-        printDebug("bDecodeFast: can't allocate memory, using slow version");
-        bDecode(data, size, position, bmp);
-        return;
+static void encodeFromCursor(const struct StgLayout *layout, struct StgCursor *cur, uint8 *carrier, ulong skip, ulong size) {
+    while (size > 0) {
+        ulong len;
+        uint8 *data = cursorMap(cur, &len);
+        len = min(len, size);
+        codecEncode(layout, data, carrier, skip, len);
+        carrier += (skip + len) / layout->groupBytes * layout->groupSize;
+        skip = (skip + len) % layout->groupBytes;
+        cursorAdvance(cur, len);
+        size -= len;
     }
-    for (ulong byteIdx = 0; byteIdx < size; byteIdx += RW_BUF_PIXELS) {
-        ulong pixelsRead = min(RW_BUF_PIXELS, size - byteIdx);
-        bRead(rbuf, pixelsRead * sizeof(u32), pixelIdx, bmp);
-        for (ulong i = 0; i < pixelsRead; i++) {
-            uint8 byte = 0;
-            u32 pixel = rbuf[i];
-        
-            byte = pixel & 0b00000011;
-            byte |= ((pixel >> 8) & 0b00000011) << 2;
-            byte |= ((pixel >> 16) & 0b00000011) << 4;
-            byte |= ((pixel >> 24) & 0b00000011) << 6;        
-
-            data[byteIdx + i] = byte;
-        }
-        pixelIdx += RW_BUF_SIZE;
+}
+
+static void zeroChunk(const struct StgLayout *layout, struct StgCursor *cur, uint8 *carrier, ulong skip, ulong size) {
+    codecZero(layout, carrier, skip, size);
+}
+
+// changes carrier bytes of a chunk in place, or reads them for decodeToCursor
+typedef void(*chunkPatcher_t)(const struct StgLayout *, struct StgCursor *, uint8 *, ulong, ulong);
+
+// codes a chunk one row at a time, carrier holds it as read from the file starting at group
+// 24-bit rows end after rowGroups groups, the colors left and the padding up to the next row are skipped
+static void patchRows(struct Bmp *bmp, chunkPatcher_t patch, struct StgCursor *cur, uint8 *carrier, ulong group, ulong skip, ulong size) {
+    const struct StgLayout *layout = bmp->layout;
+
+    while (size > 0) {
+        ulong left = rowGroupsLeft(bmp->rowGroups, group);
+        ulong len = bmp->rowGroups ? min(size, left * layout->groupBytes - skip) : size;
+
+        patch(layout, cur, carrier, skip, len);
+        size -= len;
+        if (size == 0) break;
+        carrier += left * layout->groupSize + bmp->rowSize - bmp->rowGroups * layout->groupSize;
+        group += left;
+        skip = 0;
+    }
+}
+
+//// zero-copy
+
+// pins the page cache folio holding position, reads it from the backing file if needed
+static struct folio *carrierFolio(struct Bmp *bmp, loff_t position) {
+    return read_mapping_folio(bmp->fd->f_mapping, position >> PAGE_SHIFT, bmp->fd);
+}
+
+// copies carrier bytes that may span two pages
+static int carrierGet(struct Bmp *bmp, loff_t position, uint8 *buf, ulong size) {
+    while (size > 0) {
+        ulong len = min(size, PAGE_SIZE - offset_in_page(position));
+        struct folio *folio = carrierFolio(bmp, position);
+        uint8 *carrier;
+
+        if (IS_ERR(folio)) return PTR_ERR(folio);
+        carrier = kmap_local_folio(folio, offset_in_folio(folio, position));
+        memcpy(buf, carrier, len);
+        kunmap_local(carrier);
+        folio_put(folio);
+
+        position += len;
+        buf += len;
+        size -= len;
+    }
+    return 0;
+}
+
+// returns mapped page cache of size bytes within one page, up to date and locked for writing
+static uint8 *carrierBeginWrite(struct Bmp *bmp, loff_t position, ulong size, struct page **page, void **fsdata) {
+    struct address_space *mapping = bmp->fd->f_mapping;
+    int err;
+
+    for (;;) {
+        // write_begin doesn't read the part that will be written, but it's modified, not replaced
+        struct folio *folio = carrierFolio(bmp, position);
+        if (IS_ERR(folio)) return ERR_CAST(folio);
+        folio_put(folio);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,19,0)
+        err = mapping->a_ops->write_begin(bmp->fd, mapping, position, size, page, fsdata);
+#else
+        err = mapping->a_ops->write_begin(bmp->fd, mapping, position, size, 0, page, fsdata);
+#endif
+        if (err) return ERR_PTR(err);
+        if (PageUptodate(*page)) break;
+        // evicted in the meantime, nothing is written
+        mapping->a_ops->write_end(bmp->fd, mapping, position, size, 0, *page, *fsdata);
+    }
+    return kmap_local_page(*page) + offset_in_page(position);
+}
+
+static int carrierEndWrite(struct Bmp *bmp, loff_t position, ulong size, struct page *page, void *fsdata, uint8 *carrier) {
+    struct address_space *mapping = bmp->fd->f_mapping;
+    int copied;
+
+    kunmap_local(carrier);
+    flush_dcache_page(page);
+    copied = mapping->a_ops->write_end(bmp->fd, mapping, position, size, size, page, fsdata);
+    if (copied < 0) return copied;
+    return copied == size ? 0 : -EIO;
+}
+
+static int carrierPut(struct Bmp *bmp, loff_t position, const uint8 *buf, ulong size) {
+    while (size > 0) {
+        ulong len = min(size, PAGE_SIZE - offset_in_page(position));
+        struct page *page;
+        void *fsdata;
+        uint8 *carrier = carrierBeginWrite(bmp, position, len, &page, &fsdata);
+        int err;
+
+        if (IS_ERR(carrier)) return PTR_ERR(carrier);
+        memcpy(carrier, buf, len);
+        if (( err = carrierEndWrite(bmp, position, len, page, fsdata, carrier) )) return err;
+
+        position += len;
+        buf += len;
+        size -= len;
     }
-    kfree(rbuf);
+    return 0;
 }
 
-void bEncode(uint8 *data, ulong size, loff_t position, struct Bmp *bmp) {
-    uint pixel;
-    for (ulong byteIdx = 0; byteIdx < size; byteIdx++) {
-        uint8 byte = data[byteIdx];
-        ulong pixelIdx = pixelIdxToBmpIdx(bmp, position + byteIdx);
-        bRead(&pixel, 4, pixelIdx, bmp);
-        pixel &= 0xfcfcfcfc;
-        for (uint8 colorIdx = 0; colorIdx < COLORS_PER_PIXEL; colorIdx++) {
-            uint8 twoBits = (byte >> (colorIdx * USED_BITS_PER_PIXEL)) & 0b00000011;
-            pixel |= twoBits << (colorIdx * 8);
+// codes groups straight in carrier pages, groups spanning two pages go through a small buffer
+// writes are done like generic_perform_write, so the backing filesystem sees ordinary buffered writes
+static int bFolioXXcode(struct StgCursor *cur, ulong size, loff_t position, struct Bmp *bmp, const struct StgLayout *layout, chunkPatcher_t patch) {
+    ulong group = (ulong) position / layout->groupBytes;
+    ulong skip = (ulong) position % layout->groupBytes;
+    struct inode *inode = file_inode(bmp->fd);
+    int err = 0;
+
+    if (patch) {
+        sb_start_write(inode->i_sb);
+        inode_lock(inode);
+    }
+
+    while (size > 0) {
+        // runs stay within a page and, for 24-bit carriers, within a row
+        loff_t offset = groupToBmpIdx(bmp, group);
+        ulong groups = min((PAGE_SIZE - offset_in_page(offset)) / layout->groupSize, rowGroupsLeft(bmp->rowGroups, group));
+        ulong bytes;
+
+        if (groups) {
+            ulong len;
+            u64 start = statsNow();
+            groups = min(groups, DIV_ROUND_UP(skip + size, (ulong) layout->groupBytes));
+            bytes = min(size, groups * layout->groupBytes - skip);
+            len = groups * layout->groupSize;
+
+            statsCarrier(bmp->stats, patch ? WRITE : READ, len);
+            if (patch) {
+                struct page *page;
+                void *fsdata;
+                uint8 *carrier;
+
+                trace_stg_carrier_write(bmp->idx, offset, len);
+                carrier = carrierBeginWrite(bmp, offset, len, &page, &fsdata);
+                if (IS_ERR(carrier)) {
+                    err = PTR_ERR(carrier);
+                    break;
+                }
+                statsSince(bmp->stats, STATS_CARRIER, start);
+                start = statsNow();
+                patch(layout, cur, carrier, skip, bytes);
+                statsSince(bmp->stats, STATS_CODEC, start);
+                if (( err = carrierEndWrite(bmp, offset, len, page, fsdata, carrier) )) break;
+            } else {
+                struct folio *folio;
+                uint8 *carrier;
+
+                trace_stg_carrier_read(bmp->idx, offset, len);
+                folio = carrierFolio(bmp, offset);
+                if (IS_ERR(folio)) {
+                    err = PTR_ERR(folio);
+                    break;
+                }
+                statsSince(bmp->stats, STATS_CARRIER, start);
+                carrier = kmap_local_folio(folio, offset_in_folio(folio, offset));
+                start = statsNow();
+                decodeToCursor(layout, cur, carrier, skip, bytes);
+                statsSince(bmp->stats, STATS_CODEC, start);
+                kunmap_local(carrier);
+                folio_put(folio);
+            }
+        } else {
+            uint8 carrier[LAYOUT_MAX_GROUP_PIXELS * COLORS_PER_PIXEL];
+            groups = 1;
+            bytes = min(size, layout->groupBytes - skip);
+
+            if (( err = carrierGet(bmp, offset, carrier, layout->groupSize) )) break;
+            if (patch) {
+                patch(layout, cur, carrier, skip, bytes);
+                if (( err = carrierPut(bmp, offset, carrier, layout->groupSize) )) break;
+            } else {
+                decodeToCursor(layout, cur, carrier, skip, bytes);
+            }
         }
-        bWrite(&pixel, 4, pixelIdx, bmp);
+
+        size -= bytes;
+        group += groups;
+        skip = 0;
+    }
+
+    if (patch) {
+        if (!err) file_update_time(bmp->fd);
+        inode_unlock(inode);
+        sb_end_write(inode->i_sb);
+        balance_dirty_pages_ratelimited(bmp->fd->f_mapping);
     }
+    return err;
 }
 
-void bEncodeFast(uint8 *data, ulong size, loff_t position, struct Bmp *bmp) {
-    ulong pixelIdx = pixelIdxToBmpIdx(bmp, position);
-    ulong bufSize = min(RW_BUF_SIZE, size * sizeof(u32));
-    u32 *wbuf = kmalloc(bufSize, GFP_KERNEL);
-    if(wbuf == NULL) {
-        printDebug("bEncodeFast: can't allocate memory, using slow version");
-        bEncode(data, size, position, bmp);
-        return;
+// whether page cache of the carrier can be used directly
+static bool carrierZeroCopy(struct Bmp *bmp) {
+    const struct address_space_operations *aops = bmp->fd->f_mapping->a_ops;
+    return aops->write_begin && aops->write_end;
+}
+
+// next chunk is read while the current one is decoded
+int bDecodeFast(struct StgCursor *cur, ulong size, loff_t position, struct Bmp *bmp, const struct StgLayout *layout) {
+    ulong group = (ulong) position / layout->groupBytes;
+    ulong skip = (ulong) position % layout->groupBytes;
+    ulong groups = chunkGroups(bmp, group, skip, size);
+    loff_t offset = groupToBmpIdx(bmp, group);
+    struct BounceBuffer *bb;
+    struct Bounce *bounce;
+    struct CarrierIo *io, *next;
+    int err = 0, waitErr;
+
+    if (bmp->zeroCopy)
+        return bFolioXXcode(cur, size, position, bmp, layout, NULL);
+
+    bounce = getBounce(&bb);
+    io = &bounce->io[0];
+    next = &bounce->io[1];
+    carrierRead(io, groupsToBmpSpan(bmp, group, groups), offset, bmp);
+    while (size > 0) {
+        ulong bytes = min(size, groups * layout->groupBytes - skip);
+        ulong nextGroup = group + groups;
+        ulong nextGroups = chunkGroups(bmp, nextGroup, 0, size - bytes);
+        u64 start;
+
+        if (nextGroups)
+            carrierRead(next, groupsToBmpSpan(bmp, nextGroup, nextGroups), groupToBmpIdx(bmp, nextGroup), bmp);
+        if (( err = carrierWait(io, bmp) )) break;
+        start = statsNow();
+        patchRows(bmp, decodeToCursor, cur, io->buf + io->lead, group, skip, bytes);
+        statsSince(bmp->stats, STATS_CODEC, start);
+
+        size -= bytes;
+        group = nextGroup;
+        groups = nextGroups;
+        skip = 0;
+        swap(io, next);
+    }
+
+    // nothing may be in flight when the buffers are given back
+    waitErr = carrierWait(next, bmp);
+    putBounce(bounce, bb);
+    return err ? err : waitErr;
+}
+
+// carrier units at both ends of a rewrite may hold data of other requests, requests sharing one are serialized
+// direct I/O rewrites whole blocks, buffered and zero-copy writes whole groups, which are split between
+// requests whenever groupBytes doesn't divide the block size, as with 3 colors or packed 24-bit rows
+static void lockEdges(struct Bmp *bmp, const struct StgLayout *layout, loff_t position, ulong size, struct mutex **head, struct mutex **tail) {
+    ulong first = (ulong) position / layout->groupBytes;
+    ulong last = (ulong) (position + size - 1) / layout->groupBytes;
+
+    *head = *tail = NULL;
+    if (bmp->dioAlign) {
+        *head = edgeLock(bmp, groupToBmpIdx(bmp, first) / bmp->dioAlign);
+        *tail = edgeLock(bmp, (groupToBmpIdx(bmp, last) + layout->groupSize - 1) / bmp->dioAlign);
+    } else {
+        if ((ulong) position % layout->groupBytes) *head = edgeLock(bmp, first);
+        if ((ulong) (position + size) % layout->groupBytes) *tail = edgeLock(bmp, last);
+        if (*head == NULL) swap(*head, *tail);
+    }
+    if (*tail == *head) *tail = NULL;
+    if (*tail && *head > *tail) swap(*head, *tail);
+    if (*head) mutex_lock(*head);
+    if (*tail) mutex_lock(*tail);
+}
+
+static void unlockEdges(struct mutex *head, struct mutex *tail) {
+    if (tail) mutex_unlock(tail);
+    if (head) mutex_unlock(head);
+}
+
+// read-modify-write, next chunk is read while the current one is patched and the previous one written
+static int bRewrite(struct StgCursor *cur, ulong size, loff_t position, struct Bmp *bmp, const struct StgLayout *layout, chunkPatcher_t patch) {
+    ulong group = (ulong) position / layout->groupBytes;
+    ulong skip = (ulong) position % layout->groupBytes;
+    ulong groups = chunkGroups(bmp, group, skip, size);
+    loff_t offset = groupToBmpIdx(bmp, group);
+    struct mutex *headLock, *tailLock;
+    struct BounceBuffer *bb;
+    struct Bounce *bounce;
+    struct CarrierIo *io, *next;
+    bool first = true;
+    int err = 0, waitErr;
+
+    lockEdges(bmp, layout, position, size, &headLock, &tailLock);
+    if (bmp->zeroCopy) {
+        err = bFolioXXcode(cur, size, position, bmp, layout, patch);
+        unlockEdges(headLock, tailLock);
+        set_bit(bmp->idx, bmp->unsynced);
+        return err;
     }
-    for (ulong byteIdx = 0; byteIdx < size; byteIdx += RW_BUF_PIXELS) {
-        ulong pixelsRead = min(RW_BUF_PIXELS, size - byteIdx);
-        bRead(wbuf, pixelsRead * sizeof(u32), pixelIdx, bmp);
-        for (ulong i = 0; i < pixelsRead; i++) {
-            uint8 byte = data[byteIdx + i];
-            u32 pixel = wbuf[i];
-            
-            pixel &= 0xfcfcfcfc;
-            pixel |= byte & 0b00000011;
-            pixel |= ((byte >> 2) & 0b00000011) << 8;
-            pixel |= ((byte >> 4) & 0b00000011) << 16;
-            pixel |= ((byte >> 6) & 0b00000011) << 24;
-
-            wbuf[i] = pixel;
+
+    bounce = getBounce(&bb);
+    io = &bounce->io[0];
+    next = &bounce->io[1];
+    carrierRead(io, groupsToBmpSpan(bmp, group, groups), offset, bmp);
+    while (size > 0) {
+        ulong bytes = min(size, groups * layout->groupBytes - skip);
+        ulong nextGroup = group + groups;
+        ulong nextGroups = chunkGroups(bmp, nextGroup, 0, size - bytes);
+        u64 start;
+
+        if (( err = carrierWait(io, bmp) )) break;
+        // widened chunks share a block, it was read before the previous chunk patched it
+        if (!first && next->pos + next->size > io->pos) {
+            ulong overlap = next->pos + next->size - io->pos;
+            memcpy(io->buf, next->buf + next->size - overlap, overlap);
         }
-        bWrite(wbuf, pixelsRead * sizeof(u32), pixelIdx, bmp);
-        pixelIdx += RW_BUF_SIZE;
+
+        // buffer of the next chunk may still be written
+        if (( err = carrierWait(next, bmp) )) break;
+        if (nextGroups)
+            carrierRead(next, groupsToBmpSpan(bmp, nextGroup, nextGroups), groupToBmpIdx(bmp, nextGroup), bmp);
+
+        start = statsNow();
+        patchRows(bmp, patch, cur, io->buf + io->lead, group, skip, bytes);
+        statsSince(bmp->stats, STATS_CODEC, start);
+        carrierWrite(io, bmp);
+
+        first = false;
+        size -= bytes;
+        group = nextGroup;
+        groups = nextGroups;
+        skip = 0;
+        swap(io, next);
     }
-    kfree(wbuf);
+
+    waitErr = carrierWait(io, bmp);
+    if (!err) err = waitErr;
+    waitErr = carrierWait(next, bmp);
+    putBounce(bounce, bb);
+
+    unlockEdges(headLock, tailLock);
+    // only once the data is written, so a flush that clears the bit syncs it
+    set_bit(bmp->idx, bmp->unsynced);
+    return err ? err : waitErr;
 }
 
-int bsXXcode(void *data, ulong size, loff_t position, struct BmpStorage *bmpS, xxcoder_t xxcoder) {
-    struct Bmp *bmp = bmpS->bmps;
-    
-    if (position + size > bmpS->totalVirtualSize) {
-        printError("not enough space\n");
-        return -ENOSPC; // instead of erroring out, truncating is also a possibility...
+int bEncodeFast(struct StgCursor *cur, ulong size, loff_t position, struct Bmp *bmp, const struct StgLayout *layout) {
+    return bRewrite(cur, size, position, bmp, layout, encodeFromCursor);
+}
+
+// clears data bits in place, cursor is not used
+int bZeroFast(struct StgCursor *cur, ulong size, loff_t position, struct Bmp *bmp, const struct StgLayout *layout) {
+    return bRewrite(cur, size, position, bmp, layout, zeroChunk);
+}
+
+// whole range at once, carriers are read in RW_BUF_SIZE chunks and split only at their boundaries
+// binary search for the last carrier starting at or before position
+static uint findBmp(struct BmpStorage *bmpS, loff_t position) {
+    uint lo = 0;
+    uint hi = bmpS->count - 1;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo + 1) / 2;
+        if (bmpS->bmps[mid]->virtualOffset <= position)
+            lo = mid;
+        else
+            hi = mid - 1;
     }
+    return lo;
+}
 
-    while (position >= bmp->virtualSize) {
-        position -= bmp->virtualSize;
-        bmp = bmp->pnext;
+// bytes between request cuts that fall on every carrier boundary of a concatenated storage, 0 if there are none
+ulong bsCarrierChunk(struct BmpStorage *bmpS, uint blockSize) {
+    ulong gcd = 0, smallest = ULONG_MAX;
+
+    if (bmpS->stripeShift || bmpS->count < 2)
+        return 0;
+    for (uint idx = 0; idx < bmpS->count; idx++) {
+        ulong size = bmpS->bmps[idx]->virtualSize;
+        if (size == 0) continue;
+        gcd = sizeGcd(gcd, size);
+        smallest = min(smallest, size);
     }
+    // bsXXcode takes SPLIT_WINDOW at once, a cut inside it costs nothing
+    return carrierChunk(gcd, smallest, SPLIT_WINDOW, blockSize);
+}
+
+// chunks of a striped storage go to the carriers in turns
+static int bsXXcodeStriped(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS, xxcoder_t xxcoder) {
+    ulong chunk = 1UL << bmpS->stripeShift;
 
     while (size > 0) {
+        uint16 idx;
+        ulong local = stripeLocate(bmpS->stripeShift, bmpS->count, position, &idx);
+        ulong bytesToXXcode = min(size, chunk - ((ulong) position & (chunk - 1)));
+        struct Bmp *bmp = bmpS->bmps[idx];
+        int err;
+
+        trace_stg_carrier_span(bmp->idx, local, bytesToXXcode);
+        err = xxcoder(cur, bytesToXXcode, local, bmp, bmp->layout);
+        if (err) {
+            printError("carrier %d I/O failed (error %d)\n", bmp->idx, err);
+            return err;
+        }
+
+        size -= bytesToXXcode;
+        position += bytesToXXcode;
+    }
+    return 0;
+}
+
+static int bsXXcodeConcat(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS, xxcoder_t xxcoder) {
+    uint idx = findBmp(bmpS, position);
+    position -= bmpS->bmps[idx]->virtualOffset;
+
+    while (size > 0) {
+        struct Bmp *bmp = bmpS->bmps[idx++];
         ulong posToEnd = bmp->virtualSize - position;
         ulong bytesToXXcode = min(posToEnd, size);
+        int err;
 
-        xxcoder(data, bytesToXXcode, position, bmp);
+        trace_stg_carrier_span(bmp->idx, position, bytesToXXcode);
+        err = xxcoder(cur, bytesToXXcode, position, bmp, bmp->layout);
+        if (err) {
+            printError("carrier %d I/O failed (error %d)\n", bmp->idx, err);
+            return err;
+        }
 
-        data += bytesToXXcode;
         size -= bytesToXXcode;
-        bmp = bmp->pnext;
         position = 0;
     }
     return 0;
 }
 
-int bsDecode(void *data, ulong size, loff_t position, struct BmpStorage *bmpS) {
-   return bsXXcode(data, size, position, bmpS, bDecodeFast);
+//// split requests
+
+// parts of large requests are coded by this workqueue, the worker that got the request takes the last one
+static struct workqueue_struct *splitWq = NULL;
+
+// carrier range, its stripe chunks are coded in order
+struct SplitPiece {
+    uint16 slot; // in bmps
+    ulong local; // carrier position
+    ulong size;
+};
+
+struct SplitRequest {
+    struct StgCursor *cur; // at position, left untouched until all parts are done, NULL when zeroing
+    loff_t position;
+    struct BmpStorage *bmpS;
+    xxcoder_t xxcoder;
+    struct SplitPiece *pieces;
+    atomic_t pending; // parts
+    struct completion done;
+    int err;
+};
+
+struct SplitPart {
+    struct work_struct work;
+    struct SplitRequest *req;
+    uint first; // pieces
+    uint last;
+};
+
+// pieces and parts of one window, a window that finds no free plan is coded on one cpu
+struct SplitPlan {
+    struct list_head list;
+    struct SplitPart *parts;
+    struct SplitPiece *pieces;
+};
+
+int initSplitWorkers(void) {
+    splitWq = alloc_workqueue("stg_split", WQ_UNBOUND | WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+    return splitWq ? 0 : -ENOMEM;
 }
 
-int bsEncode(void *data, ulong size, loff_t position, struct BmpStorage *bmpS) {
-    return bsXXcode(data, size, position, bmpS, bEncodeFast);
+void freeSplitWorkers(void) {
+    if (splitWq) {
+        destroy_workqueue(splitWq);
+        splitWq = NULL;
+    }
 }
 
-int isFileBmp(struct Bmp *bmp) {
-    uint8 buf[2];
-    if (bmp->size < BMP_HEADER_SIZE)
+// carrier ranges of a window, at most one per carrier, returns their number
+static uint splitRanges(struct BmpStorage *bmpS, ulong size, loff_t position, struct SplitPiece *pieces) {
+    ulong chunk = 1UL << bmpS->stripeShift;
+    uint n = 0;
+    uint idx;
+
+    if (bmpS->stripeShift) {
+        // chunks of one carrier follow each other in it
+        for (ulong k = 0; size > 0; k++) {
+            uint16 slot;
+            ulong local = stripeLocate(bmpS->stripeShift, bmpS->count, position, &slot);
+            ulong len = min(size, chunk - ((ulong) position & (chunk - 1)));
+            if (k < bmpS->count)
+                pieces[n++] = (struct SplitPiece) { slot, local, len };
+            else
+                pieces[k % bmpS->count].size += len;
+            position += len;
+            size -= len;
+        }
+        return n;
+    }
+
+    idx = findBmp(bmpS, position);
+    position -= bmpS->bmps[idx]->virtualOffset;
+    while (size > 0) {
+        ulong len = min(bmpS->bmps[idx]->virtualSize - (ulong) position, size);
+        pieces[n++] = (struct SplitPiece) { idx++, position, len };
+        position = 0;
+        size -= len;
+    }
+    return n;
+}
+
+// most carrier ranges any window can touch
+static uint splitMaxWindowRanges(struct BmpStorage *bmpS) {
+    uint most = 0;
+
+    if (bmpS->stripeShift)
+        return min((ulong) bmpS->count, ((ulong) SPLIT_WINDOW >> bmpS->stripeShift) + 1);
+    for (uint idx = 0, end = 0; idx < bmpS->count; idx++) {
+        struct Bmp *bmp = bmpS->bmps[idx];
+        while (end < bmpS->count && bmpS->bmps[end]->virtualOffset < bmp->virtualOffset + bmp->virtualSize + SPLIT_WINDOW)
+            end++;
+        most = max(most, end - idx);
+    }
+    return most;
+}
+
+static uint splitMaxRanges(struct BmpStorage *bmpS, ulong size, loff_t position) {
+    if (bmpS->stripeShift) {
+        ulong chunks = ((position + size - 1) >> bmpS->stripeShift) - (position >> bmpS->stripeShift) + 1;
+        return min(chunks, (ulong) bmpS->count);
+    }
+    return findBmp(bmpS, position + size - 1) - findBmp(bmpS, position) + 1;
+}
+
+// cuts ranges in place at multiples of splitBytes of their carrier, returns number of pieces
+// splitBytes holds whole groups, so pieces coded in parallel never share one
+static uint splitCut(struct SplitPiece *pieces, uint nrRanges, ulong splitBytes) {
+    uint total = 0;
+
+    for (uint i = 0; i < nrRanges; i++)
+        total += (pieces[i].local + pieces[i].size - 1) / splitBytes - pieces[i].local / splitBytes + 1;
+
+    // every range gives at least one piece, filling from the back never overwrites a range not cut yet
+    for (uint i = nrRanges, end = total; i-- > 0; ) {
+        struct SplitPiece range = pieces[i];
+        ulong cut = range.local + range.size;
+        while (cut > range.local) {
+            ulong start = max(range.local, (cut - 1) / splitBytes * splitBytes);
+            pieces[--end] = (struct SplitPiece) { range.slot, start, cut - start };
+            cut = start;
+        }
+    }
+    return total;
+}
+
+// codes one piece, cursor is moved from the start of the request to every chunk
+static int splitXXcodePiece(struct SplitRequest *req, const struct SplitPiece *piece) {
+    struct BmpStorage *bmpS = req->bmpS;
+    struct Bmp *bmp = bmpS->bmps[piece->slot];
+    struct StgCursor cur, *pcur = NULL;
+    loff_t at = req->position;
+    ulong local = piece->local;
+    ulong size = piece->size;
+
+    if (req->cur) {
+        cur = *req->cur;
+        pcur = &cur;
+    }
+    while (size > 0) {
+        ulong len = size;
+        loff_t position = bmp->virtualOffset + local;
+        int err;
+
+        if (bmpS->stripeShift) {
+            ulong chunk = 1UL << bmpS->stripeShift;
+            len = min(size, chunk - (local & (chunk - 1)));
+            position = stripePosition(bmpS->stripeShift, bmpS->count, piece->slot, local);
+        }
+        if (pcur) cursorSkip(pcur, position - at);
+
+        trace_stg_carrier_span(bmp->idx, local, len);
+        err = req->xxcoder(pcur, len, local, bmp, bmp->layout);
+        if (err) {
+            printError("carrier %d I/O failed (error %d)\n", bmp->idx, err);
+            return err;
+        }
+
+        at = position + len;
+        local += len;
+        size -= len;
+    }
+    return 0;
+}
+
+static void splitRunPart(struct SplitPart *part) {
+    struct SplitRequest *req = part->req;
+    int err = 0;
+
+    for (uint i = part->first; i < part->last && !err; i++)
+        err = splitXXcodePiece(req, &req->pieces[i]);
+    if (err) cmpxchg(&req->err, 0, err);
+    if (atomic_dec_and_test(&req->pending))
+        complete(&req->done);
+}
+
+static void splitWork(struct work_struct *work) {
+    splitRunPart(container_of(work, struct SplitPart, work));
+}
+
+// 24-bit carriers have groups of their own, pieces of both hold whole groups
+static ulong splitGroupBytes(struct BmpStorage *bmpS) {
+    ulong groupBytes = lcm(bmpS->layout.groupBytes, bmpS->packedLayout.groupBytes);
+    return bmpS->splitBytes / groupBytes * groupBytes;
+}
+
+static void freeSplitPlans(struct BmpStorage *bmpS) {
+    struct SplitPlan *plan, *tmp;
+
+    list_for_each_entry_safe(plan, tmp, &bmpS->splitPlans, list) {
+        list_del(&plan->list);
+        kvfree(plan);
+    }
+}
+
+// one plan per online cpu, more windows at once wouldn't be coded any faster
+static int allocSplitPlans(struct BmpStorage *bmpS) {
+    ulong splitBytes = splitGroupBytes(bmpS);
+    uint maxPieces;
+
+    if (splitBytes == 0) {
+        bmpS->splitBytes = 0;
         return 0;
-    bRead(buf, 2, 0, bmp);
-    return buf[0] == 'B' && buf[1] == 'M';
+    }
+    // a range may be cut at both ends
+    maxPieces = 2 * splitMaxWindowRanges(bmpS) + SPLIT_WINDOW / splitBytes;
+    bmpS->splitMaxPieces = maxPieces;
+    for (uint i = 0; i < num_online_cpus(); i++) {
+        struct SplitPlan *plan = kvmalloc(sizeof(struct SplitPlan) + maxPieces * (sizeof(struct SplitPart) + sizeof(struct SplitPiece)), GFP_KERNEL);
+        if (plan == NULL) {
+            freeSplitPlans(bmpS);
+            return -ENOMEM;
+        }
+        plan->parts = (struct SplitPart *) (plan + 1);
+        plan->pieces = (struct SplitPiece *) (plan->parts + maxPieces);
+        list_add(&plan->list, &bmpS->splitPlans);
+    }
+    return 0;
+}
+
+static struct SplitPlan *getSplitPlan(struct BmpStorage *bmpS) {
+    struct SplitPlan *plan;
+
+    spin_lock(&bmpS->splitLock);
+    plan = list_first_entry_or_null(&bmpS->splitPlans, struct SplitPlan, list);
+    if (plan) list_del(&plan->list);
+    spin_unlock(&bmpS->splitLock);
+    return plan;
+}
+
+static void putSplitPlan(struct BmpStorage *bmpS, struct SplitPlan *plan) {
+    spin_lock(&bmpS->splitLock);
+    list_add(&plan->list, &bmpS->splitPlans);
+    spin_unlock(&bmpS->splitLock);
+}
+
+// codes one window on several cpus, -EAGAIN when every plan of the storage is taken
+static int bsXXcodeSplit(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS, xxcoder_t xxcoder) {
+    ulong splitBytes = splitGroupBytes(bmpS);
+    uint maxPieces = 2 * splitMaxRanges(bmpS, size, position) + size / splitBytes;
+    uint nrPieces, nrParts = 0;
+    struct SplitRequest req;
+    struct SplitPlan *plan;
+    struct SplitPart *parts;
+    ulong partSize = 0;
+
+    if (maxPieces > bmpS->splitMaxPieces || ( plan = getSplitPlan(bmpS) ) == NULL)
+        return -EAGAIN;
+    req.pieces = plan->pieces;
+    parts = plan->parts;
+
+    nrPieces = splitCut(req.pieces, splitRanges(bmpS, size, position, req.pieces), splitBytes);
+    // consecutive pieces are packed into parts of up to splitBytes, small stripe chunks don't get a cpu each
+    for (uint i = 0; i < nrPieces; i++) {
+        if (nrParts == 0 || partSize + req.pieces[i].size > splitBytes) {
+            parts[nrParts++] = (struct SplitPart) { .req = &req, .first = i };
+            partSize = 0;
+        }
+        parts[nrParts - 1].last = i + 1;
+        partSize += req.pieces[i].size;
+    }
+
+    req.cur = cur;
+    req.position = position;
+    req.bmpS = bmpS;
+    req.xxcoder = xxcoder;
+    req.err = 0;
+    atomic_set(&req.pending, nrParts);
+    init_completion(&req.done);
+
+    for (uint i = 0; i + 1 < nrParts; i++) {
+        INIT_WORK(&parts[i].work, splitWork);
+        queue_work(splitWq, &parts[i].work);
+    }
+    splitRunPart(&parts[nrParts - 1]);
+    wait_for_completion_io(&req.done);
+
+    putSplitPlan(bmpS, plan);
+    if (!req.err && cur)
+        cursorSkip(cur, size);
+    return req.err;
 }
 
-uint getBmpColorDepth(struct Bmp *bmp) {
-    uint8 buf[2];
-    bRead(buf, 2, 28, bmp);
-    return buf[0] + buf[1] * 256;
+int bsXXcode(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS, xxcoder_t xxcoder) {
+    if (position + size > bmpS->totalVirtualSize) {
+        printError("not enough space\n");
+        return -ENOSPC; // instead of erroring out, truncating is also a possibility...
+    }
+
+    // large requests go window by window, the rest is coded right here
+    while (splitWq && bmpS->splitBytes && size >= 2 * bmpS->splitBytes) {
+        ulong window = min(size, (ulong) SPLIT_WINDOW);
+        int err = bsXXcodeSplit(cur, window, position, bmpS, xxcoder);
+        if (err == -EAGAIN) break;
+        if (err) return err;
+        position += window;
+        size -= window;
+    }
+    if (size == 0) return 0;
+
+    if (bmpS->stripeShift)
+        return bsXXcodeStriped(cur, size, position, bmpS, xxcoder);
+    return bsXXcodeConcat(cur, size, position, bmpS, xxcoder);
+}
+
+static int bsDecodeCached(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS) {
+    struct BlockCache *cache = &bmpS->cache;
+    struct CacheBlock *blocks[CACHE_RUN_BLOCKS];
+    int err;
+
+    if (!cache->maxBlocks)
+        return bsXXcode(cur, size, position, bmpS, bDecodeFast);
+
+    // hits are copied block by block, runs of misses are decoded in one pass and published afterwards
+    while (size > 0) {
+        struct StgCursor runCur;
+        ulong runSize = 0;
+        uint nrBlocks = 0;
+
+        pgoff_t idx = position >> CACHE_BLOCK_SHIFT;
+        uint offset = position & (CACHE_BLOCK_SIZE - 1);
+        ulong len = min(size, (ulong) CACHE_BLOCK_SIZE - offset);
+
+        if (cacheRead(cache, idx, offset, len, cur)) {
+            this_cpu_inc(bmpS->stats->cacheHits);
+            position += len;
+            size -= len;
+            continue;
+        }
+
+        // only blocks fully covered by the request can be published
+        do {
+            loff_t blockPos = (loff_t) (idx + nrBlocks) << CACHE_BLOCK_SHIFT;
+            struct CacheBlock *block = NULL;
+            if (len == CACHE_BLOCK_SIZE && blockPos + CACHE_BLOCK_SIZE <= bmpS->totalVirtualSize)
+                block = cacheReserve(cache, idx + nrBlocks);
+            blocks[nrBlocks++] = block;
+            runSize += len;
+            len = min(size - runSize, (ulong) CACHE_BLOCK_SIZE);
+        } while (len > 0 && nrBlocks < CACHE_RUN_BLOCKS && !cacheHas(cache, idx + nrBlocks));
+
+        this_cpu_add(bmpS->stats->cacheMisses, nrBlocks);
+        runCur = *cur;
+        err = bsXXcode(cur, runSize, position, bmpS, bDecodeFast);
+
+        len = CACHE_BLOCK_SIZE - offset;
+        for (uint i = 0, done = 0; i < nrBlocks; i++, done += len, len = CACHE_BLOCK_SIZE) {
+            len = min(len, runSize - done);
+            if (blocks[i]) {
+                if (!err) cursorCopyFrom(&runCur, blocks[i]->data, len);
+                cacheFill(cache, blocks[i], !err);
+            } else if (!err) {
+                cursorSkip(&runCur, len);
+            }
+        }
+        if (err) return err;
+
+        position += runSize;
+        size -= runSize;
+    }
+    return 0;
+}
+
+// extents that were never written read as zeros, without the cache and carriers
+int bsDecode(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS) {
+    while (size > 0) {
+        bool written;
+        ulong len = extentsRun(&bmpS->extents, position, size, &written);
+        int err;
+
+        if (!written)
+            cursorZero(cur, len);
+        else if (( err = bsDecodeCached(cur, len, position, bmpS) ))
+            return err;
+        position += len;
+        size -= len;
+    }
+    return 0;
 }
 
-void fillBmpStruct(struct Bmp *bmp) {
-    // dimensions
-    bRead((uint8 *) &bmp->width, 4, 18, bmp);
-    bRead((uint8 *) &bmp->height, 4, 22, bmp);
-    // printInfo("width: %d, height: %d\n", bmp->width, bmp->height);
+static int bsZeroCarriers(ulong size, loff_t position, struct BmpStorage *bmpS) {
+    int err = bsXXcode(NULL, size, position, bmpS, bZeroFast);
+    if (!err && bmpS->cache.maxBlocks)
+        cacheZero(&bmpS->cache, position, size);
+    return err;
+}
+
+// first write to an extent clears the rest of it, so that doesn't turn from zeros into noise of the image
+static int bsMarkWritten(ulong size, loff_t position, struct BmpStorage *bmpS) {
+    struct ExtentMap *map = &bmpS->extents;
+    loff_t end = position + size;
+    loff_t extentStart, extentEnd;
+    int err = 0;
+
+    if (extentsWritten(map, position, size)) return 0;
+
+    mutex_lock(&map->lock);
+    extentStart = round_down(position, extentSize(map));
+    extentEnd = min_t(loff_t, round_up(end, extentSize(map)), map->size);
+    if (extentStart < position && !extentsWritten(map, extentStart, 1))
+        err = bsZeroCarriers(position - extentStart, extentStart, bmpS);
+    if (!err && end < extentEnd && !extentsWritten(map, end, 1))
+        err = bsZeroCarriers(extentEnd - end, end, bmpS);
+    if (!err)
+        extentsMark(map, position, size);
+    mutex_unlock(&map->lock);
+    return err;
+}
+
+// readers may have cached a block of the run while it was coded, cacheWrite replaces their copy
+static int bsEncodeRun(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS) {
+    struct StgCursor written = *cur;
+    int err = bsXXcode(cur, size, position, bmpS, bEncodeFast);
+    if (!err)
+        cacheWrite(&bmpS->cache, position, size, &written);
+    return err;
+}
+
+// absorbed blocks are acknowledged right away, the rest is written through in runs
+static int bsEncodeBack(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS) {
+    struct BlockCache *cache = &bmpS->cache;
+    struct WriteBack *wb = &bmpS->wb;
+    struct StgCursor runCur;
+    loff_t runPos = 0;
+    ulong runSize = 0;
+    int err = 0;
+
+    if (position + size > bmpS->totalVirtualSize) {
+        printError("access out of range\n");
+        return -ENOSPC;
+    }
+
+    // flusher is woken at half of the limit, writers wait for it at the limit
+    if (READ_ONCE(cache->nrDirty) >= cache->maxDirty / 2) {
+        WRITE_ONCE(wb->kicked, true);
+        wake_up(&wb->wait);
+        wait_event(cache->dirtyWait, READ_ONCE(cache->nrDirty) < cache->maxDirty);
+    }
+
+    while (size > 0) {
+        pgoff_t idx = position >> CACHE_BLOCK_SHIFT;
+        uint offset = position & (CACHE_BLOCK_SIZE - 1);
+        ulong len = min(size, (ulong) CACHE_BLOCK_SIZE - offset);
+
+        if (cacheWriteBack(cache, idx, offset, len, cur)) {
+            if (runSize && (err = bsEncodeRun(&runCur, runSize, runPos, bmpS)))
+                return err;
+            runSize = 0;
+        } else {
+            if (runSize == 0) {
+                runCur = *cur;
+                runPos = position;
+            }
+            cursorSkip(cur, len);
+            runSize += len;
+        }
+
+        position += len;
+        size -= len;
+    }
+
+    if (runSize)
+        err = bsEncodeRun(&runCur, runSize, runPos, bmpS);
+    return err;
+}
+
+int bsEncode(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS) {
+    struct StgCursor written = *cur;
+    int err;
+
+    if (( err = bsMarkWritten(size, position, bmpS) )) return err;
+
+    if (bmpS->wb.thread)
+        return bsEncodeBack(cur, size, position, bmpS);
+
+    err = bsXXcode(cur, size, position, bmpS, bEncodeFast);
+    if (!err && bmpS->cache.maxBlocks)
+        cacheWrite(&bmpS->cache, position, size, &written);
+    return err;
+}
+
+// whole extents are only marked unwritten, the ends of others are cleared in carriers unless they read as zeros already
+// cached copies are cleared as well
+int bsZero(ulong size, loff_t position, struct BmpStorage *bmpS) {
+    struct ExtentMap *map = &bmpS->extents;
+    loff_t start, end;
+    int err = 0;
+
+    extentsWhole(map, position, size, &start, &end);
+    if (start > position && !extentsUnwritten(map, position, start - position))
+        err = bsZeroCarriers(start - position, position, bmpS);
+    if (!err && end < position + size && !extentsUnwritten(map, end, position + size - end))
+        err = bsZeroCarriers(position + size - end, end, bmpS);
+    if (err || end <= start) return err;
+
+    extentsClear(map, start, end - start);
+    if (bmpS->cache.maxBlocks)
+        cacheZero(&bmpS->cache, start, end - start);
+    return 0;
+}
+
+// discarded whole extents read as zeros until they are written again, the rest keeps its data
+int bsDiscard(ulong size, loff_t position, struct BmpStorage *bmpS) {
+    loff_t start, end;
+
+    extentsWhole(&bmpS->extents, position, size, &start, &end);
+    if (end <= start) return 0;
+
+    extentsClear(&bmpS->extents, start, end - start);
+    if (bmpS->cache.maxBlocks)
+        cacheZero(&bmpS->cache, start, end - start);
+    return 0;
+}
+
+//// write-back
+
+// writes dirty blocks back in index order, runs of adjacent blocks are encoded in one pass
+static int writeBackDirty(struct BmpStorage *bmpS) {
+    struct CacheBlock *blocks[CACHE_RUN_BLOCKS];
+    struct bio_vec bvecs[CACHE_RUN_BLOCKS];
+    pgoff_t next = 0;
+    uint nrBlocks;
+    int err = 0;
+
+    mutex_lock(&bmpS->wb.lock);
+    while (( nrBlocks = cacheTakeDirty(&bmpS->cache, &next, blocks, CACHE_RUN_BLOCKS) )) {
+        struct bio bio; // only a container for the cursor, it's never submitted
+        struct StgCursor cur;
+        int runErr;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,18,0)
+        bio_init(&bio, NULL, bvecs, CACHE_RUN_BLOCKS, REQ_OP_WRITE);
+#else
+        bio_init(&bio, bvecs, CACHE_RUN_BLOCKS);
+#endif
+        for (uint i = 0; i < nrBlocks; i++)
+            __bio_add_page(&bio, virt_to_page(blocks[i]->data), CACHE_BLOCK_SIZE, 0);
+        cursorInit(&cur, &bio);
+
+        runErr = bsXXcode(&cur, (ulong) nrBlocks << CACHE_BLOCK_SHIFT, (loff_t) blocks[0]->idx << CACHE_BLOCK_SHIFT, bmpS, bEncodeFast);
+        cacheFlushDone(&bmpS->cache, blocks, nrBlocks, !runErr);
+        bio_uninit(&bio);
+        if (runErr) {
+            printError("failed to write back %u blocks at %lu (error %d)\n", nrBlocks, blocks[0]->idx, runErr);
+            err = runErr;
+        }
+    }
+    mutex_unlock(&bmpS->wb.lock);
+    return err;
+}
+
+static int writeBackThread(void *data) {
+    struct BmpStorage *bmpS = data;
+    struct WriteBack *wb = &bmpS->wb;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(wb->wait, READ_ONCE(wb->kicked) || kthread_should_stop(), wb->expire);
+        WRITE_ONCE(wb->kicked, false);
+        writeBackDirty(bmpS);
+    }
+    return 0;
+}
+
+// dirty blocks are kept in the cache, so at least half of it stays for reads
+int bsStartWriteBack(struct BmpStorage *bmpS, ulong dirtyBytes, uint expireMs, const char *name) {
+    struct WriteBack *wb = &bmpS->wb;
+    struct BlockCache *cache = &bmpS->cache;
+
+    wb->thread = NULL;
+    cache->maxDirty = min(dirtyBytes >> CACHE_BLOCK_SHIFT, cache->maxBlocks / 2);
+    if (cache->maxDirty == 0) return 0;
+
+    init_waitqueue_head(&wb->wait);
+    mutex_init(&wb->lock);
+    wb->kicked = false;
+    wb->expire = max(msecs_to_jiffies(expireMs), 1UL);
+    wb->thread = kthread_run(writeBackThread, bmpS, "%s-wb", name);
+    if (IS_ERR(wb->thread)) {
+        int err = PTR_ERR(wb->thread);
+        wb->thread = NULL;
+        cache->maxDirty = 0;
+        return err;
+    }
+
+    printInfo("write-back: up to %lu dirty blocks (%lu KiB) for %u ms\n", cache->maxDirty, cache->maxDirty * CACHE_BLOCK_SIZE / 1024, expireMs);
+    return 0;
+}
+
+// stops the flusher and writes back what's left, device must be idle
+void bsStopWriteBack(struct BmpStorage *bmpS) {
+    if (bmpS->wb.thread == NULL) return;
+
+    kthread_stop(bmpS->wb.thread);
+    if (bsFlush(bmpS))
+        printError("failed to write back dirty blocks, data is lost\n");
+    bmpS->wb.thread = NULL;
+    bmpS->cache.maxDirty = 0;
+}
+
+// drains dirty blocks and carriers' page cache, written extents follow the data they describe
+int bsFlush(struct BmpStorage *bmpS) {
+    int err = 0, syncErr;
+
+    if (bmpS->wb.thread)
+        err = writeBackDirty(bmpS);
+    // written through data may still be in page cache of carriers, only written ones are synced
+    for (uint idx = 0; idx < bmpS->count; idx++) {
+        if (!test_and_clear_bit(idx, bmpS->unsynced)) continue;
+        syncErr = vfs_fsync(bmpS->bmps[idx]->fd, 1);
+        if (syncErr) set_bit(idx, bmpS->unsynced);
+        if (syncErr && !err) err = syncErr;
+    }
+    // bits of written extents are only made durable after the data they stand for
+    syncErr = extentsSync(&bmpS->extents, true);
+    if (syncErr && !err) err = syncErr;
+    return err;
+}
+
+//// folder
+
+// the folder is looked up in the context of the caller of add, workers would see the root and mounts of init
+int bsLookupFolder(struct BmpStorage *bmpS) {
+    int err = kern_path(bmpS->backingPath, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, &bmpS->folder);
+    if (err) {
+        printError("failed to look up folder %s (error %d)\n", bmpS->backingPath, err);
+        return err;
+    }
+    bmpS->cred = get_current_cred();
+    return 0;
+}
+
+void bsPutFolder(struct BmpStorage *bmpS) {
+    if (bmpS->cred == NULL) return;
+    path_put(&bmpS->folder);
+    put_cred(bmpS->cred);
+    bmpS->cred = NULL;
+}
+
+// files of the folder are checked against the credentials of the caller of add, not of the worker
+static struct file *openFolderFile(struct BmpStorage *bmpS, const char *name, int flags) {
+    const struct cred *old = override_creds(bmpS->cred);
+    struct file *fd = file_open_root(&bmpS->folder, name, flags, 0);
+    revert_creds(old);
+    return fd;
+}
+
+//// probing
+
+// file of the folder, opened and its header parsed on a probe worker
+struct BmpProbe {
+    struct list_head list; // directory order, results are checked and printed in it
+    struct work_struct work;
+    struct BmpStorage *bmpS;
+    struct Bmp *bmp; // NULL once placed in the storage
+    uint16 count;    // files of the storage, as reported by the header
+    bool isBmp;
+    bool known;      // header comes from the manifest and isn't read
+    bool stale;      // file doesn't match its manifest entry
+    ulong fileSize;  // of the manifest entry
+    u64 ino;
+    u64 mtime;
+    int err;
+    char name[];
+};
+
+struct BmpProbes {
+    struct BmpStorage *bmpS;
+    struct workqueue_struct *wq;
+    struct list_head list;
+    int err;
+};
+
+// whole header is read at once, fields are little endian at fixed offsets
+static bool parseBmpHeader(struct Bmp *bmp, const uint8 *header, uint16 *count) {
+    if (header[0] != 'B' || header[1] != 'M') return false;
+
+    bmp->depth = get_unaligned_le16(header + 28);
+    bmp->width = get_unaligned_le32(header + 18);
+    bmp->height = get_unaligned_le32(header + 22);
+    bmp->headerSize = get_unaligned_le32(header + 10);
+    bmp->idx = get_unaligned_le16(header + BMP_IDX_OFFSET);
+    *count = get_unaligned_le16(header + BMP_COUNT_OFFSET);
 
     // row size
-    bmp->rowSize = bmp->width * COLORS_PER_PIXEL;
+    bmp->rowSize = bmp->width * (bmp->depth / 8);
     bmp->padding = (4 - (bmp->rowSize % 4)) % 4;
     bmp->rowSize += bmp->padding;
-    // printInfo("row size: %d B, row padding: %d B\n", bmp->rowSize, bmp->padding);
 
-    // capacity
-    bmp->virtualSize = bmp->width * bmp->height * COLORS_PER_PIXEL * USED_BITS_PER_PIXEL / 8;
-    printInfo("virtual size: %lu.%.2lu MiB\n", bmp->virtualSize / 1024 / 1024, (100 * bmp->virtualSize / 1024 / 1024) % 100);
+    // embedding density
+    bmp->bits = header[BMP_LAYOUT_OFFSET];
+    bmp->channels = header[BMP_LAYOUT_OFFSET + 1];
+    if (bmp->bits == 0 && bmp->channels == 0) { // initialized before density was configurable
+        bmp->bits = DEFAULT_BITS_PER_COLOR;
+        bmp->channels = DEFAULT_CHANNELS;
+    }
+    bmp->stripeShift = header[BMP_STRIPE_OFFSET];
+    return true;
+}
+
+// replaced carriers have another inode or size, carriers written since the manifest have their header compared
+static bool knownCarrierMatches(struct BmpProbe *probe) {
+    struct Bmp *bmp = probe->bmp;
+    struct Bmp parsed = *bmp;
+    uint8 header[BMP_HEADER_SIZE];
+    struct kstat stat;
+    loff_t pos = 0;
+    uint16 count;
 
-    // header size
-    bRead((uint8 *) &bmp->headerSize, 4, 10, bmp);
-    // printInfo("header size: %d B\n", bmp->headerSize);
+    if (vfs_getattr(&bmp->fd->f_path, &stat, STATX_INO | STATX_MTIME, AT_STATX_SYNC_AS_STAT)) return false;
+    if (stat.ino != probe->ino || bmp->size != probe->fileSize) return false;
+    if (timespec64_to_ns(&stat.mtime) == probe->mtime) return true;
 
-    // idx of the file
-    bRead((uint8 *) &bmp->idx, 2, BMP_IDX_OFFSET, bmp);
+    if (bmp->size < BMP_HEADER_SIZE || kernel_read(bmp->fd, header, BMP_HEADER_SIZE, &pos) != BMP_HEADER_SIZE) return false;
+    if (!parseBmpHeader(&parsed, header, &count)) return false;
+    return parsed.idx == bmp->idx && parsed.depth == bmp->depth && parsed.width == bmp->width && parsed.height == bmp->height &&
+           parsed.headerSize == bmp->headerSize && count == probe->count && parsed.bits == bmp->bits &&
+           parsed.channels == bmp->channels && parsed.stripeShift == bmp->stripeShift;
 }
 
-int handleFile(void* data, const char *name, int namlen, loff_t offset, u64 ino, uint d_type) {
-    struct BmpStorage *bmpS = (struct BmpStorage *) data;
-    struct Bmp *bmp;
-    char* fullPath;
-    uint16 bmpsCountReported;
-    int err;
+// the same file is opened again for writes, one replaced in between isn't taken
+static int reopenWritable(struct BmpProbe *probe) {
+    struct Bmp *bmp = probe->bmp;
+    struct file *fd = openFolderFile(probe->bmpS, probe->name, O_RDWR);
 
-    if (d_type != DT_REG) return 0;
+    if (IS_ERR(fd)) return PTR_ERR(fd);
+    if (file_inode(fd) != file_inode(bmp->fd)) {
+        filp_close(fd, NULL);
+        return -ESTALE;
+    }
+    filp_close(bmp->fd, NULL);
+    bmp->fd = fd;
+    return 0;
+}
+
+// files are only read until their header shows they belong to a storage
+static void probeWork(struct work_struct *work) {
+    struct BmpProbe *probe = container_of(work, struct BmpProbe, work);
+    struct BmpStorage *bmpS = probe->bmpS;
+    struct Bmp *bmp = probe->bmp;
+    uint8 header[BMP_HEADER_SIZE];
+    loff_t pos = 0;
+
+    bmp->fd = openFolderFile(bmpS, probe->name, O_RDONLY);
+    if (IS_ERR_OR_NULL(bmp->fd)) {
+        probe->err = bmp->fd ? PTR_ERR(bmp->fd) : -ENOENT;
+        probe->stale = probe->known && probe->err == -ENOENT;
+        bmp->fd = NULL;
+        return;
+    }
+    bmp->size = i_size_read(file_inode(bmp->fd));
+
+    if (probe->known) {
+        probe->stale = !knownCarrierMatches(probe);
+        if (probe->stale) return;
+    } else {
+        if (bmp->size < BMP_HEADER_SIZE) return;
+        if (kernel_read(bmp->fd, header, BMP_HEADER_SIZE, &pos) != BMP_HEADER_SIZE) return;
+        probe->isBmp = parseBmpHeader(bmp, header, &probe->count);
+        // bmps that weren't initialized report no count and are skipped
+        if (!probe->isBmp || probe->count == 0) return;
+    }
 
-    printInfo("===> %.*s\n", namlen, name);
-    bmp = kzalloc(sizeof(struct Bmp), GFP_KERNEL);
-    if (bmp == NULL) {
+    if (!bmpS->readOnly && (probe->err = reopenWritable(probe))) {
+        probe->stale = probe->known && probe->err == -ESTALE;
+        return;
+    }
+    if (bmpS->zeroCopy)
+        bmp->zeroCopy = carrierZeroCopy(bmp);
+    // headers are still read through page cache, only carrier chunks use direct I/O
+    if (bmpS->directIo && !bmp->zeroCopy)
+        bmp->dioAlign = carrierDioAlign(bmp);
+}
+
+static struct BmpProbe *queueProbe(struct BmpProbes *probes, const char *name, int namlen) {
+    struct BmpProbe *probe = kzalloc(struct_size(probe, name, namlen + 1), GFP_KERNEL);
+    if (probe != NULL) probe->bmp = kzalloc(sizeof(struct Bmp), GFP_KERNEL);
+    if (probe == NULL || probe->bmp == NULL) {
         printError("failed to allocate bmp struct\n");
-        return -ENOMEM;
+        kfree(probe);
+        probes->err = -ENOMEM;
+        return NULL;
     }
-    bmp->pnext = NULL;
+    memcpy(probe->name, name, namlen);
+    probe->bmpS = probes->bmpS;
+    INIT_WORK(&probe->work, probeWork);
+    list_add_tail(&probe->list, &probes->list);
+    return probe;
+}
 
-    fullPath = kzalloc(strlen(bmpS->backingPath) + 1 + namlen + 1, GFP_KERNEL);
-    if (fullPath == NULL) {
-        printError("failed to allocate fullPath string\n");
-        err = -ENOMEM;
-        goto FREE_BMP;
+// only collects files, probes run while the rest of the directory is read
+static int collectFile(void* data, const char *name, int namlen, loff_t offset, u64 ino, uint d_type) {
+    struct BmpProbes *probes = (struct BmpProbes *) data;
+    struct BmpProbe *probe;
+
+    if (d_type != DT_REG) return 0;
+
+    probe = queueProbe(probes, name, namlen);
+    if (probe == NULL) return -ENOMEM;
+    queue_work(probes->wq, &probe->work);
+    return 0;
+}
+
+static void freeProbe(struct BmpProbe *probe) {
+    if (probe->bmp != NULL) {
+        if (probe->bmp->fd) filp_close(probe->bmp->fd, NULL);
+        kfree(probe->bmp);
     }
-    strcpy(fullPath, bmpS->backingPath);
-    strcat(fullPath, "/");
-    strncat(fullPath, name, namlen);
-    bmp->fd = filp_open(fullPath, O_RDWR, 0644);
-    kfree(fullPath);
-    if (IS_ERR_OR_NULL(bmp->fd)) {
+    kfree(probe);
+}
+
+void setBmpCapacity(struct Bmp *bmp) {
+    bmp->virtualSize = carrierCapacity(bmp->layout, bmp->width, bmp->height, bmp->rowGroups);
+    printInfo("virtual size: %lu.%.2lu MiB\n", bmp->virtualSize / 1024 / 1024, (100 * bmp->virtualSize / 1024 / 1024) % 100);
+}
+
+// checks a probed file against the storage and takes its bmp, files that aren't carriers are skipped
+static int placeBmp(struct BmpStorage *bmpS, struct BmpProbe *probe) {
+    struct Bmp *bmp = probe->bmp;
+    uint16 bmpsCountReported = probe->count;
+
+    printInfo("===> %s\n", probe->name);
+    if (probe->err) {
         printError("failed to open file\n");
-        err = PTR_ERR(bmp->fd);
-        goto FREE_BMP;
+        return probe->err;
     }
-    bmp->size = bmp->fd->f_inode->i_size;
     printInfo("file size: %ld.%.2ld MiB\n", bmp->size / 1024 / 1024, (100 * bmp->size / 1024 / 1024) % 100);
 
-    if (!isFileBmp(bmp)) {
+    if (!probe->isBmp) {
         printInfo("not a bmp, this file will be skipped\n");
-        goto CLOSE_FILE; // continue
+        return 0; // continue
     }
 
-    if (getBmpColorDepth(bmp) != 32) {
-        printInfo("only 32-bit ARGB bitmaps are supported, this file will be skipped\n");
-        goto CLOSE_FILE; // continue
+    if (bmpS->zeroCopy && !bmp->zeroCopy)
+        printInfo("backing filesystem has no page cache to code in, falling back to bounce buffers\n");
+    if (bmpS->directIo && !bmp->zeroCopy && bmp->dioAlign == 0)
+        printInfo("backing filesystem doesn't support direct I/O, falling back to buffered\n");
+    bmp->stats = bmpS->stats;
+
+    if (bmp->depth != 24 && bmp->depth != 32) {
+        printInfo("only 24-bit RGB and 32-bit ARGB bitmaps are supported, this file will be skipped\n");
+        return 0; // continue
     }
 
-    fillBmpStruct(bmp);
-    
-    bRead((uint8 *) &bmpsCountReported, 2, BMP_COUNT_OFFSET, bmp);
     printInfo("fileno: %d / %d\n", bmp->idx + 1, bmpsCountReported);
     if (bmpsCountReported == 0) {
         printError("file is not a part of a bmp storage\n");
         if (bmpS->bmps == NULL) {
             printError("you need to initialize this folder with helper program\n");
         }
-        err = 0; // continue
-        goto CLOSE_FILE;
+        return 0; // continue
     }
 
-    bmp->virtualOffset = bmpS->totalVirtualSize;
-    bmpS->totalVirtualSize += bmp->virtualSize;
-
-    // add to list
     if (bmpS->bmps == NULL) {
-        bmpS->bmps = bmp;
+        if (layoutInit(&bmpS->layout, bmp->bits, bmp->channels)) {
+            printError("unsupported density: %d bits of colors 0x%x\n", bmp->bits, bmp->channels);
+            return -EINVAL;
+        }
+        printInfo("density: %d bits of colors 0x%x, %d B in %d pixels\n", bmpS->layout.bits, bmpS->layout.channels, bmpS->layout.groupBytes, bmpS->layout.groupPixels);
+        layoutInit(&bmpS->packedLayout, bmp->bits, 0xf);
+        if (bmp->stripeShift && (bmp->stripeShift < STRIPE_MIN_SHIFT || bmp->stripeShift > STRIPE_MAX_SHIFT)) {
+            printError("unsupported stripe of 2^%d B\n", bmp->stripeShift);
+            return -EINVAL;
+        }
+        bmpS->stripeShift = bmp->stripeShift;
+
+        bmpS->bmps = kvcalloc(bmpsCountReported, sizeof(struct Bmp *), GFP_KERNEL);
+        if (bmpS->bmps == NULL) {
+            printError("failed to allocate bmps array\n");
+            return -ENOMEM;
+        }
         bmpS->count = bmpsCountReported;
-    } else {
-        struct Bmp *bmpPrev = NULL;
-        struct Bmp *bmpCurr = bmpS->bmps;
-
-        if (bmpsCountReported != bmpS->count) {
-            printError("file count mismatch, different files have reported different count\n");
-            printError("this file belongs to other or none bmp storage");
-            err = -EINVAL;
-            goto CLOSE_FILE;
+    } else if (bmpsCountReported != bmpS->count) {
+        printError("file count mismatch, different files have reported different count\n");
+        printError("this file belongs to other or none bmp storage");
+        return -EINVAL;
+    } else if (bmp->bits != bmpS->layout.bits || bmp->channels != bmpS->layout.channels) {
+        printError("density mismatch, different files have reported different density\n");
+        return -EINVAL;
+    } else if (bmp->stripeShift != bmpS->stripeShift) {
+        printError("stripe mismatch, different files have reported different stripes\n");
+        return -EINVAL;
+    }
+
+    // carriers are indexed by idx, offsets are assigned once all of them are known
+    if (bmp->idx >= bmpS->count || bmpS->bmps[bmp->idx] != NULL) {
+        printError("file idx %d is out of range or duplicated\n", bmp->idx);
+        return -EINVAL;
+    }
+
+    // 24-bit pixels have no alpha, every color carries data
+    bmp->layout = &bmpS->layout;
+    if (bmp->depth == 24) {
+        if ((bmpS->layout.channels & 0x7) != 0x7) {
+            printError("24-bit bmps need density using all of red, green and blue\n");
+            return -EINVAL;
+        }
+        bmp->layout = &bmpS->packedLayout;
+        bmp->rowGroups = carrierRowGroups(bmp->layout, bmp->depth, bmp->width);
+        if (bmp->rowGroups == 0) {
+            printError("bmp %d is too narrow to hold a group in a row\n", bmp->idx);
+            return -EINVAL;
         }
+    }
+    setBmpCapacity(bmp);
+    bmpS->totalVirtualSize += bmp->virtualSize;
+    bmpS->bmps[bmp->idx] = bmp;
+    probe->bmp = NULL;
+    return 0;
+}
 
-        // add to the correct place based on idx
-        while (bmpCurr != NULL && bmpCurr->idx < bmp->idx) {
-            bmpPrev = bmpCurr;
-            bmpCurr = bmpCurr->pnext;
+//// manifest
+
+static int folderMtime(struct BmpStorage *bmpS, u64 *mtime) {
+    struct kstat stat;
+    int err = vfs_getattr(&bmpS->folder, &stat, STATX_MTIME, AT_STATX_SYNC_AS_STAT);
+    if (!err) *mtime = timespec64_to_ns(&stat.mtime);
+    return err;
+}
+
+static int readManifestFile(struct BmpStorage *bmpS, uint8 **buf, ulong *size) {
+    struct file *fd;
+    loff_t pos = 0;
+    int err = 0;
+
+    fd = openFolderFile(bmpS, MANIFEST_NAME, O_RDONLY);
+    if (IS_ERR(fd)) return PTR_ERR(fd);
+
+    *size = i_size_read(file_inode(fd));
+    if (*size < sizeof(struct StgManifestHeader) || *size > MANIFEST_MAX_SIZE) {
+        err = -ESTALE;
+        goto closeFile;
+    }
+    *buf = kvmalloc(*size, GFP_KERNEL);
+    if (*buf == NULL) {
+        err = -ENOMEM;
+        goto closeFile;
+    }
+    while (pos < *size) {
+        ssize_t ret = kernel_read(fd, *buf + pos, *size - pos, &pos);
+        if (ret <= 0) {
+            err = ret < 0 ? ret : -ESTALE;
+            kvfree(*buf);
+            break;
         }
-        if (bmpPrev == NULL) {
-            bmp->pnext = bmpS->bmps;
-            bmpS->bmps = bmp;
-        } else {
-            bmp->pnext = bmpCurr;
-            bmpPrev->pnext = bmp;
+    }
+
+closeFile:
+    filp_close(fd, NULL);
+    return err;
+}
+
+// queues a probe for every carrier of a valid manifest, headers of known carriers aren't read
+// -ENOENT means there's no manifest and -ESTALE that it doesn't match the folder, both fall back to a scan
+static int readManifest(struct BmpProbes *probes) {
+    struct BmpStorage *bmpS = probes->bmpS;
+    struct StgManifestHeader *header;
+    struct StgLayout layout, packedLayout;
+    uint8 *buf;
+    ulong size, pos;
+    u64 checksum, mtime;
+    int err;
+
+    if (( err = readManifestFile(bmpS, &buf, &size) )) return err;
+    header = (struct StgManifestHeader *) buf;
+
+    err = -ESTALE;
+    if (header->magic != MANIFEST_MAGIC || header->version != MANIFEST_VERSION || header->size != size || header->count == 0) goto freeBuf;
+    checksum = header->checksum;
+    header->checksum = 0;
+    if (manifestChecksum(MANIFEST_CHECKSUM_INIT, buf, size) != checksum) goto freeBuf;
+    if (folderMtime(bmpS, &mtime) || mtime != header->folderMtime) goto freeBuf;
+    // density is checked against every carrier once they are placed
+    if (layoutInit(&layout, header->bits, header->channels)) goto freeBuf;
+    layoutInit(&packedLayout, header->bits, 0xf);
+
+    pos = sizeof(struct StgManifestHeader);
+    for (uint i = 0; i < header->count; i++) {
+        struct StgManifestEntry *entry = (struct StgManifestEntry *) (buf + pos);
+        struct BmpProbe *probe;
+        struct Bmp *bmp;
+
+        if (pos + sizeof(struct StgManifestEntry) > size) goto freeBuf;
+        pos += sizeof(struct StgManifestEntry);
+        if (entry->nameLen == 0 || entry->nameLen > MANIFEST_NAME_MAX || pos + entry->nameLen > size) goto freeBuf;
+        if (memchr(buf + pos, '/', entry->nameLen) || memchr(buf + pos, 0, entry->nameLen)) goto freeBuf;
+        if (entry->virtualSize != carrierCapacity(entry->depth == 24 ? &packedLayout : &layout, entry->width, entry->height,
+                                                  carrierRowGroups(&packedLayout, entry->depth, entry->width))) goto freeBuf;
+
+        probe = queueProbe(probes, (const char *) buf + pos, entry->nameLen);
+        if (probe == NULL) {
+            err = -ENOMEM;
+            goto freeBuf;
         }
+        pos += entry->nameLen;
+
+        probe->known = probe->isBmp = true;
+        probe->fileSize = entry->fileSize;
+        probe->ino = entry->ino;
+        probe->mtime = entry->mtime;
+        probe->count = header->count;
+        bmp = probe->bmp;
+        bmp->idx = entry->idx;
+        bmp->depth = entry->depth;
+        bmp->width = entry->width;
+        bmp->height = entry->height;
+        bmp->headerSize = entry->headerSize;
+        bmp->rowSize = round_up(bmp->width * (bmp->depth / 8), 4);
+        bmp->padding = bmp->rowSize - bmp->width * (bmp->depth / 8);
+        bmp->bits = header->bits;
+        bmp->channels = header->channels;
+        bmp->stripeShift = header->stripeShift;
     }
+    if (pos != size) goto freeBuf;
 
-    return 0;
+    printInfo("manifest of generation %llu lists %d bmps\n", header->generation, header->count);
+    err = 0;
 
-CLOSE_FILE:
-    filp_close(bmp->fd, NULL);
-    bmp->fd = NULL;
-FREE_BMP:
-    kfree(bmp);
-    if (err) bmpS->totalVirtualSize = bmpS->count = 0;
+freeBuf:
+    kvfree(buf);
+    return err;
+}
+
+//// open
+
+// files are opened and their headers read in parallel, then checked one by one in directory or manifest order
+static int runProbes(struct BmpStorage *bmpS, bool manifest) {
+    struct BmpProbes probes = { .bmpS = bmpS };
+    struct BmpProbe *probe, *next;
+    int err;
+
+    INIT_LIST_HEAD(&probes.list);
+    probes.wq = alloc_workqueue("stg_probe", WQ_UNBOUND, PROBE_MAX_ACTIVE);
+    if (probes.wq == NULL) {
+        printError("failed to allocate probe workqueue\n");
+        return -ENOMEM;
+    }
+    if (manifest) {
+        // carriers are only opened once the whole manifest is known to be valid
+        err = readManifest(&probes);
+        if (!err) {
+            list_for_each_entry(probe, &probes.list, list)
+                queue_work(probes.wq, &probe->work);
+        }
+    } else {
+        struct file *dir = openFolderFile(bmpS, ".", O_RDONLY | O_DIRECTORY);
+        err = IS_ERR(dir) ? PTR_ERR(dir) : readdir(dir, collectFile, &probes);
+        if (!IS_ERR(dir)) filp_close(dir, NULL);
+        if (!err) err = probes.err;
+        if (err) printError("failed to read directory %s\n", bmpS->backingPath);
+    }
+    // waits for every queued probe
+    destroy_workqueue(probes.wq);
+
+    if (manifest && !err) {
+        list_for_each_entry(probe, &probes.list, list) {
+            if (!probe->stale) continue;
+            printInfo("%s changed since the manifest was written\n", probe->name);
+            err = -ESTALE;
+            break;
+        }
+    }
+
+    list_for_each_entry_safe(probe, next, &probes.list, list) {
+        if (!err) err = placeBmp(bmpS, probe);
+        list_del(&probe->list);
+        freeProbe(probe);
+    }
     return err;
 }
 
+// carriers listed by the manifest are opened directly, the whole folder is scanned without a valid one
+static int probeBmps(struct BmpStorage *bmpS) {
+    int err = runProbes(bmpS, true);
+    if (err == -ENOENT) {
+        printInfo("no manifest, scanning the folder\n");
+    } else if (err == -ESTALE) {
+        printInfo("manifest is stale, scanning the folder\n");
+    } else {
+        return err;
+    }
+    return runProbes(bmpS, false);
+}
+
 int openBmps(struct BmpStorage *bmpS) {
     int err = 0;
-    uint idx = 0;
-    struct Bmp *bmp;
+    ulong virtualOffset = 0;
     
     bmpS->totalVirtualSize = bmpS->count = 0;
     bmpS->bmps = NULL;
-    if (( err = readdir(bmpS->backingPath, handleFile, (void*)bmpS) )) {
-        printError("failed to read directory %s\n", bmpS->backingPath);
+    bmpS->unsynced = NULL;
+    INIT_LIST_HEAD(&bmpS->splitPlans);
+    spin_lock_init(&bmpS->splitLock);
+    if (( err = probeBmps(bmpS) )) {
         closeBmps(bmpS);
         return err;
     }
@@ -296,35 +1834,65 @@ int openBmps(struct BmpStorage *bmpS) {
         return -EINVAL;
     }
 
-    bmp = bmpS->bmps;
-    while(bmp != NULL) {
-        if (bmp->idx != idx++) {
-            printError("failed to open all bmps, %d is missing\n", idx - 1);
+    bmpS->unsynced = bitmap_zalloc(bmpS->count, GFP_KERNEL);
+    if (bmpS->unsynced == NULL) {
+        printError("failed to allocate unsynced carriers bitmap\n");
+        closeBmps(bmpS);
+        return -ENOMEM;
+    }
+
+    for (uint idx = 0; idx < bmpS->count; idx++) {
+        struct Bmp *bmp = bmpS->bmps[idx];
+        if (bmp == NULL) {
+            printError("failed to open all bmps, %d is missing\n", idx);
             printError("there should be %d bmps in this folder\n", bmpS->count);
             closeBmps(bmpS);
             return -EINVAL;
         }
-        bmp = bmp->pnext;
+        bmp->unsynced = bmpS->unsynced;
+        bmp->virtualOffset = virtualOffset;
+        virtualOffset += bmp->virtualSize;
     }
-    if (idx != bmpS->count) {
-        printError("there should be %d bmps, but only %d were found\n", bmpS->count, idx);
-        closeBmps(bmpS);
-        return -EINVAL;
+
+    // every carrier holds the same number of whole chunks, the rest of bigger ones stays unused
+    if (bmpS->stripeShift) {
+        ulong stripeSize = ULONG_MAX;
+        for (uint idx = 0; idx < bmpS->count; idx++)
+            stripeSize = min(stripeSize, bmpS->bmps[idx]->virtualSize);
+        stripeSize = round_down(stripeSize, 1UL << bmpS->stripeShift);
+        if (stripeSize == 0) {
+            printError("the smallest bmp doesn't fit a single %lu KiB chunk\n", (1UL << bmpS->stripeShift) / 1024);
+            closeBmps(bmpS);
+            return -EINVAL;
+        }
+        for (uint idx = 0; idx < bmpS->count; idx++)
+            bmpS->bmps[idx]->virtualSize = stripeSize;
+        printInfo("striped in %lu KiB chunks, %lu of %lu B used\n", (1UL << bmpS->stripeShift) / 1024, stripeSize * bmpS->count, bmpS->totalVirtualSize);
+        bmpS->totalVirtualSize = stripeSize * bmpS->count;
     }
 
     printInfo("total virtual size: %lu.%.2lu MiB (%lu B)\n", bmpS->totalVirtualSize / 1024 / 1024, (100 * bmpS->totalVirtualSize / 1024 / 1024) % 100, bmpS->totalVirtualSize);
 
+    if (( err = extentsOpen(&bmpS->extents, openFolderFile(bmpS, EXTENTS_NAME, bmpS->readOnly ? O_RDONLY : O_RDWR), bmpS->totalVirtualSize) ) ||
+            ( err = allocSplitPlans(bmpS) ))
+        closeBmps(bmpS);
     return err;
 }
 
 void closeBmps(struct BmpStorage *bmpS) {
-    struct Bmp *bmp = bmpS->bmps;
-    struct Bmp *nextBmp;
-    while (bmp != NULL) {
-        if (bmp->fd) filp_close(bmp->fd, NULL);
+    if (bmpS->bmps == NULL) return;
+
+    freeSplitPlans(bmpS);
+    extentsClose(&bmpS->extents);
+    bitmap_free(bmpS->unsynced);
+    bmpS->unsynced = NULL;
 
-        nextBmp = bmp->pnext;
+    for (uint idx = 0; idx < bmpS->count; idx++) {
+        struct Bmp *bmp = bmpS->bmps[idx];
+        if (bmp == NULL) continue;
+        if (bmp->fd) filp_close(bmp->fd, NULL);
         kfree(bmp);
-        bmp = nextBmp;
     }
-}
\ No newline at end of file
+    kvfree(bmpS->bmps);
+    bmpS->bmps = NULL;
+}
@@ -1,10 +1,30 @@
 #include "definitions.h"
 #include "diriter.h"
+#include "cache.h"
+#include "extents.h"
+#include "codec.h"
+#include "stats.h"
 
+int initBounceBuffers(void);
+void freeBounceBuffers(void);
+int holdBounceBuffers(void);
+void releaseBounceBuffers(void);
+int initSplitWorkers(void);
+void freeSplitWorkers(void);
+
+int bsLookupFolder(struct BmpStorage *bmpS);
+void bsPutFolder(struct BmpStorage *bmpS);
 int openBmps(struct BmpStorage *bmpS);
 void closeBmps(struct BmpStorage *bmpS);
 
-typedef void(*xxcoder_t)(uint8 *, ulong, loff_t, struct Bmp *);
+typedef int(*xxcoder_t)(struct StgCursor *, ulong, loff_t, struct Bmp *, const struct StgLayout *);
+
+int bsEncode(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS);
+int bsDecode(struct StgCursor *cur, ulong size, loff_t position, struct BmpStorage *bmpS);
+int bsZero(ulong size, loff_t position, struct BmpStorage *bmpS);
+int bsDiscard(ulong size, loff_t position, struct BmpStorage *bmpS);
+ulong bsCarrierChunk(struct BmpStorage *bmpS, uint blockSize);
 
-int bsEncode(void *data, ulong size, loff_t position, struct BmpStorage *bmpS);
-int bsDecode(void *data, ulong size, loff_t position, struct BmpStorage *bmpS);
+int bsStartWriteBack(struct BmpStorage *bmpS, ulong dirtyBytes, uint expireMs, const char *name);
+void bsStopWriteBack(struct BmpStorage *bmpS);
+int bsFlush(struct BmpStorage *bmpS);
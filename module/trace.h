@@ -0,0 +1,139 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM stg_blkdev
+
+#if !defined(STG_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define STG_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/blk-mq.h>
+
+// static tracepoints, compiled to a patched out jump when disabled
+// perf list 'stg_blkdev:*'
+
+#define showOp(op) __print_symbolic(op,                 \
+    { REQ_OP_READ,          "read" },                   \
+    { REQ_OP_WRITE,         "write" },                  \
+    { REQ_OP_FLUSH,         "flush" },                  \
+    { REQ_OP_DISCARD,       "discard" },                \
+    { REQ_OP_WRITE_ZEROES,  "write_zeroes" })
+
+//// request lifecycle
+
+DECLARE_EVENT_CLASS(stg_request,
+    TP_PROTO(struct request *rq),
+    TP_ARGS(rq),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(sector_t, sector)
+        __field(unsigned int, bytes)
+        __field(unsigned int, op)
+        __field(int, tag)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = rq->q->disk ? disk_devt(rq->q->disk) : 0;
+        __entry->sector = blk_rq_pos(rq);
+        __entry->bytes = blk_rq_bytes(rq);
+        __entry->op = req_op(rq);
+        __entry->tag = rq->tag;
+    ),
+
+    TP_printk("%d,%d %s sector %llu bytes %u tag %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev), showOp(__entry->op),
+              (unsigned long long) __entry->sector, __entry->bytes, __entry->tag)
+);
+
+DEFINE_EVENT(stg_request, stg_queue_rq,
+    TP_PROTO(struct request *rq),
+    TP_ARGS(rq)
+);
+
+DEFINE_EVENT(stg_request, stg_worker_start,
+    TP_PROTO(struct request *rq),
+    TP_ARGS(rq)
+);
+
+DEFINE_EVENT(stg_request, stg_complete_rq,
+    TP_PROTO(struct request *rq),
+    TP_ARGS(rq)
+);
+
+//// carriers
+
+// part of a request served by one carrier, position is in its payload
+TRACE_EVENT(stg_carrier_span,
+    TP_PROTO(unsigned short idx, loff_t position, unsigned long size),
+    TP_ARGS(idx, position, size),
+
+    TP_STRUCT__entry(
+        __field(unsigned short, idx)
+        __field(loff_t, position)
+        __field(unsigned long, size)
+    ),
+
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->position = position;
+        __entry->size = size;
+    ),
+
+    TP_printk("carrier %u payload %lld + %lu", __entry->idx, __entry->position, __entry->size)
+);
+
+// carrier file I/O, position is in the file
+DECLARE_EVENT_CLASS(stg_carrier_io,
+    TP_PROTO(unsigned short idx, loff_t position, unsigned long size),
+    TP_ARGS(idx, position, size),
+
+    TP_STRUCT__entry(
+        __field(unsigned short, idx)
+        __field(loff_t, position)
+        __field(unsigned long, size)
+    ),
+
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->position = position;
+        __entry->size = size;
+    ),
+
+    TP_printk("carrier %u file %lld + %lu", __entry->idx, __entry->position, __entry->size)
+);
+
+DEFINE_EVENT(stg_carrier_io, stg_carrier_read,
+    TP_PROTO(unsigned short idx, loff_t position, unsigned long size),
+    TP_ARGS(idx, position, size)
+);
+
+DEFINE_EVENT(stg_carrier_io, stg_carrier_write,
+    TP_PROTO(unsigned short idx, loff_t position, unsigned long size),
+    TP_ARGS(idx, position, size)
+);
+
+TRACE_EVENT(stg_carrier_done,
+    TP_PROTO(unsigned short idx, loff_t position, long ret),
+    TP_ARGS(idx, position, ret),
+
+    TP_STRUCT__entry(
+        __field(unsigned short, idx)
+        __field(loff_t, position)
+        __field(long, ret)
+    ),
+
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->position = position;
+        __entry->ret = ret;
+    ),
+
+    TP_printk("carrier %u file %lld ret %ld", __entry->idx, __entry->position, __entry->ret)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>